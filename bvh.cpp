@@ -0,0 +1,883 @@
+/* File: bvh.cpp; Mode: C++; Tab-width: 3; Author: Simon Flannery;            */
+
+#include <vector>
+#include <algorithm>
+#include <functional>
+
+#include "bvh.h"
+#include "scheduler.h"
+
+/* Cost of one node visit relative to one primitive test. */
+#define BVH_TRAVERSAL_COST 1.0f
+#define BVH_MAX_SAH_DEPTH  48
+
+/* Runs of primitives at most this long are built as one serial task. */
+#define BVH_SUBTREE_SIZE 4096
+
+/* Nodes at least this large bin and partition across every thread. */
+#define BVH_PARALLEL_SPLIT_SIZE 262144
+
+/* Primitives per task when one node's work is shared out. */
+#define BVH_PARALLEL_GRAIN 16384
+
+/* Bits of each axis in a Morton code. */
+#define BVH_MORTON_BITS 10
+
+namespace
+{
+/* The binary tree the builder makes before it is collapsed. */
+   struct BinaryNode
+   {
+      AABox box;
+      uint32_t child[2]; /* Interior nodes only. */
+      uint32_t offset;   /* Leaf: first primitive. */
+      uint32_t count;    /* Number of primitives, zero for interior nodes. */
+   };
+
+   inline int GetBin(float c, float lo, float scale)
+   {
+      int bin = (int) ((c - lo) * scale);
+
+      return bin < BVH_NUM_BINS ? bin : BVH_NUM_BINS - 1;
+   }
+
+/* A primitive as the builder moves it about, so each pass over a run reads
+   the run in order rather than chasing indices. */
+   struct Reference
+   {
+      AABox box;
+      vector3f centroid;
+      uint32_t index;
+   };
+
+   struct Builder
+   {
+      Scheduler* scheduler;
+      BVH::Type type;
+      size_t max_leaf_size;
+      size_t max_sah_depth; /* Deeper runs are halved at their median. */
+      size_t depth;         /* Levels of the collapsed tree. */
+      std::vector<Reference> ref;
+      std::vector<uint32_t> code; /* Morton codes, kept in the order of ref. */
+      std::vector<BinaryNode> nodes;
+      std::vector<BVHNode> wide;
+
+      void ForEach(size_t count, const std::function<void (size_t)>& f);
+
+      void Grow();
+      void Recurse(std::vector<BinaryNode>& out, size_t node, uint32_t begin, uint32_t end, uint32_t level);
+      uint32_t Split(AABox& box, uint32_t begin, uint32_t end, uint32_t level, uint32_t& child_level);
+      uint32_t SplitSAH(const AABox& box, const AABox& centroid_box, uint32_t begin, uint32_t end, size_t depth);
+      uint32_t SplitLarge(AABox& box, uint32_t begin, uint32_t end, size_t depth);
+      uint32_t SplitMorton(uint32_t begin, uint32_t end, uint32_t level, uint32_t& child_level);
+      uint32_t Halve(uint32_t begin, uint32_t end, size_t axis, float extent);
+      int FindSplit(const AABox bin_box[BVH_NUM_BINS], const uint32_t bin_count[BVH_NUM_BINS], float& best_cost);
+      void SortMorton();
+      uint32_t Collapse(uint32_t node, size_t level);
+   };
+
+   void Builder::ForEach(size_t count, const std::function<void (size_t)>& f)
+   {
+      if (scheduler != NULL && count > 1)
+      {
+         scheduler->ParallelFor(count, [&f](size_t i, size_t) {   f(i);   });
+      }
+      else
+      {
+         for (size_t i = 0; i < count; ++i)
+         {
+            f(i);
+         }
+      }
+
+      return;
+   }
+
+/* Splits the top of the tree breadth first, a level at a time: the largest
+   nodes share their binning and partitioning across the threads, the rest of
+   the level takes a node per task. Below BVH_SUBTREE_SIZE each run becomes a
+   serial task of its own, and the subtrees are stitched in afterwards. The
+   sizes that decide all this are fixed, so the tree does not depend on the
+   number of threads. */
+   void Builder::Grow()
+   {
+      struct Task
+      {
+         uint32_t node, begin, end, level;
+      };
+
+      std::vector<Task> frontier, subtrees;
+      std::vector<uint32_t> interior;
+
+      frontier.push_back({0, 0, (uint32_t) ref.size(), type == BVH::Type::Morton ? 3 * BVH_MORTON_BITS : 0u});
+
+      while (frontier.empty() == false)
+      {
+         const size_t n = frontier.size();
+
+         std::vector<AABox> box(n);
+         std::vector<uint32_t> middle(n), child_level(n);
+
+         for (size_t k = 0; k < n; ++k)
+         {
+            const Task& t = frontier[k];
+
+            middle[k] = t.begin;
+            child_level[k] = t.level + 1;
+
+            if (type == BVH::Type::SAH && t.end - t.begin >= BVH_PARALLEL_SPLIT_SIZE)
+            {
+               middle[k] = SplitLarge(box[k], t.begin, t.end, t.level);
+            }
+         }
+
+         ForEach(n, [this, &frontier, &box, &middle, &child_level](size_t k)
+         {
+            const Task& t = frontier[k];
+            const uint32_t count = t.end - t.begin;
+
+            if (count > BVH_SUBTREE_SIZE && (type != BVH::Type::SAH || count < BVH_PARALLEL_SPLIT_SIZE))
+            {
+               middle[k] = Split(box[k], t.begin, t.end, t.level, child_level[k]);
+            }
+         });
+
+         std::vector<Task> next;
+
+         for (size_t k = 0; k < n; ++k)
+         {
+            const Task& t = frontier[k];
+
+            if (t.end - t.begin <= BVH_SUBTREE_SIZE || middle[k] == t.begin || middle[k] == t.end)
+            {
+               subtrees.push_back(t);
+
+               continue;
+            }
+
+            const uint32_t first = (uint32_t) nodes.size();
+
+            nodes[t.node].count = 0;
+            nodes[t.node].child[0] = first;
+            nodes[t.node].child[1] = first + 1;
+            nodes.push_back(BinaryNode());
+            nodes.push_back(BinaryNode());
+
+            interior.push_back(t.node);
+
+            next.push_back({first + 0, t.begin, middle[k], child_level[k]});
+            next.push_back({first + 1, middle[k], t.end, child_level[k]});
+         }
+
+         frontier.swap(next);
+      }
+
+      std::vector<std::vector<BinaryNode> > local(subtrees.size());
+
+      ForEach(subtrees.size(), [this, &subtrees, &local](size_t k)
+      {
+         const Task& t = subtrees[k];
+
+         local[k].reserve(2 * (t.end - t.begin) / max_leaf_size + 1);
+         local[k].push_back(BinaryNode());
+
+         Recurse(local[k], 0, t.begin, t.end, t.level);
+      });
+
+   /* A subtree's root takes the place of its task's node, the rest go on the end. */
+      for (size_t k = 0; k < subtrees.size(); ++k)
+      {
+         const uint32_t base = (uint32_t) nodes.size() - 1;
+
+         for (size_t i = 0; i < local[k].size(); ++i)
+         {
+            BinaryNode node = local[k][i];
+
+            if (node.count == 0)
+            {
+               node.child[0] = node.child[0] + base;
+               node.child[1] = node.child[1] + base;
+            }
+
+            if (i == 0)
+            {
+               nodes[subtrees[k].node] = node;
+            }
+            else
+            {
+               nodes.push_back(node);
+            }
+         }
+      }
+
+   /* Children were made after their parents, so this refits from the bottom up. */
+      for (size_t k = interior.size(); k > 0; --k)
+      {
+         BinaryNode& node = nodes[interior[k - 1]];
+
+         node.box = nodes[node.child[0]].box;
+         node.box.Expand(nodes[node.child[1]].box);
+      }
+
+      return;
+   }
+
+   void Builder::Recurse(std::vector<BinaryNode>& out, size_t node, uint32_t begin, uint32_t end, uint32_t level)
+   {
+      AABox box;
+      uint32_t child_level = level + 1;
+      uint32_t middle = Split(box, begin, end, level, child_level);
+
+      if (middle == begin || middle == end)
+      {
+         if (box.IsEmpty() != false)
+         {
+            for (uint32_t i = begin; i < end; ++i)
+            {
+               box.Expand(ref[i].box);
+            }
+         }
+
+         out[node].box    = box;
+         out[node].offset = begin;
+         out[node].count  = end - begin;
+
+         return;
+      }
+
+      out[node].count = 0;
+
+      for (size_t side = 0; side < 2; ++side)
+      {
+         const uint32_t child = (uint32_t) out.size();
+
+         out[node].child[side] = child;
+         out.push_back(BinaryNode());
+
+         Recurse(out, child, side == 0 ? begin : middle, side == 0 ? middle : end, child_level);
+      }
+
+   /* Morton splits never look at the boxes, so they are built on the way up. */
+      if (box.IsEmpty() != false)
+      {
+         box = out[out[node].child[0]].box;
+         box.Expand(out[out[node].child[1]].box);
+      }
+
+      out[node].box = box;
+
+      return;
+   }
+
+/* Chooses where to split a run. SAH fills in the run's box; Morton leaves it
+   for the caller to build from the children. */
+   uint32_t Builder::Split(AABox& box, uint32_t begin, uint32_t end, uint32_t level, uint32_t& child_level)
+   {
+      if (type == BVH::Type::Morton)
+      {
+         return SplitMorton(begin, end, level, child_level);
+      }
+
+      AABox centroid_box;
+
+      for (uint32_t i = begin; i < end; ++i)
+      {
+         box.Expand(ref[i].box);
+         centroid_box.Expand(ref[i].centroid);
+      }
+
+      child_level = level + 1;
+
+      return (end - begin) > max_leaf_size ? SplitSAH(box, centroid_box, begin, end, level) : begin;
+   }
+
+   uint32_t Builder::SplitSAH(const AABox& box, const AABox& centroid_box, uint32_t begin, uint32_t end, size_t depth)
+   {
+      const uint32_t count = end - begin;
+
+      size_t axis = centroid_box.GetLongestAxis();
+
+      const float lo = centroid_box.vmin[axis];
+      const float extent = centroid_box.vmax[axis] - lo;
+
+      if (extent <= 0.0f || depth >= max_sah_depth)
+      {
+         return Halve(begin, end, axis, extent);
+      }
+
+      AABox bin_box[BVH_NUM_BINS];
+      uint32_t bin_count[BVH_NUM_BINS] = {0};
+
+      const float scale = BVH_NUM_BINS / extent;
+
+      for (uint32_t i = begin; i < end; ++i)
+      {
+         int bin = GetBin(ref[i].centroid[axis], lo, scale);
+
+         bin_box[bin].Expand(ref[i].box);
+         ++bin_count[bin];
+      }
+
+      float best_cost = FLT_MAX;
+      int best_split = FindSplit(bin_box, bin_count, best_cost);
+
+      const float area = box.GetSurfaceArea();
+      const float leaf_cost = (float) count;
+
+      if (best_split < 0)
+      {
+         return begin;
+      }
+
+      if (area > 0.0f && BVH_TRAVERSAL_COST + best_cost / area >= leaf_cost && count <= max_leaf_size * 4)
+      {
+         return begin; /* Splitting would not pay for itself. */
+      }
+
+      Reference* first = &ref[0] + begin;
+      Reference* last  = &ref[0] + end;
+
+      Reference* middle = std::partition(first, last, [axis, lo, scale, best_split](const Reference& r)
+      {
+         return GetBin(r.centroid[axis], lo, scale) <= best_split;
+      });
+
+      return (uint32_t) (middle - &ref[0]);
+   }
+
+/* The same split as SplitSAH, with the bounds, the bins and a stable
+   partition each shared out across the threads in fixed size chunks. */
+   uint32_t Builder::SplitLarge(AABox& box, uint32_t begin, uint32_t end, size_t depth)
+   {
+      const uint32_t count = end - begin;
+      const size_t chunks = (count + BVH_PARALLEL_GRAIN - 1) / BVH_PARALLEL_GRAIN;
+
+      std::vector<AABox> chunk_box(chunks), chunk_centroid(chunks);
+
+      ForEach(chunks, [this, begin, end, &chunk_box, &chunk_centroid](size_t c)
+      {
+         const uint32_t first = begin + (uint32_t) (c * BVH_PARALLEL_GRAIN);
+         const uint32_t last  = first + BVH_PARALLEL_GRAIN < end ? first + BVH_PARALLEL_GRAIN : end;
+
+         for (uint32_t i = first; i < last; ++i)
+         {
+            chunk_box[c].Expand(ref[i].box);
+            chunk_centroid[c].Expand(ref[i].centroid);
+         }
+      });
+
+      AABox centroid_box;
+
+      for (size_t c = 0; c < chunks; ++c)
+      {
+         box.Expand(chunk_box[c]);
+         centroid_box.Expand(chunk_centroid[c]);
+      }
+
+      size_t axis = centroid_box.GetLongestAxis();
+
+      const float lo = centroid_box.vmin[axis];
+      const float extent = centroid_box.vmax[axis] - lo;
+
+      if (extent <= 0.0f || depth >= max_sah_depth)
+      {
+         return Halve(begin, end, axis, extent);
+      }
+
+      const float scale = BVH_NUM_BINS / extent;
+
+      std::vector<AABox> chunk_bin_box(chunks * BVH_NUM_BINS);
+      std::vector<uint32_t> chunk_bin_count(chunks * BVH_NUM_BINS, 0);
+
+      ForEach(chunks, [this, begin, end, axis, lo, scale, &chunk_bin_box, &chunk_bin_count](size_t c)
+      {
+         const uint32_t first = begin + (uint32_t) (c * BVH_PARALLEL_GRAIN);
+         const uint32_t last  = first + BVH_PARALLEL_GRAIN < end ? first + BVH_PARALLEL_GRAIN : end;
+
+         for (uint32_t i = first; i < last; ++i)
+         {
+            int bin = GetBin(ref[i].centroid[axis], lo, scale);
+
+            chunk_bin_box[c * BVH_NUM_BINS + bin].Expand(ref[i].box);
+            ++chunk_bin_count[c * BVH_NUM_BINS + bin];
+         }
+      });
+
+      AABox bin_box[BVH_NUM_BINS];
+      uint32_t bin_count[BVH_NUM_BINS] = {0};
+
+      for (size_t c = 0; c < chunks; ++c)
+      {
+         for (size_t b = 0; b < BVH_NUM_BINS; ++b)
+         {
+            bin_box[b].Expand(chunk_bin_box[c * BVH_NUM_BINS + b]);
+            bin_count[b] = bin_count[b] + chunk_bin_count[c * BVH_NUM_BINS + b];
+         }
+      }
+
+      float best_cost = FLT_MAX;
+      int best_split = FindSplit(bin_box, bin_count, best_cost);
+
+      if (best_split < 0)
+      {
+         return Halve(begin, end, axis, extent);
+      }
+
+   /* Count each chunk's left side, then place both sides of every chunk at
+      their running offsets, which keeps the order within each side. */
+      std::vector<uint32_t> left(chunks, 0);
+
+      ForEach(chunks, [this, begin, end, axis, lo, scale, best_split, &left](size_t c)
+      {
+         const uint32_t first = begin + (uint32_t) (c * BVH_PARALLEL_GRAIN);
+         const uint32_t last  = first + BVH_PARALLEL_GRAIN < end ? first + BVH_PARALLEL_GRAIN : end;
+
+         for (uint32_t i = first; i < last; ++i)
+         {
+            left[c] = left[c] + (GetBin(ref[i].centroid[axis], lo, scale) <= best_split ? 1 : 0);
+         }
+      });
+
+      std::vector<uint32_t> left_offset(chunks), right_offset(chunks);
+      uint32_t num_left = 0, num_right = 0;
+
+      for (size_t c = 0; c < chunks; ++c)
+      {
+         const uint32_t size = (uint32_t) ((c + 1) * BVH_PARALLEL_GRAIN < count ? BVH_PARALLEL_GRAIN : count - c * BVH_PARALLEL_GRAIN);
+
+         left_offset[c] = num_left;
+         right_offset[c] = num_right;
+
+         num_left = num_left + left[c];
+         num_right = num_right + size - left[c];
+      }
+
+      std::vector<Reference> scratch(count);
+
+      ForEach(chunks, [this, begin, end, axis, lo, scale, best_split, num_left, &left_offset, &right_offset, &scratch](size_t c)
+      {
+         const uint32_t first = begin + (uint32_t) (c * BVH_PARALLEL_GRAIN);
+         const uint32_t last  = first + BVH_PARALLEL_GRAIN < end ? first + BVH_PARALLEL_GRAIN : end;
+
+         uint32_t l = left_offset[c], r = num_left + right_offset[c];
+
+         for (uint32_t i = first; i < last; ++i)
+         {
+            if (GetBin(ref[i].centroid[axis], lo, scale) <= best_split)
+            {
+               scratch[l++] = ref[i];
+            }
+            else
+            {
+               scratch[r++] = ref[i];
+            }
+         }
+      });
+
+      ForEach(chunks, [this, begin, end, &scratch](size_t c)
+      {
+         const uint32_t first = begin + (uint32_t) (c * BVH_PARALLEL_GRAIN);
+         const uint32_t last  = first + BVH_PARALLEL_GRAIN < end ? first + BVH_PARALLEL_GRAIN : end;
+
+         std::copy(scratch.begin() + (first - begin), scratch.begin() + (last - begin), ref.begin() + first);
+      });
+
+      return begin + num_left;
+   }
+
+/* Codes in a run are sorted and share every bit above level, so the run
+   splits where the highest bit that differs turns on. Runs of equal codes
+   are halved. */
+   uint32_t Builder::SplitMorton(uint32_t begin, uint32_t end, uint32_t level, uint32_t& child_level)
+   {
+      if (end - begin <= max_leaf_size)
+      {
+         return begin;
+      }
+
+      for (uint32_t bit = level; bit > 0; --bit)
+      {
+         const uint32_t mask = 1u << (bit - 1);
+
+         if ((code[begin] & mask) != (code[end - 1] & mask))
+         {
+            const uint32_t* middle = std::partition_point(&code[0] + begin, &code[0] + end, [mask](uint32_t c) {   return (c & mask) == 0;   });
+
+            child_level = bit - 1;
+
+            return (uint32_t) (middle - &code[0]);
+         }
+      }
+
+      child_level = 0;
+
+      return begin + (end - begin) / 2;
+   }
+
+/* Every centroid sits on one point (or the tree is getting deep): halve the run. */
+   uint32_t Builder::Halve(uint32_t begin, uint32_t end, size_t axis, float extent)
+   {
+      uint32_t middle = begin + (end - begin) / 2;
+
+      if (extent > 0.0f)
+      {
+         std::nth_element(ref.begin() + begin, ref.begin() + middle, ref.begin() + end, [axis](const Reference& a, const Reference& b) {   return a.centroid[axis] < b.centroid[axis];   });
+      }
+
+      return middle;
+   }
+
+/* Sweeps from the right to collect suffix areas, then from the left for the
+   costs. Returns the last bin of the cheaper left side, or -1. */
+   int Builder::FindSplit(const AABox bin_box[BVH_NUM_BINS], const uint32_t bin_count[BVH_NUM_BINS], float& best_cost)
+   {
+      float right_area[BVH_NUM_BINS];
+      uint32_t right_count[BVH_NUM_BINS];
+      AABox accumulate;
+      uint32_t n = 0;
+
+      for (int i = BVH_NUM_BINS - 1; i > 0; --i)
+      {
+         accumulate.Expand(bin_box[i]);
+         n = n + bin_count[i];
+
+         right_area[i]  = accumulate.IsEmpty() ? 0.0f : accumulate.GetSurfaceArea();
+         right_count[i] = n;
+      }
+
+      int best_split = -1;
+
+      accumulate = AABox();
+      n = 0;
+
+      for (int i = 0; i < BVH_NUM_BINS - 1; ++i)
+      {
+         accumulate.Expand(bin_box[i]);
+         n = n + bin_count[i];
+
+         if (n == 0 || right_count[i + 1] == 0)
+         {
+            continue;
+         }
+
+         float cost = accumulate.GetSurfaceArea() * n + right_area[i + 1] * right_count[i + 1];
+
+         if (cost < best_cost)
+         {
+            best_cost = cost;
+            best_split = i;
+         }
+      }
+
+      return best_split;
+   }
+
+/* Codes the centroids on a 1024^3 grid over their bounds and sorts the
+   primitives by them, least significant ten bits first. */
+   void Builder::SortMorton()
+   {
+      const size_t count = ref.size();
+      const size_t chunks = (count + BVH_PARALLEL_GRAIN - 1) / BVH_PARALLEL_GRAIN;
+
+      std::vector<AABox> chunk_centroid(chunks);
+
+      ForEach(chunks, [this, count, &chunk_centroid](size_t c)
+      {
+         const size_t last = (c + 1) * BVH_PARALLEL_GRAIN < count ? (c + 1) * BVH_PARALLEL_GRAIN : count;
+
+         for (size_t i = c * BVH_PARALLEL_GRAIN; i < last; ++i)
+         {
+            chunk_centroid[c].Expand(ref[i].centroid);
+         }
+      });
+
+      AABox centroid_box;
+
+      for (size_t c = 0; c < chunks; ++c)
+      {
+         centroid_box.Expand(chunk_centroid[c]);
+      }
+
+      const float cells = (float) (1 << BVH_MORTON_BITS);
+      vector3f scale;
+
+      for (size_t k = 0; k < 3; ++k)
+      {
+         float extent = centroid_box.vmax[k] - centroid_box.vmin[k];
+
+         scale[k] = extent > 0.0f ? cells / extent : 0.0f;
+      }
+
+      std::vector<uint32_t> key(count);
+
+      ForEach(chunks, [this, count, &centroid_box, &scale, cells, &key](size_t c)
+      {
+         const size_t last = (c + 1) * BVH_PARALLEL_GRAIN < count ? (c + 1) * BVH_PARALLEL_GRAIN : count;
+
+         for (size_t i = c * BVH_PARALLEL_GRAIN; i < last; ++i)
+         {
+            uint32_t cell[3];
+
+            for (size_t k = 0; k < 3; ++k)
+            {
+               float v = (ref[i].centroid[k] - centroid_box.vmin[k]) * scale[k];
+
+               cell[k] = (uint32_t) (v < cells - 1.0f ? v : cells - 1.0f);
+            }
+
+            key[i] = (ExpandBits(cell[x]) << 2) | (ExpandBits(cell[y]) << 1) | ExpandBits(cell[z]);
+         }
+      });
+
+      std::vector<uint32_t> sorted_key(count);
+      std::vector<Reference> sorted_ref(count);
+
+      for (uint32_t shift = 0; shift < 3 * BVH_MORTON_BITS; shift += BVH_MORTON_BITS)
+      {
+         const uint32_t digits = 1u << BVH_MORTON_BITS;
+         std::vector<uint32_t> offset(digits + 1, 0);
+
+         for (size_t i = 0; i < count; ++i)
+         {
+            ++offset[((key[i] >> shift) & (digits - 1)) + 1];
+         }
+
+         for (uint32_t d = 0; d < digits; ++d)
+         {
+            offset[d + 1] = offset[d + 1] + offset[d];
+         }
+
+         for (size_t i = 0; i < count; ++i)
+         {
+            uint32_t slot = offset[(key[i] >> shift) & (digits - 1)]++;
+
+            sorted_key[slot] = key[i];
+            sorted_ref[slot] = ref[i];
+         }
+
+         key.swap(sorted_key);
+         ref.swap(sorted_ref);
+      }
+
+      code.swap(key);
+
+      return;
+   }
+
+/* Gathers up to BVH_WIDTH descendants of a binary node by opening the
+   interior child with the largest surface area until the node is full, then
+   does the same below each interior one. Returns the wide node's index, and
+   keeps the deepest level reached in depth. */
+   uint32_t Builder::Collapse(uint32_t node, size_t level)
+   {
+      depth = level > depth ? level : depth;
+
+      uint32_t child[BVH_WIDTH];
+      size_t n = 0;
+
+      if (nodes[node].count != 0)
+      {
+         child[n++] = node; /* A tree that is one leaf. */
+      }
+      else
+      {
+         child[n++] = nodes[node].child[0];
+         child[n++] = nodes[node].child[1];
+
+         while (n < BVH_WIDTH)
+         {
+            size_t best = n;
+            float best_area = -1.0f;
+
+            for (size_t i = 0; i < n; ++i)
+            {
+               const BinaryNode& c = nodes[child[i]];
+
+               if (c.count == 0 && c.box.GetSurfaceArea() > best_area)
+               {
+                  best = i;
+                  best_area = c.box.GetSurfaceArea();
+               }
+            }
+
+            if (best == n)
+            {
+               break;
+            }
+
+            const uint32_t opened = child[best];
+
+            child[best] = nodes[opened].child[0];
+            child[n++] = nodes[opened].child[1];
+         }
+      }
+
+   /* Children are collapsed first; the vector may move while they are. */
+      BVHNode result;
+
+      result.lanes = (1u << n) - 1;
+
+      for (size_t k = 0; k < BVH_WIDTH; ++k)
+      {
+         AABox box;
+
+         result.offset[k] = 0;
+         result.count[k] = 0;
+
+         if (k < n)
+         {
+            const BinaryNode& c = nodes[child[k]];
+
+            box = c.box;
+
+            if (c.count != 0)
+            {
+               result.offset[k] = c.offset;
+               result.count[k] = (uint16_t) c.count;
+            }
+         }
+
+         for (size_t i = 0; i < 3; ++i)
+         {
+            result.bounds[2 * i + 0][k] = box.vmin[i];
+            result.bounds[2 * i + 1][k] = box.vmax[i];
+         }
+      }
+
+      const uint32_t index = (uint32_t) wide.size();
+      wide.push_back(result);
+
+      for (size_t k = 0; k < n; ++k)
+      {
+         if (nodes[child[k]].count == 0)
+         {
+            wide[index].offset[k] = Collapse(child[k], level + 1);
+         }
+      }
+
+      return index;
+   }
+}
+
+void BVH::Build(const AABox* bounds, size_t count, uint32_t* order, Scheduler* scheduler, Type type, size_t max_leaf_size)
+{
+   delete [] memory;
+   memory = NULL;
+   nodes = NULL;
+   num_nodes = 0;
+   box = AABox();
+
+   if (count == 0)
+   {
+      return;
+   }
+
+   Builder builder;
+   builder.scheduler = scheduler;
+   builder.type = type;
+   builder.max_leaf_size = max_leaf_size;
+   builder.max_sah_depth = BVH_MAX_SAH_DEPTH;
+
+   for (;;)
+   {
+      builder.ref.resize(count);
+      builder.code.clear();
+      builder.nodes.clear();
+      builder.nodes.reserve(2 * count / max_leaf_size + 1);
+      builder.wide.clear();
+      builder.depth = 0;
+
+      for (size_t i = 0; i < count; ++i)
+      {
+         builder.ref[i].box = bounds[i];
+         builder.ref[i].centroid = bounds[i].GetCentroid();
+         builder.ref[i].index = (uint32_t) i;
+      }
+
+      if (builder.type == Type::Morton)
+      {
+         builder.SortMorton();
+      }
+
+      builder.nodes.push_back(BinaryNode());
+      builder.Grow();
+
+      builder.wide.reserve(builder.nodes.size() / 2 + 1);
+      builder.Collapse(0, 1);
+
+      if (builder.depth <= BVH_MAX_DEPTH || builder.max_sah_depth == 0)
+      {
+         break;
+      }
+
+   /* Too deep for the traversal's stack. Halving every run at its median
+      keeps the depth to the logarithm of the count, which always fits. */
+      builder.type = Type::SAH;
+      builder.max_sah_depth = 0;
+   }
+
+   assert(builder.depth <= BVH_MAX_DEPTH);
+
+   box = builder.nodes[0].box;
+
+   num_nodes = builder.wide.size();
+   memory = new uint8_t[num_nodes * sizeof(BVHNode) + BVH_CACHE_LINE];
+
+   BVHNode* aligned = (BVHNode*) (((uintptr_t) memory + BVH_CACHE_LINE - 1) & ~(uintptr_t) (BVH_CACHE_LINE - 1));
+
+   for (size_t i = 0; i < num_nodes; ++i)
+   {
+      aligned[i] = builder.wide[i];
+   }
+
+   nodes = aligned;
+
+   for (size_t i = 0; i < count; ++i)
+   {
+      order[i] = builder.ref[i].index;
+   }
+
+   return;
+}
+
+bool BVH::Attach(const BVHNode* n, size_t count, const AABox& bounds)
+{
+   delete [] memory;
+   memory = NULL;
+   nodes = NULL;
+   num_nodes = 0;
+   box = AABox();
+
+/* Build puts every child after its parent, so the depths are found from the
+   last node back, and a child anywhere else means the nodes are not ours. */
+   std::vector<size_t> depth(count, 1);
+
+   for (size_t i = count; i > 0; --i)
+   {
+      const BVHNode& node = n[i - 1];
+
+      for (size_t k = 0; k < BVH_WIDTH; ++k)
+      {
+         if (((node.lanes >> k) & 1) != 0 && node.count[k] == 0)
+         {
+            if (node.offset[k] < i || node.offset[k] >= count)
+            {
+               return false;
+            }
+
+            depth[i - 1] = depth[node.offset[k]] + 1 > depth[i - 1] ? depth[node.offset[k]] + 1 : depth[i - 1];
+         }
+      }
+   }
+
+   if (count != 0 && depth[0] > BVH_MAX_DEPTH)
+   {
+      return false;
+   }
+
+   nodes = n;
+   num_nodes = count;
+   box = bounds;
+
+   return true;
+}
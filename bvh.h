@@ -0,0 +1,361 @@
+/* File: bvh.h; Mode: C++; Tab-width: 3; Author: Simon Flannery;              */
+
+#ifndef BVH_H
+#define BVH_H
+
+#include <stdint.h>
+#include <assert.h>
+
+#include "math.h"
+#include "ray.h"
+#include "hit.h"
+#include "kernels.h"
+#include "packet.h"
+
+#if defined(__SSE__) || defined(_M_X64) || defined(_M_IX86)
+#include <xmmintrin.h>
+#endif
+
+/* The width is the same whichever kernels run, as the nodes are built once,
+   and kept in cache files, while the kernels are picked at startup. */
+#define BVH_WIDTH KERNEL_LANES
+#define BVH_MAX_LEAF_SIZE 4
+#define BVH_NUM_BINS      16
+#define BVH_STACK_SIZE    256
+#define BVH_MAX_DEPTH     ((BVH_STACK_SIZE - 1) / (BVH_WIDTH - 1)) /* Levels a walk's stack always holds. */
+#define BVH_CACHE_LINE    64
+#define BVH_PACKET_MIN_RAYS 3 /* Fewer rays than this leave the packet and go on alone. */
+
+class Scheduler;
+
+/* A node of the wide tree holds the boxes of up to BVH_WIDTH children, one
+   lane each, so all of them are tested against a ray at once. Unused lanes
+   keep an empty box that no finite ray can hit, and are left out of lanes,
+   as a ray with a NaN in it passes every slab test. Nodes start on a cache
+   line. */
+
+struct alignas(BVH_CACHE_LINE) BVHNode
+{
+   float bounds[6][BVH_WIDTH]; /* Minimum then maximum on each axis, a lane per child. */
+   uint32_t offset[BVH_WIDTH]; /* Leaf: first primitive. Interior: index of the child node. */
+   uint16_t count[BVH_WIDTH];  /* Number of primitives, zero for interior nodes. */
+   uint32_t lanes;             /* Bit k set when lane k holds a child. */
+};
+
+/* Asks for the node's cache lines ahead of the visit. */
+inline void PrefetchNode(const BVHNode* node)
+{
+#if defined(__SSE__) || defined(_M_X64) || defined(_M_IX86)
+   for (size_t line = 0; line < sizeof(BVHNode); line += BVH_CACHE_LINE)
+   {
+      _mm_prefetch((const char*) node + line, _MM_HINT_T0);
+   }
+#endif
+
+   return;
+}
+
+/* Bounding volume hierarchy over an array of primitive boxes, built with the
+   binned surface area heuristic, or for speed over quality by splitting the
+   Morton order of the centroids, and then collapsed into BVH_WIDTH-ary nodes.
+   The owner keeps its primitives and applies the permutation returned by
+   Build, so a leaf is a contiguous run of them. */
+
+class BVH
+{
+public:
+   enum class Type { SAH, Morton };
+
+   BVH() : memory(NULL), nodes(NULL), num_nodes(0) {   }
+   ~BVH() {   delete [] memory;   }
+
+/* Fills order[i] with the original index of the i-th primitive in leaf order.
+   With a scheduler the build is spread across its threads; the tree is the
+   same either way. Runs longer than max_leaf_size are split, and the surface
+   area heuristic may leave up to four times as many in a leaf. */
+   void Build(const AABox* bounds, size_t count, uint32_t* order, Scheduler* scheduler = NULL, Type type = Type::SAH, size_t max_leaf_size = BVH_MAX_LEAF_SIZE);
+
+/* Uses nodes built earlier and kept elsewhere, such as in a mapped cache file.
+   They are not copied, so they must outlive the hierarchy. Returns false,
+   leaving the hierarchy empty, for nodes Build could not have made or a tree
+   deeper than the traversal's stack allows. */
+   bool Attach(const BVHNode* n, size_t count, const AABox& bounds);
+
+/* Calls Remap(offset, count) on each leaf of a built tree, for an owner that
+   refers to its primitives by something other than the order of Build. The
+   count it leaves must not be zero, or the leaf would read as a node. */
+   template <class Remap>
+   void RemapLeaves(const Remap& remap)
+   {
+      assert(memory != NULL); /* Attached nodes are not ours to change. */
+
+      BVHNode* node = const_cast<BVHNode*>(nodes);
+
+      for (size_t n = 0; n < num_nodes; ++n)
+      {
+         for (size_t k = 0; k < BVH_WIDTH; ++k)
+         {
+            if (((node[n].lanes >> k) & 1) && node[n].count[k] != 0)
+            {
+               remap(node[n].offset[k], node[n].count[k]);
+
+               assert(node[n].count[k] != 0);
+            }
+         }
+      }
+
+      return;
+   }
+
+   size_t GetNumNodes() const {   return num_nodes;   }
+   const BVHNode* GetNodes() const {   return nodes;   }
+
+   AABox GetBounds() const {   return box;   }
+
+/* Visits the leaves a ray may reach, nearest first. Leaf(first, count) tests
+   that run of primitives, updating h and returning true on a closer hit. When
+   any is set the first hit ends the walk, which is all a shadow ray needs. */
+   template <class Leaf>
+   bool Traverse(const Ray& ray, Hit& h, float tmin, const Leaf& leaf, bool any = false) const
+   {
+      return num_nodes != 0 && TraverseFrom(0, ray, h, tmin, leaf, any);
+   }
+
+/* Traverse for the rays of a packet set in active, hits[k] being the hit of
+   ray k. Each node is visited once for all the rays that reach it, which
+   share its cache lines and the stack. Leaf(first, count, rays) tests the
+   run for the rays in the mask rays and returns the mask of those it found
+   closer hits for, as this does. */
+   template <class Leaf>
+   uint32_t TraversePacket(const RayPacket& packet, Hit hits[PACKET_SIZE], uint32_t active, float tmin, const Leaf& leaf) const
+   {
+      uint32_t result = 0;
+
+      if (num_nodes == 0 || active == 0)
+      {
+         return result;
+      }
+
+      const KernelTable& kernel = Kernels::Get();
+
+   /* As for one ray, with the rays still to visit the child and the nearest
+      distance at which any of them enters it. */
+      struct Entry
+      {
+         uint32_t offset;
+         uint32_t count;
+         uint32_t rays;
+         float t;
+      };
+
+      Entry stack[BVH_STACK_SIZE];
+      size_t top = 0;
+
+      stack[top++] = {0, 0, active, tmin};
+
+      float tmax[PACKET_SIZE];
+
+      while (top > 0)
+      {
+         const Entry entry = stack[--top];
+
+      /* No ray enters nearer than the entry says, so those with a hit before
+         that are done with it. */
+         uint32_t rays = 0;
+
+         for (size_t k = 0; k < PACKET_SIZE; ++k)
+         {
+            tmax[k] = hits[k].GetT();
+
+            if (((entry.rays >> k) & 1) && entry.t <= tmax[k])
+            {
+               rays = rays | (1u << k);
+            }
+         }
+
+         if (rays == 0)
+         {
+            continue;
+         }
+
+         if (entry.count != 0)
+         {
+            result = result | leaf(entry.offset, entry.count, rays);
+
+            continue;
+         }
+
+      /* Too few rays left together to pay for testing them as a packet; each
+         walks the rest of this subtree alone. */
+         if (CountRays(rays) < BVH_PACKET_MIN_RAYS)
+         {
+            for (size_t k = 0; k < PACKET_SIZE; ++k)
+            {
+               if ((rays >> k) & 1)
+               {
+                  const uint32_t ray = 1u << k;
+
+                  if (TraverseFrom(entry.offset, packet.rays[k], hits[k], tmin, [&leaf, ray](uint32_t first, uint32_t count) {   return leaf(first, count, ray) != 0;   }, false) != false)
+                  {
+                     result = result | ray;
+                  }
+               }
+            }
+
+            continue;
+         }
+
+         const BVHNode& node = nodes[entry.offset];
+
+         uint32_t hit_rays[BVH_WIDTH];
+         float tnear[BVH_WIDTH];
+         uint32_t mask = kernel.IntersectChildrenPacket(node.bounds, packet.origin, packet.inverse_direction, rays, tmin, tmax, hit_rays, tnear) & node.lanes;
+
+         Entry hit[BVH_WIDTH];
+         size_t n = 0;
+
+         for (size_t k = 0; k < BVH_WIDTH; ++k)
+         {
+            if ((mask >> k) & 1)
+            {
+               size_t j = n++;
+
+               for (; j > 0 && hit[j - 1].t < tnear[k]; --j)
+               {
+                  hit[j] = hit[j - 1];
+               }
+
+               if (node.count[k] == 0)
+               {
+                  PrefetchNode(&nodes[node.offset[k]]);
+               }
+
+               hit[j].offset = node.offset[k];
+               hit[j].count  = node.count[k];
+               hit[j].rays   = hit_rays[k];
+               hit[j].t      = tnear[k];
+            }
+         }
+
+         assert(top + n <= BVH_STACK_SIZE);
+
+         for (size_t k = 0; k < n; ++k)
+         {
+            stack[top++] = hit[k];
+         }
+      }
+
+      return result;
+   }
+
+private:
+   BVH(const BVH&);
+   BVH& operator = (const BVH&);
+
+/* The walk of Traverse from the node root down. */
+   template <class Leaf>
+   bool TraverseFrom(uint32_t root, const Ray& ray, Hit& h, float tmin, const Leaf& leaf, bool any) const
+   {
+      bool result = false;
+
+      const KernelTable& kernel = Kernels::Get();
+
+      const point3f origin = ray.GetOrigin();
+      const vector3f inverse_direction = ray.GetInverseDirectionForAABoxFaceIntersection();
+
+      size_t enter[3], leave[3];
+
+      for (size_t i = 0; i < 3; ++i)
+      {
+         enter[i] = 2 * i + (inverse_direction[i] < 0.0f ? 1 : 0);
+         leave[i] = enter[i] ^ 1;
+      }
+
+   /* Entries are children still to visit with the distance at which the ray
+      enters them; an entry beyond the nearest hit found since is dropped. */
+      struct Entry
+      {
+         uint32_t offset;
+         uint32_t count;
+         float t;
+      };
+
+      Entry stack[BVH_STACK_SIZE];
+      size_t top = 0;
+
+      stack[top++] = {root, 0, tmin};
+
+      while (top > 0)
+      {
+         const Entry entry = stack[--top];
+
+         if (entry.t > h.GetT())
+         {
+            continue;
+         }
+
+         if (entry.count != 0)
+         {
+            if (leaf(entry.offset, entry.count) != false)
+            {
+               result = true;
+
+               if (any != false)
+               {
+                  return result;
+               }
+            }
+
+            continue;
+         }
+
+         const BVHNode& node = nodes[entry.offset];
+
+         float tnear[BVH_WIDTH];
+         uint32_t mask = kernel.IntersectChildren(node.bounds, origin.m, inverse_direction.m, enter, leave, tmin, h.GetT(), tnear) & node.lanes;
+
+      /* Push the children hit farthest first, so the nearest is popped next,
+         and fetch the nodes among them while the others are dealt with. */
+         Entry hit[BVH_WIDTH];
+         size_t n = 0;
+
+         for (size_t k = 0; k < BVH_WIDTH; ++k)
+         {
+            if ((mask >> k) & 1)
+            {
+               size_t j = n++;
+
+               for (; j > 0 && hit[j - 1].t < tnear[k]; --j)
+               {
+                  hit[j] = hit[j - 1];
+               }
+
+               if (node.count[k] == 0)
+               {
+                  PrefetchNode(&nodes[node.offset[k]]);
+               }
+
+               hit[j].offset = node.offset[k];
+               hit[j].count  = node.count[k];
+               hit[j].t      = tnear[k];
+            }
+         }
+
+         assert(top + n <= BVH_STACK_SIZE);
+
+         for (size_t k = 0; k < n; ++k)
+         {
+            stack[top++] = hit[k];
+         }
+      }
+
+      return result;
+   }
+
+   uint8_t* memory; /* Holds the nodes, aligned by hand as new need not. */
+   const BVHNode* nodes;
+   size_t num_nodes;
+   AABox box;
+};
+
+#endif
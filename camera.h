@@ -27,7 +27,7 @@ public:
    // up.Normalize();
    }
 
-   virtual Ray GenerateRay(const point2f& point) const = 0;
+   virtual Ray GenerateRay(const point2f& point, float time) const = 0;
    virtual bool UseSamples() const = 0;
 
    static vector3f LookAt(const point3f& eye, const point3f& look_at)
@@ -55,11 +55,11 @@ public:
 
    }
 
-   virtual Ray GenerateRay(const point2f& point) const
+   virtual Ray GenerateRay(const point2f& point, float time) const
    {
       point3f origin = center + (point[x] - 0.5f) * size * horizontal + (point[y] - 0.5f) * size * up;
 
-      Ray ray(origin, direction);
+      Ray ray(origin, direction, time);
 
       return ray;
    }
@@ -86,7 +86,7 @@ public:
       size = focal_depth * (float) tan(angle);
    }
 
-   virtual Ray GenerateRay(const point2f& point) const
+   virtual Ray GenerateRay(const point2f& point, float time) const
    {
       vector3f screen = center + direction + (point[x] - 0.5f) * size * horizontal + (point[y] - 0.5f) * size * up;
 
@@ -94,7 +94,7 @@ public:
       center point from the screen point. Don't forget to normalize. */
       vector3f d = screen - center;
 
-      Ray ray(center, d.Normalize());
+      Ray ray(center, d.Normalize(), time);
 
       return ray;
    }
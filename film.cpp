@@ -0,0 +1,212 @@
+/* File: film.cpp; Mode: C++; Tab-width: 3; Author: Simon Flannery;           */
+
+#include <stdio.h>
+#include <float.h>
+
+#include <string>
+
+#include "film.h"
+#include "image.h"
+
+Film::Film(size_t width, size_t height) : w(width), h(height)
+{
+   pixel = new Pixel[w * h];
+
+   Clear();
+}
+
+Film::~Film()
+{
+   delete [] pixel;
+}
+
+void Film::Clear()
+{
+   for (size_t i = 0; i < w * h; ++i)
+   {
+      pixel[i].sum.Set();
+      pixel[i].mean  = 0.0;
+      pixel[i].m2    = 0.0;
+      pixel[i].count = 0;
+   }
+
+   return;
+}
+
+void Film::AddSample(size_t i, size_t j, const color3f& color)
+{
+   Pixel& p = pixel[j * w + i];
+
+   p.sum = p.sum + color;
+   p.count = p.count + 1;
+
+   double luminance = 0.2126 * color[r] + 0.7152 * color[g] + 0.0722 * color[b];
+   double delta = luminance - p.mean;
+
+   p.mean = p.mean + delta / p.count;
+   p.m2 = p.m2 + delta * (luminance - p.mean);
+
+   return;
+}
+
+uint64_t Film::GetTotalSampleCount() const
+{
+   uint64_t total = 0;
+
+   for (size_t i = 0; i < w * h; ++i)
+   {
+      total = total + pixel[i].count;
+   }
+
+   return total;
+}
+
+float Film::GetRelativeError(size_t i, size_t j) const
+{
+   const Pixel& p = pixel[j * w + i];
+
+   if (p.count < 2)
+   {
+      return FLT_MAX;
+   }
+
+   double variance = p.m2 / (p.count - 1);
+   double error = sqrt(variance / p.count);
+
+   return (float) (error / fmax(p.mean, FILM_MIN_MEAN));
+}
+
+void Film::Resolve(Image& capture) const
+{
+   for (size_t j = 0; j < h; ++j)
+   {
+      for (size_t i = 0; i < w; ++i)
+      {
+         const Pixel& p = pixel[j * w + i];
+
+         color3f color;
+
+         if (p.count > 0)
+         {
+            const float s = 1.0f / (float) p.count;
+
+            color[r] = (float) sqrt(p.sum[r] * s);
+            color[g] = (float) sqrt(p.sum[g] * s);
+            color[b] = (float) sqrt(p.sum[b] * s);
+         }
+
+         capture.SetPixel(i, j, color);
+      }
+   }
+
+   return;
+}
+
+void Film::ResolveSampleCounts(Image& capture) const
+{
+   uint32_t most = 1;
+
+   for (size_t i = 0; i < w * h; ++i)
+   {
+      if (pixel[i].count > most)
+      {
+         most = pixel[i].count;
+      }
+   }
+
+   for (size_t j = 0; j < h; ++j)
+   {
+      for (size_t i = 0; i < w; ++i)
+      {
+         float level = pixel[j * w + i].count / (float) most;
+
+         capture.SetPixel(i, j, color3f(level, level, level));
+      }
+   }
+
+   return;
+}
+
+bool Film::Save(const char* szFileName, const FilmProgress& progress) const
+{
+   const std::string temporary = std::string(szFileName) + ".tmp";
+
+   FILE* file = fopen(temporary.c_str(), "wb");
+
+   if (file == NULL)
+   {
+      return false;
+   }
+
+   const uint32_t header[4] = {FILM_STATE_MAGIC, FILM_STATE_VERSION, (uint32_t) w, (uint32_t) h};
+
+   bool success = fwrite(header, sizeof(header), 1, file) == 1 &&
+                  fwrite(&progress, sizeof(FilmProgress), 1, file) == 1;
+
+   for (size_t i = 0; i < w * h && success != false; ++i)
+   {
+      const Pixel& p = pixel[i];
+      const float sum[3] = {p.sum[r], p.sum[g], p.sum[b]};
+
+      success = fwrite(sum, sizeof(float), 3, file) == 3 &&
+                fwrite(&p.mean, sizeof(double), 1, file) == 1 &&
+                fwrite(&p.m2, sizeof(double), 1, file) == 1 &&
+                fwrite(&p.count, sizeof(uint32_t), 1, file) == 1;
+   }
+
+   success = fclose(file) == 0 && success;
+
+/* rename replaces the old state in one step where it can; where it will not
+   replace an existing file, the old one has to go first. */
+   if (success == false)
+   {
+      remove(temporary.c_str());
+   }
+   else if (rename(temporary.c_str(), szFileName) != 0)
+   {
+      remove(szFileName);
+
+      success = rename(temporary.c_str(), szFileName) == 0;
+   }
+
+   return success;
+}
+
+bool Film::Load(const char* szFileName, FilmProgress& progress)
+{
+   FILE* file = fopen(szFileName, "rb");
+
+   if (file == NULL)
+   {
+      return false;
+   }
+
+   uint32_t header[4] = {0};
+
+   bool success = fread(header, sizeof(header), 1, file) == 1 &&
+                  header[0] == FILM_STATE_MAGIC && header[1] == FILM_STATE_VERSION &&
+                  header[2] == w && header[3] == h &&
+                  fread(&progress, sizeof(FilmProgress), 1, file) == 1;
+
+   for (size_t i = 0; i < w * h && success != false; ++i)
+   {
+      Pixel& p = pixel[i];
+      float sum[3] = {0.0f};
+
+      success = fread(sum, sizeof(float), 3, file) == 3 &&
+                fread(&p.mean, sizeof(double), 1, file) == 1 &&
+                fread(&p.m2, sizeof(double), 1, file) == 1 &&
+                fread(&p.count, sizeof(uint32_t), 1, file) == 1;
+
+      p.sum.Set(sum[r], sum[g], sum[b]);
+   }
+
+   fclose(file);
+
+   if (success == false)
+   {
+      Clear();
+   }
+
+   return success;
+}
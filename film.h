@@ -0,0 +1,78 @@
+/* File: film.h; Mode: C++; Tab-width: 3; Author: Simon Flannery;             */
+
+#ifndef FILM_H
+#define FILM_H
+
+#include <stdint.h>
+
+#include "math.h"
+
+#define FILM_MIN_MEAN 1e-3f /* Below this mean luminance the error is taken as absolute. */
+#define FILM_STATE_MAGIC 0x4D4C4946 /* "FILM" */
+#define FILM_STATE_VERSION 1
+
+class Image;
+
+/* Where the renderer had got to when the film was saved. The seed and
+   sampler must match for a resumed render to carry on the same sequences. */
+
+struct FilmProgress
+{
+   uint64_t seed;
+   uint32_t sampler;
+   uint32_t pass;
+   uint32_t samples;
+};
+
+/* Accumulates the samples of every pixel over any number of passes. Besides
+   the sum it keeps the running mean and variance of each pixel's luminance
+   (Welford's method), so the renderer can tell when a pixel has converged. */
+
+class Film
+{
+public:
+   Film(size_t width, size_t height);
+   ~Film();
+
+   size_t GetWidth()  const {   return w;   }
+   size_t GetHeight() const {   return h;   }
+
+   void Clear();
+
+   void AddSample(size_t i, size_t j, const color3f& color);
+
+   size_t GetSampleCount(size_t i, size_t j) const {   return pixel[j * w + i].count;   }
+   uint64_t GetTotalSampleCount() const;
+
+/* Standard error of the mean luminance over the mean; FLT_MAX before two samples. */
+   float GetRelativeError(size_t i, size_t j) const;
+
+/* Writes the gamma corrected average of every pixel. */
+   void Resolve(Image& capture) const;
+
+/* Writes each pixel's sample count as a grey level, white being the largest. */
+   void ResolveSampleCounts(Image& capture) const;
+
+/* Writes the raw accumulation of every pixel to a state file, by way of a
+   temporary file so an interrupted write leaves the previous state intact. */
+   bool Save(const char* szFileName, const FilmProgress& progress) const;
+
+/* Reads a state file written by Save; on failure the film is left empty. */
+   bool Load(const char* szFileName, FilmProgress& progress);
+
+private:
+   Film(const Film&);
+   Film& operator = (const Film&);
+
+   struct Pixel
+   {
+      color3f sum;
+      double mean, m2;
+      uint32_t count;
+   };
+
+   size_t w, h;
+   Pixel* pixel;
+};
+
+#endif
@@ -4,37 +4,86 @@
 #define HIT_H
 
 #include <float.h>
+#include <stdint.h>
 
 #include "math.h"
 #include "ray.h"
 
 class Material;
+class Object;
+
+/* Intersection runs in two phases. While the closest hit is searched for a
+   primitive only records its distance, itself, and which part of it was hit
+   with the barycentrics there. Once the search is over Evaluate works out
+   the material, normal and point of that one hit, rather than of every
+   closer hit found along the way. */
 
 class Hit
 {
 public:
-   Hit(float t = FLT_MAX) : tmin(t),  material(NULL) { }
+   Hit(float t = FLT_MAX) : tmin(t),  material(NULL), object(NULL), primitive(0), u(0.0f), v(0.0f), evaluated(true) { }
 
    float GetT()            const {   return tmin;   }
    Material* GetMaterial() const {   return material;   }
    point3f GetIntersectionPoint() const {   return intersection_point;   }
    vector3f GetNormal()    const {   return normal;   }
+   const Object* GetObject() const {   return object;   }
+
+   uint32_t GetPrimitive() const {   return primitive;   }
+   float GetU()            const {   return u;   }
+   float GetV()            const {   return v;   }
+   bool IsEvaluated()      const {   return evaluated;   }
 
-   void Set(float t, Material* m, const vector3f& n, const Ray& ray)
+   void Record(float t, const Object* o, uint32_t p = 0, float b1 = 0.0f, float b2 = 0.0f)
    {
       tmin = t;
+      object = o;
+      primitive = p;
+      u = b1;
+      v = b2;
+      evaluated = false;
+
+      return;
+   }
+
+/* Fills in the surface of a recorded hit; called by the object's Evaluate. */
+   void SetSurface(Material* m, const vector3f& n)
+   {
       material = m;
       normal = n;
+      evaluated = true;
+
+      return;
+   }
+
+   void SetT(float t) {   tmin = t;   return;   }
+
+/* Records and evaluates at once, for callers that need the normal straight
+   away, such as the constructive solid geometry. */
+   void Set(float t, Material* m, const vector3f& n, const Ray& ray, const Object* o)
+   {
+      tmin = t;
+      material = m;
+      normal = n;
+      object = o;
+      evaluated = true;
 
       intersection_point = ray.PointAtParameter(tmin);
 
       return;
    }
 
+/* The second phase, on the ray the hit was found with. */
+   void Evaluate(const Ray& ray);
+
 protected:
-private: 
+private:
    float tmin;
    Material* material;
+   const Object* object;
+   uint32_t primitive;
+   float u, v;
+   bool evaluated;
    vector3f normal;
    point3f intersection_point;
 };
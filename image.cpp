@@ -1,6 +1,7 @@
 /* File: image.cpp; Mode: C++; Tab-width: 3; Author: Simon Flannery;          */
 
 #include "image.h"
+#include "kernels.h"
 
 #ifdef BITMAP_SUPPORT
 #define WIN32_LEAN_AND_MEAN
@@ -9,6 +10,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 
 Image::Image(size_t width, size_t height) : w(width), h(height), data(NULL)
@@ -110,6 +112,16 @@ void Image::Save(const char* szFileName, Format t) const
    return;
 }
 
+void Image::Save(const char* szFileName) const
+{
+   if (szFileName != NULL)
+   {
+      Save(szFileName, strstr(szFileName, ".bmp") != NULL ? Format::BMP : Format::TGA);
+   }
+
+   return;
+}
+
 void Image::SaveTGA(const char* szFileName) const
 {
    FILE* file = fopen(szFileName, "wb");
@@ -130,16 +142,16 @@ void Image::SaveTGA(const char* szFileName) const
       }
 
    /* Write the image data. */
+      uint8_t* row = new uint8_t[w * 3];
+
       for (int j = h - 1; j >= 0; --j)
       {
-         for (int i = 0; i < w; ++i)
-         {
-            color3f v = GetPixel(i, j);
-            WriteByte(file, ClampColorComponent(v[b]));
-            WriteByte(file, ClampColorComponent(v[g]));
-            WriteByte(file, ClampColorComponent(v[r]));
-         }
+         Kernels::Get().ConvertToBGR(&data[j * w][0], w, row);
+
+         fwrite(row, sizeof(uint8_t), w * 3, file);
       }
+
+      delete [] row;
       
       fclose(file);
    }
@@ -175,22 +187,17 @@ void Image::SaveBMP(const char* szFileName) const
       fwrite(&bmpHeader,     sizeof(BITMAPFILEHEADER), 1, file);
       fwrite(&bmpInfomation, sizeof(BITMAPINFOHEADER), 1, file);
 
-   /* Write the image data upside-down. */
+   /* Write the image data upside-down, each row padded with zeros. */
+      uint8_t* row = new uint8_t[w * 3 + pad]();
+
       for (size_t j = 0; j < h; ++j)
       {
-         for (size_t i = 0; i < w; ++i)
-         {
-            color3f v = GetPixel(i, j);
-            WriteByte(file, ClampColorComponent(v[b]));
-            WriteByte(file, ClampColorComponent(v[g]));
-            WriteByte(file, ClampColorComponent(v[r]));
-         }
-
-         for (size_t i = 0; i < pad; ++i)
-         {
-            WriteByte(file, 0);
-         }
+         Kernels::Get().ConvertToBGR(&data[j * w][0], w, row);
+
+         fwrite(row, sizeof(uint8_t), w * 3 + pad, file);
       }
+
+      delete [] row;
       
       fclose(file);
    }
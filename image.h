@@ -29,6 +29,9 @@ public:
 
    void Save(const char* szFileName, Format t) const;
 
+/* Saves as a bitmap or a targa file depending on the file name. */
+   void Save(const char* szFileName) const;
+
 protected:
 private:
    void SaveTGA(const char* szFileName) const;
@@ -41,16 +44,6 @@ private:
       return;
    }
 
-   static unsigned char ClampColorComponent(float c)
-   {
-      int b = (int) (c * 255.0f);
-      
-      if (b <   0) b = 0;
-      if (b > 255) b = 255;
-
-      return (unsigned char) b;
-   }
-
    size_t w, h;
    color3f* data;
 };
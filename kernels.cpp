@@ -0,0 +1,390 @@
+/* File: kernels.cpp; Mode: C++; Tab-width: 3; Author: Simon Flannery;        */
+
+#include <stdio.h>
+#include <string.h>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+/* The scalar reference, built like the rest of the program. */
+#define KERNEL_TABLE kernels_scalar
+#define KERNEL_NAME "scalar"
+
+#include "kernels_isa.h"
+#include "perlin.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define KERNELS_X86
+#endif
+
+/* Best first. */
+static const KernelTable* const variants[] = {&kernels_avx512, &kernels_avx2, &kernels_sse42, &kernels_scalar};
+
+const KernelTable* Kernels::table = &kernels_scalar;
+
+/* Asks the processor, and for the wider registers the system too, as both
+   must support a set before it can be used. */
+static bool IsSupported(const KernelTable* t)
+{
+   bool sse42 = false, avx2 = false, avx512 = false;
+
+#if defined(KERNELS_X86) && defined(_MSC_VER)
+   int info[4];
+
+   __cpuid(info, 0);
+   const int highest = info[0];
+
+   __cpuid(info, 1);
+   sse42 = (info[2] & (1 << 20)) != 0;
+
+   const bool avx = (info[2] & (1 << 28)) != 0, osxsave = (info[2] & (1 << 27)) != 0;
+   const unsigned long long xcr0 = osxsave != false ? _xgetbv(0) : 0;
+
+   if (highest >= 7)
+   {
+      __cpuidex(info, 7, 0);
+
+      avx2   = avx != false && (xcr0 & 0x06) == 0x06 && (info[1] & (1 << 5)) != 0;
+      avx512 = avx2 != false && (xcr0 & 0xE6) == 0xE6 && (info[1] & (1 << 16)) != 0 && (info[1] & (1u << 31)) != 0;
+   }
+#elif defined(KERNELS_X86)
+   __builtin_cpu_init();
+
+   sse42  = __builtin_cpu_supports("sse4.2") != 0;
+   avx2   = __builtin_cpu_supports("avx2") != 0;
+   avx512 = __builtin_cpu_supports("avx512f") != 0 && __builtin_cpu_supports("avx512vl") != 0;
+#endif
+
+   if (t == &kernels_avx512) return avx512;
+   if (t == &kernels_avx2)   return avx2;
+   if (t == &kernels_sse42)  return sse42;
+
+   return t == &kernels_scalar;
+}
+
+bool Kernels::Select(const char* szName)
+{
+   const bool automatic = szName == NULL || strcmp(szName, "auto") == 0;
+
+   for (size_t i = 0; i < sizeof(variants) / sizeof(variants[0]); ++i)
+   {
+      if ((automatic != false || strcmp(szName, variants[i]->name) == 0) && IsSupported(variants[i]) != false)
+      {
+         table = variants[i];
+
+         return true;
+      }
+   }
+
+   return false;
+}
+
+void Kernels::PrepareTriangleRay(const float origin[3], const float direction[3], TriangleRay& ray)
+{
+   const float d[3] = {fabsf(direction[0]), fabsf(direction[1]), fabsf(direction[2])};
+
+   const uint32_t kz = d[0] > d[1] ? (d[0] > d[2] ? 0 : 2) : (d[1] > d[2] ? 1 : 2);
+
+/* Swapped when the ray runs down its axis, so the winding stays the same. */
+   uint32_t kx = (kz + 1) % 3, ky = (kx + 1) % 3;
+
+   if (direction[kz] < 0.0f)
+   {
+      const uint32_t swap = kx;
+
+      kx = ky;
+      ky = swap;
+   }
+
+   ray.axis[0] = kx;
+   ray.axis[1] = ky;
+   ray.axis[2] = kz;
+
+   ray.shear[0] = direction[kx] / direction[kz];
+   ray.shear[1] = direction[ky] / direction[kz];
+   ray.shear[2] = 1.0f / direction[kz];
+
+   for (size_t k = 0; k < 3; ++k)
+   {
+      ray.origin[k] = origin[k];
+   }
+
+   return;
+}
+
+/* A fixed sequence, so a failure can be repeated. */
+struct TestRandom
+{
+   uint32_t state;
+
+   float Get(float low, float high)
+   {
+      state = state ^ (state << 13);
+      state = state ^ (state >> 17);
+      state = state ^ (state << 5);
+
+      return low + (high - low) * (float) (state >> 8) / (float) (1 << 24);
+   }
+
+   uint32_t Get(uint32_t n)
+   {
+      return (uint32_t) Get(0.0f, (float) n) % n;
+   }
+};
+
+static bool Same(const void* a, const void* b, size_t size)
+{
+   return memcmp(a, b, size) == 0;
+}
+
+/* Each kernel on the same inputs under both tables; returns the name of the
+   first that differs, or NULL. */
+static const char* Compare(const KernelTable& test, const KernelTable& reference)
+{
+   TestRandom random = {0x9E3779B9u};
+
+   const size_t trials = 4096;
+
+   for (size_t n = 0; n < trials; ++n)
+   {
+      alignas(64) float bounds[6][KERNEL_LANES];
+
+      for (size_t k = 0; k < KERNEL_LANES; ++k)
+      {
+         for (size_t i = 0; i < 3; ++i)
+         {
+            bounds[2 * i][k] = random.Get(-4.0f, 4.0f);
+            bounds[2 * i + 1][k] = bounds[2 * i][k] + random.Get(0.0f, 4.0f);
+
+         /* Empty lanes, as unused children have. */
+            if (k == 7 && n % 3 == 0)
+            {
+               bounds[2 * i][k] = FLT_MAX;
+               bounds[2 * i + 1][k] = -FLT_MAX;
+            }
+         }
+      }
+
+      float origin[3], inverse_direction[3];
+      size_t enter[3], leave[3];
+
+      for (size_t i = 0; i < 3; ++i)
+      {
+         origin[i] = random.Get(-6.0f, 6.0f);
+
+      /* Rays along an axis, some starting on a slab, give 0 * inf. */
+         const float d = n % 5 == i ? 0.0f : random.Get(-1.0f, 1.0f);
+
+         if (d == 0.0f && n % 2 == 0)
+         {
+            origin[i] = bounds[2 * i][n % KERNEL_LANES];
+         }
+
+         inverse_direction[i] = 1.0f / d;
+         enter[i] = 2 * i + (inverse_direction[i] < 0.0f ? 1 : 0);
+         leave[i] = enter[i] ^ 1;
+      }
+
+      const float tmin = n % 4 == 0 ? 0.0f : random.Get(0.0f, 2.0f);
+      const float tmax = n % 4 == 1 ? FLT_MAX : random.Get(0.0f, 10.0f);
+
+      float tnear[2][KERNEL_LANES];
+
+      const uint32_t mask[2] = {test.IntersectChildren(bounds, origin, inverse_direction, enter, leave, tmin, tmax, tnear[0]),
+                                reference.IntersectChildren(bounds, origin, inverse_direction, enter, leave, tmin, tmax, tnear[1])};
+
+      if (mask[0] != mask[1] || Same(tnear[0], tnear[1], sizeof(tnear[0])) == false)
+      {
+         return "IntersectChildren";
+      }
+
+   /* The same boxes against a packet of rays around the one above. */
+      float origins[3][KERNEL_LANES], inverse_directions[3][KERNEL_LANES], limits[KERNEL_LANES];
+
+      for (size_t r = 0; r < KERNEL_LANES; ++r)
+      {
+         for (size_t i = 0; i < 3; ++i)
+         {
+            origins[i][r] = origin[i] + (r == 0 ? 0.0f : random.Get(-0.5f, 0.5f));
+            inverse_directions[i][r] = r == 0 || random.Get(4) == 0 ? inverse_direction[i] : 1.0f / random.Get(-1.0f, 1.0f);
+         }
+
+         limits[r] = r % 2 == 0 ? tmax : random.Get(0.0f, 10.0f);
+      }
+
+      const uint32_t active = n % 7 == 0 ? 0xFF : random.Get(256);
+
+      uint32_t hits[2][KERNEL_LANES];
+
+      const uint32_t packet_mask[2] = {test.IntersectChildrenPacket(bounds, origins, inverse_directions, active, tmin, limits, hits[0], tnear[0]),
+                                       reference.IntersectChildrenPacket(bounds, origins, inverse_directions, active, tmin, limits, hits[1], tnear[1])};
+
+      if (packet_mask[0] != packet_mask[1] || Same(hits[0], hits[1], sizeof(hits[0])) == false || Same(tnear[0], tnear[1], sizeof(tnear[0])) == false)
+      {
+         return "IntersectChildrenPacket";
+      }
+   }
+
+/* Faces over a grid of corners they share, so that rays run through their
+   edges and corners, and along the axes for half the trials, so that some
+   of the edge functions come out as zero. */
+   const size_t faces = 64, corners = 27;
+   float vertices[9][faces + KERNEL_LANES - 1] = {{0.0f}};
+   const float* v0[3] = {vertices[0], vertices[1], vertices[2]};
+   const float* v1[3] = {vertices[3], vertices[4], vertices[5]};
+   const float* v2[3] = {vertices[6], vertices[7], vertices[8]};
+
+   for (size_t i = 0; i < faces; ++i)
+   {
+      for (size_t j = 0; j < 3; ++j)
+      {
+         uint32_t corner = random.Get((uint32_t) corners);
+
+         for (size_t k = 0; k < 3; ++k)
+         {
+            vertices[3 * j + k][i] = (float) (corner % 3) - 1.0f;
+            corner = corner / 3;
+         }
+      }
+   }
+
+   for (size_t n = 0; n < trials; ++n)
+   {
+      float origin[3], direction[3], length = 0.0f;
+
+      for (size_t i = 0; i < 3; ++i)
+      {
+         origin[i] = random.Get(-4.0f, 4.0f);
+         direction[i] = random.Get(-1.0f, 1.0f);
+      }
+
+      if (n % 2 != 0)
+      {
+         const uint32_t axis = random.Get(3u);
+
+         for (size_t i = 0; i < 3; ++i)
+         {
+            origin[i] = i == axis ? origin[i] : 0.5f * (float) ((int) random.Get(5u) - 2);
+            direction[i] = i == axis ? (origin[i] < 0.0f ? 1.0f : -1.0f) : 0.0f;
+         }
+      }
+
+      for (size_t i = 0; i < 3; ++i)
+      {
+         length = length + direction[i] * direction[i];
+      }
+
+      for (size_t i = 0; i < 3; ++i)
+      {
+         direction[i] = direction[i] / sqrtf(length);
+      }
+
+      TriangleRay ray;
+      Kernels::PrepareTriangleRay(origin, direction, ray);
+
+      const uint32_t first = random.Get(faces), count = 1 + random.Get((uint32_t) (faces - first));
+
+      float t[2], u[2] = {0.0f, 0.0f}, v[2] = {0.0f, 0.0f};
+      uint32_t face[2] = {0, 0};
+
+      t[0] = t[1] = n % 4 < 2 ? FLT_MAX : random.Get(0.0f, 8.0f);
+
+      const bool hit[2] = {test.IntersectTriangles(v0, v1, v2, first, count, ray, 1e-4f, t[0], u[0], v[0], face[0]),
+                           reference.IntersectTriangles(v0, v1, v2, first, count, ray, 1e-4f, t[1], u[1], v[1], face[1])};
+
+      if (hit[0] != hit[1] || face[0] != face[1] || Same(&t[0], &t[1], sizeof(float)) == false ||
+          Same(&u[0], &u[1], sizeof(float)) == false || Same(&v[0], &v[1], sizeof(float)) == false)
+      {
+         return "IntersectTriangles";
+      }
+   }
+
+   const int* p = Perlin::GetPermutation();
+
+   for (size_t n = 0; n < trials; ++n)
+   {
+      const float px = random.Get(-300.0f, 300.0f), py = random.Get(-300.0f, 300.0f), pz = random.Get(-300.0f, 300.0f);
+      const size_t octaves = 1 + random.Get(12);
+
+      const float noise[2] = {test.Turbulence(p, px, py, pz, octaves), reference.Turbulence(p, px, py, pz, octaves)};
+
+      if (Same(&noise[0], &noise[1], sizeof(float)) == false)
+      {
+         return "Turbulence";
+      }
+   }
+
+   for (size_t n = 0; n < trials / 16; ++n)
+   {
+      const size_t count = random.Get(41);
+
+      float rgb[3 * 40];
+      uint8_t bgr[2][3 * 40];
+
+      for (size_t i = 0; i < 3 * count; ++i)
+      {
+         rgb[i] = random.Get(-0.5f, 1.5f);
+      }
+
+      test.ConvertToBGR(rgb, count, bgr[0]);
+      reference.ConvertToBGR(rgb, count, bgr[1]);
+
+      if (Same(bgr[0], bgr[1], 3 * count) == false)
+      {
+         return "ConvertToBGR";
+      }
+   }
+
+   return NULL;
+}
+
+bool Kernels::SelfTest()
+{
+   bool passed = true;
+
+/* The scalar turbulence is itself held to the noise of perlin.h. */
+   TestRandom random = {12345u};
+
+   for (size_t n = 0; n < 4096 && passed != false; ++n)
+   {
+      const float px = random.Get(-300.0f, 300.0f), py = random.Get(-300.0f, 300.0f), pz = random.Get(-300.0f, 300.0f);
+      const size_t octaves = 1 + random.Get(12);
+
+      float noise[2] = {0.0f, kernels_scalar.Turbulence(Perlin::GetPermutation(), px, py, pz, octaves)};
+
+      for (size_t i = 0, j = 1; i < octaves; ++i, j = 2 * j)
+      {
+         noise[0] = noise[0] + (float) (Perlin::noise(px * j, py * j, pz * j) / j);
+      }
+
+      passed = Same(&noise[0], &noise[1], sizeof(float));
+   }
+
+   printf("%-8s %s\n", "scalar", passed != false ? "matches perlin.h" : "FAILED against perlin.h");
+
+   for (size_t i = 0; i < sizeof(variants) / sizeof(variants[0]); ++i)
+   {
+      if (IsSupported(variants[i]) == false)
+      {
+         printf("%-8s not supported here\n", variants[i]->name);
+
+         continue;
+      }
+
+      const char* szFailure = Compare(*variants[i], kernels_scalar);
+
+      if (szFailure != NULL)
+      {
+         printf("%-8s FAILED in %s\n", variants[i]->name, szFailure);
+
+         passed = false;
+      }
+      else
+      {
+         printf("%-8s passed\n", variants[i]->name);
+      }
+   }
+
+   return passed;
+}
@@ -0,0 +1,80 @@
+/* File: kernels.h; Mode: C++; Tab-width: 3; Author: Simon Flannery;          */
+
+#ifndef KERNELS_H
+#define KERNELS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define KERNEL_LANES 8 /* Children per tree node, as every variant lays them out. */
+
+/* The innermost loops of the renderer, built once for each instruction set
+   in kernels_*.cpp, so one binary runs well on old and new processors
+   alike. Each variant gives exactly the bits the scalar one gives. Only
+   plain data crosses this interface, as the variants must not share inline
+   code with the rest of the program that was compiled for another set. */
+
+/* A ray as IntersectTriangles takes it, from Kernels::PrepareTriangleRay:
+   axis[2] is the axis the direction is largest along, and the shear takes
+   the direction onto it with unit length. */
+struct TriangleRay
+{
+   float origin[3];
+   float shear[3];
+   uint32_t axis[3];
+};
+
+struct KernelTable
+{
+   const char* name;
+
+/* Slab tests of a ray against the boxes of a node's children; see BVHNode.
+   enter and leave pick the rows of bounds the ray enters and leaves each
+   axis by. Returns the mask of the children hit and their entry distances. */
+   uint32_t (*IntersectChildren)(const float bounds[6][KERNEL_LANES], const float origin[3], const float inverse_direction[3], const size_t enter[3], const size_t leave[3], float tmin, float tmax, float tnear[KERNEL_LANES]);
+
+/* The same test for a packet of rays, a lane each, each ray entering by the
+   rows its own signs pick and ending at its own tmax. Only the rays set in
+   active count. hits[k] gets the mask of the rays that hit child k, tnear[k]
+   the nearest of their entry distances or FLT_MAX. Returns the mask of the
+   children any ray hit. */
+   uint32_t (*IntersectChildrenPacket)(const float bounds[6][KERNEL_LANES], const float origin[3][KERNEL_LANES], const float inverse_direction[3][KERNEL_LANES], uint32_t active, float tmin, const float tmax[KERNEL_LANES], uint32_t hits[KERNEL_LANES], float tnear[KERNEL_LANES]);
+
+/* The watertight test over the faces first to first + count - 1 of a mesh,
+   given by their vertices. Each array runs KERNEL_LANES - 1 floats past the
+   last face, so a variant may read a whole block at the end of the run. On
+   hits beyond tmin and closer than t it updates t, the weights u and v of
+   v1 and v2, and face. */
+   bool (*IntersectTriangles)(const float* const v0[3], const float* const v1[3], const float* const v2[3], uint32_t first, uint32_t count, const TriangleRay& ray, float tmin, float& t, float& u, float& v, uint32_t& face);
+
+/* Sum over the octaves i of Perlin noise at (x, y, z) * 2^i over 2^i, with p
+   the doubled permutation. */
+   float (*Turbulence)(const int p[512], float x, float y, float z, size_t octaves);
+
+/* Red, green, blue floats to blue, green, red bytes, scaled by 255 and clamped. */
+   void (*ConvertToBGR)(const float* rgb, size_t count, uint8_t* bgr);
+};
+
+extern const KernelTable kernels_scalar, kernels_sse42, kernels_avx2, kernels_avx512;
+
+class Kernels
+{
+public:
+/* Uses the named variant, or the best the processor runs for NULL or "auto".
+   Returns false, changing nothing, for an unknown or unsupported name. */
+   static bool Select(const char* szName = NULL);
+
+   static const KernelTable& Get() {   return *table;   }
+
+/* Done once for each ray, ahead of all the IntersectTriangles calls it makes. */
+   static void PrepareTriangleRay(const float origin[3], const float direction[3], TriangleRay& ray);
+
+/* Runs every variant the processor supports on random inputs against the
+   scalar one and prints the outcome of each. */
+   static bool SelfTest();
+
+private:
+   static const KernelTable* table;
+};
+
+#endif
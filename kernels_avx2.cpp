@@ -0,0 +1,9 @@
+/* File: kernels_avx2.cpp; Mode: C++; Tab-width: 3; Author: Simon Flannery;   */
+
+/* The kernels built with AVX2 enabled; only run where Kernels finds it. */
+
+#define KERNEL_AVX2
+#define KERNEL_TABLE kernels_avx2
+#define KERNEL_NAME "avx2"
+
+#include "kernels_isa.h"
@@ -0,0 +1,9 @@
+/* File: kernels_avx512.cpp; Mode: C++; Tab-width: 3; Author: Simon Flannery; */
+
+/* The kernels built with AVX-512 (F and VL) enabled; only run where Kernels finds it. */
+
+#define KERNEL_AVX512
+#define KERNEL_TABLE kernels_avx512
+#define KERNEL_NAME "avx512"
+
+#include "kernels_isa.h"
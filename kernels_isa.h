@@ -0,0 +1,763 @@
+/* File: kernels_isa.h; Mode: C++; Tab-width: 3; Author: Simon Flannery;      */
+
+/* The body of every kernel variant. Each kernels_*.cpp includes it once,
+   having named the instruction set with KERNEL_SSE42, KERNEL_AVX2 or
+   KERNEL_AVX512 (none for the scalar reference) and the table to define
+   with KERNEL_TABLE and KERNEL_NAME. Everything here has internal linkage
+   and nothing else of the program is included, so no function built for
+   one set can be picked by the linker in place of another. */
+
+#ifndef KERNELS_ISA_H
+#define KERNELS_ISA_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+
+#if defined(KERNEL_AVX512)
+#define KERNEL_AVX2
+#endif
+
+#if defined(KERNEL_AVX2)
+#define KERNEL_SSE42
+#include <immintrin.h>
+#elif defined(KERNEL_SSE42)
+#include <nmmintrin.h>
+#endif
+
+#include "kernels.h"
+
+namespace
+{
+
+uint32_t IntersectChildren(const float bounds[6][KERNEL_LANES], const float origin[3], const float inverse_direction[3], const size_t enter[3], const size_t leave[3], float tmin, float tmax, float tnear[KERNEL_LANES])
+{
+#if defined(KERNEL_AVX2)
+   __m256 t0 = _mm256_set1_ps(tmin), t1 = _mm256_set1_ps(tmax);
+
+   for (size_t i = 0; i < 3; ++i)
+   {
+      const __m256 o = _mm256_set1_ps(origin[i]);
+      const __m256 d = _mm256_set1_ps(inverse_direction[i]);
+
+      t0 = _mm256_max_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(bounds[enter[i]]), o), d), t0);
+      t1 = _mm256_min_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(bounds[leave[i]]),  o), d), t1);
+   }
+
+   _mm256_storeu_ps(tnear, t0);
+
+#if defined(KERNEL_AVX512)
+   return (uint32_t) _mm256_cmp_ps_mask(t0, t1, _CMP_LE_OQ);
+#else
+   return (uint32_t) _mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ));
+#endif
+#elif defined(KERNEL_SSE42)
+   uint32_t mask = 0;
+
+/* The lanes in two halves of four. */
+   for (size_t k = 0; k < KERNEL_LANES; k += 4)
+   {
+      __m128 t0 = _mm_set1_ps(tmin), t1 = _mm_set1_ps(tmax);
+
+      for (size_t i = 0; i < 3; ++i)
+      {
+         const __m128 o = _mm_set1_ps(origin[i]);
+         const __m128 d = _mm_set1_ps(inverse_direction[i]);
+
+         t0 = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(bounds[enter[i]] + k), o), d), t0);
+         t1 = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(bounds[leave[i]] + k),  o), d), t1);
+      }
+
+      _mm_storeu_ps(tnear + k, t0);
+
+      mask = mask | ((uint32_t) _mm_movemask_ps(_mm_cmple_ps(t0, t1)) << k);
+   }
+
+   return mask;
+#else
+/* A lane whose product is 0 * inf gives NaN, which the comparisons discard
+   in favour of the running interval, as the min and max instructions do. */
+   uint32_t mask = 0;
+
+   for (size_t k = 0; k < KERNEL_LANES; ++k)
+   {
+      float t0 = tmin, t1 = tmax;
+
+      for (size_t i = 0; i < 3; ++i)
+      {
+         float a = (bounds[enter[i]][k] - origin[i]) * inverse_direction[i];
+         float b = (bounds[leave[i]][k]  - origin[i]) * inverse_direction[i];
+
+         t0 = a > t0 ? a : t0;
+         t1 = b < t1 ? b : t1;
+      }
+
+      tnear[k] = t0;
+      mask = mask | (t0 <= t1 ? 1u << k : 0u);
+   }
+
+   return mask;
+#endif
+}
+
+uint32_t IntersectChildrenPacket(const float bounds[6][KERNEL_LANES], const float origin[3][KERNEL_LANES], const float inverse_direction[3][KERNEL_LANES], uint32_t active, float tmin, const float tmax[KERNEL_LANES], uint32_t hits[KERNEL_LANES], float tnear[KERNEL_LANES])
+{
+/* A ray left out gets an interval no entry distance fits in. */
+   float limit[KERNEL_LANES];
+
+   for (size_t r = 0; r < KERNEL_LANES; ++r)
+   {
+      limit[r] = (active >> r) & 1 ? tmax[r] : -FLT_MAX;
+   }
+
+   uint32_t mask = 0;
+
+#if defined(KERNEL_AVX2)
+   __m256 o[3], d[3], negative[3];
+
+   for (size_t i = 0; i < 3; ++i)
+   {
+      o[i] = _mm256_loadu_ps(origin[i]);
+      d[i] = _mm256_loadu_ps(inverse_direction[i]);
+      negative[i] = _mm256_cmp_ps(d[i], _mm256_setzero_ps(), _CMP_LT_OQ);
+   }
+
+   const __m256 t1_start = _mm256_loadu_ps(limit);
+
+   for (size_t k = 0; k < KERNEL_LANES; ++k)
+   {
+      __m256 t0 = _mm256_set1_ps(tmin), t1 = t1_start;
+
+      for (size_t i = 0; i < 3; ++i)
+      {
+         const __m256 a = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(bounds[2 * i][k]), o[i]), d[i]);
+         const __m256 b = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(bounds[2 * i + 1][k]), o[i]), d[i]);
+
+         t0 = _mm256_max_ps(_mm256_blendv_ps(a, b, negative[i]), t0);
+         t1 = _mm256_min_ps(_mm256_blendv_ps(b, a, negative[i]), t1);
+      }
+
+      const __m256 hit = _mm256_cmp_ps(t0, t1, _CMP_LE_OQ);
+
+      hits[k] = (uint32_t) _mm256_movemask_ps(hit);
+      tnear[k] = FLT_MAX;
+
+      if (hits[k] != 0)
+      {
+         __m256 m = _mm256_blendv_ps(_mm256_set1_ps(FLT_MAX), t0, hit);
+
+         m = _mm256_min_ps(m, _mm256_permute2f128_ps(m, m, 1));
+         m = _mm256_min_ps(m, _mm256_shuffle_ps(m, m, _MM_SHUFFLE(1, 0, 3, 2)));
+         m = _mm256_min_ps(m, _mm256_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+
+         tnear[k] = _mm256_cvtss_f32(m);
+         mask = mask | (1u << k);
+      }
+   }
+#elif defined(KERNEL_SSE42)
+/* The rays in two halves of four. */
+   for (size_t k = 0; k < KERNEL_LANES; ++k)
+   {
+      hits[k] = 0;
+      tnear[k] = FLT_MAX;
+   }
+
+   for (size_t r = 0; r < KERNEL_LANES; r += 4)
+   {
+      __m128 o[3], d[3], negative[3];
+
+      for (size_t i = 0; i < 3; ++i)
+      {
+         o[i] = _mm_loadu_ps(origin[i] + r);
+         d[i] = _mm_loadu_ps(inverse_direction[i] + r);
+         negative[i] = _mm_cmplt_ps(d[i], _mm_setzero_ps());
+      }
+
+      const __m128 t1_start = _mm_loadu_ps(limit + r);
+
+      for (size_t k = 0; k < KERNEL_LANES; ++k)
+      {
+         __m128 t0 = _mm_set1_ps(tmin), t1 = t1_start;
+
+         for (size_t i = 0; i < 3; ++i)
+         {
+            const __m128 a = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bounds[2 * i][k]), o[i]), d[i]);
+            const __m128 b = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bounds[2 * i + 1][k]), o[i]), d[i]);
+
+            t0 = _mm_max_ps(_mm_blendv_ps(a, b, negative[i]), t0);
+            t1 = _mm_min_ps(_mm_blendv_ps(b, a, negative[i]), t1);
+         }
+
+         const __m128 hit = _mm_cmple_ps(t0, t1);
+         const uint32_t bits = (uint32_t) _mm_movemask_ps(hit);
+
+         if (bits != 0)
+         {
+            __m128 m = _mm_blendv_ps(_mm_set1_ps(FLT_MAX), t0, hit);
+
+            m = _mm_min_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(1, 0, 3, 2)));
+            m = _mm_min_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+
+            const float t = _mm_cvtss_f32(m);
+
+            hits[k] = hits[k] | (bits << r);
+            tnear[k] = t < tnear[k] ? t : tnear[k];
+            mask = mask | (1u << k);
+         }
+      }
+   }
+#else
+/* Each ray as IntersectChildren tests it. */
+   for (size_t k = 0; k < KERNEL_LANES; ++k)
+   {
+      hits[k] = 0;
+      tnear[k] = FLT_MAX;
+
+      for (size_t r = 0; r < KERNEL_LANES; ++r)
+      {
+         float t0 = tmin, t1 = limit[r];
+
+         for (size_t i = 0; i < 3; ++i)
+         {
+            const size_t enter = 2 * i + (inverse_direction[i][r] < 0.0f ? 1 : 0);
+
+            float a = (bounds[enter][k] - origin[i][r]) * inverse_direction[i][r];
+            float b = (bounds[enter ^ 1][k] - origin[i][r]) * inverse_direction[i][r];
+
+            t0 = a > t0 ? a : t0;
+            t1 = b < t1 ? b : t1;
+         }
+
+         if (t0 <= t1)
+         {
+            hits[k] = hits[k] | (1u << r);
+            tnear[k] = t0 < tnear[k] ? t0 : tnear[k];
+         }
+      }
+
+      mask = mask | (hits[k] != 0 ? 1u << k : 0u);
+   }
+#endif
+
+   return mask;
+}
+
+/* The edge functions over again in double. In float they may round to zero
+   for a ray through an edge or a vertex, and the faces either side could
+   then both turn it away. */
+void ExactEdges(float ax, float ay, float bx, float by, float cx, float cy, float& u, float& v, float& w)
+{
+   u = (float) ((double) cx * (double) by - (double) cy * (double) bx);
+   v = (float) ((double) ax * (double) cy - (double) ay * (double) cx);
+   w = (float) ((double) bx * (double) ay - (double) by * (double) ax);
+
+   return;
+}
+
+/* Sven Woop, Carsten Benthin and Ingo Wald's watertight test. The vertices
+   are moved into the ray's frame, where it runs down z from the origin, and
+   the signs of the three edge functions there say whether it passes inside.
+   An edge shared by two faces gets the same function in both, bar the sign,
+   so no ray slips between them. */
+bool IntersectTriangles(const float* const v0[3], const float* const v1[3], const float* const v2[3], uint32_t first, uint32_t count, const TriangleRay& ray, float tmin, float& t, float& u, float& v, uint32_t& face)
+{
+   bool result = false;
+
+   const uint32_t* k = ray.axis;
+   const float* s = ray.shear;
+   const float* o = ray.origin;
+
+#if defined(KERNEL_AVX2)
+   const __m256 zero = _mm256_setzero_ps();
+   const __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+   const __m256 sx = _mm256_set1_ps(s[0]), sy = _mm256_set1_ps(s[1]), sz = _mm256_set1_ps(s[2]);
+
+   __m256 origin[3];
+
+   for (size_t j = 0; j < 3; ++j)
+   {
+      origin[j] = _mm256_set1_ps(o[k[j]]);
+   }
+
+/* A block of faces at a time; those past the run are masked off. */
+   for (uint32_t i = first; i < first + count; i = i + KERNEL_LANES)
+   {
+      const __m256 valid = _mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_set1_epi32((int) (first + count - i)), lane));
+
+      __m256 a[3], b[3], c[3];
+
+      for (size_t j = 0; j < 3; ++j)
+      {
+         a[j] = _mm256_sub_ps(_mm256_loadu_ps(v0[k[j]] + i), origin[j]);
+         b[j] = _mm256_sub_ps(_mm256_loadu_ps(v1[k[j]] + i), origin[j]);
+         c[j] = _mm256_sub_ps(_mm256_loadu_ps(v2[k[j]] + i), origin[j]);
+      }
+
+      const __m256 ax = _mm256_sub_ps(a[0], _mm256_mul_ps(sx, a[2])), ay = _mm256_sub_ps(a[1], _mm256_mul_ps(sy, a[2]));
+      const __m256 bx = _mm256_sub_ps(b[0], _mm256_mul_ps(sx, b[2])), by = _mm256_sub_ps(b[1], _mm256_mul_ps(sy, b[2]));
+      const __m256 cx = _mm256_sub_ps(c[0], _mm256_mul_ps(sx, c[2])), cy = _mm256_sub_ps(c[1], _mm256_mul_ps(sy, c[2]));
+
+      __m256 eu = _mm256_sub_ps(_mm256_mul_ps(cx, by), _mm256_mul_ps(cy, bx));
+      __m256 ev = _mm256_sub_ps(_mm256_mul_ps(ax, cy), _mm256_mul_ps(ay, cx));
+      __m256 ew = _mm256_sub_ps(_mm256_mul_ps(bx, ay), _mm256_mul_ps(by, ax));
+
+      const __m256 exact = _mm256_and_ps(_mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(eu, zero, _CMP_EQ_OQ), _mm256_cmp_ps(ev, zero, _CMP_EQ_OQ)), _mm256_cmp_ps(ew, zero, _CMP_EQ_OQ)), valid);
+      const uint32_t redo = (uint32_t) _mm256_movemask_ps(exact);
+
+      if (redo != 0)
+      {
+         float p[6][KERNEL_LANES], e[3][KERNEL_LANES];
+
+         const __m256 projected[6] = {ax, ay, bx, by, cx, cy}, edges[3] = {eu, ev, ew};
+
+         for (size_t j = 0; j < 6; ++j)
+         {
+            _mm256_storeu_ps(p[j], projected[j]);
+         }
+
+         for (size_t j = 0; j < 3; ++j)
+         {
+            _mm256_storeu_ps(e[j], edges[j]);
+         }
+
+         for (size_t r = 0; r < KERNEL_LANES; ++r)
+         {
+            if ((redo >> r) & 1)
+            {
+               ExactEdges(p[0][r], p[1][r], p[2][r], p[3][r], p[4][r], p[5][r], e[0][r], e[1][r], e[2][r]);
+            }
+         }
+
+         eu = _mm256_loadu_ps(e[0]);
+         ev = _mm256_loadu_ps(e[1]);
+         ew = _mm256_loadu_ps(e[2]);
+      }
+
+      const __m256 negative = _mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(eu, zero, _CMP_LT_OQ), _mm256_cmp_ps(ev, zero, _CMP_LT_OQ)), _mm256_cmp_ps(ew, zero, _CMP_LT_OQ));
+      const __m256 positive = _mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(eu, zero, _CMP_GT_OQ), _mm256_cmp_ps(ev, zero, _CMP_GT_OQ)), _mm256_cmp_ps(ew, zero, _CMP_GT_OQ));
+
+      const __m256 det = _mm256_add_ps(_mm256_add_ps(eu, ev), ew);
+      const __m256 scaled = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(eu, _mm256_mul_ps(sz, a[2])), _mm256_mul_ps(ev, _mm256_mul_ps(sz, b[2]))), _mm256_mul_ps(ew, _mm256_mul_ps(sz, c[2])));
+
+      const __m256 inverse_det = _mm256_div_ps(_mm256_set1_ps(1.0f), det);
+      const __m256 distance = _mm256_mul_ps(scaled, inverse_det);
+
+      __m256 hit = _mm256_andnot_ps(_mm256_and_ps(negative, positive), valid);
+
+      hit = _mm256_and_ps(hit, _mm256_cmp_ps(det, zero, _CMP_NEQ_OQ));
+      hit = _mm256_and_ps(hit, _mm256_and_ps(_mm256_cmp_ps(distance, _mm256_set1_ps(tmin), _CMP_GT_OQ), _mm256_cmp_ps(distance, _mm256_set1_ps(t), _CMP_LT_OQ)));
+
+      uint32_t bits = (uint32_t) _mm256_movemask_ps(hit);
+
+      if (bits != 0)
+      {
+      /* The nearest, and of equals the first, as the faces taken in turn give. */
+         __m256 m = _mm256_blendv_ps(_mm256_set1_ps(FLT_MAX), distance, hit);
+
+         m = _mm256_min_ps(m, _mm256_permute2f128_ps(m, m, 1));
+         m = _mm256_min_ps(m, _mm256_shuffle_ps(m, m, _MM_SHUFFLE(1, 0, 3, 2)));
+         m = _mm256_min_ps(m, _mm256_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+
+         bits = bits & (uint32_t) _mm256_movemask_ps(_mm256_cmp_ps(distance, m, _CMP_EQ_OQ));
+
+         uint32_t r = 0;
+
+         while (((bits >> r) & 1) == 0)
+         {
+            ++r;
+         }
+
+         float d[KERNEL_LANES], q[KERNEL_LANES], e[2][KERNEL_LANES];
+
+         _mm256_storeu_ps(d, distance);
+         _mm256_storeu_ps(q, inverse_det);
+         _mm256_storeu_ps(e[0], ev);
+         _mm256_storeu_ps(e[1], ew);
+
+         t = d[r];
+         u = e[0][r] * q[r];
+         v = e[1][r] * q[r];
+         face = i + r;
+         result = true;
+      }
+   }
+#elif defined(KERNEL_SSE42)
+   const __m128 zero = _mm_setzero_ps();
+   const __m128i lane = _mm_setr_epi32(0, 1, 2, 3);
+   const __m128 sx = _mm_set1_ps(s[0]), sy = _mm_set1_ps(s[1]), sz = _mm_set1_ps(s[2]);
+
+   __m128 origin[3];
+
+   for (size_t j = 0; j < 3; ++j)
+   {
+      origin[j] = _mm_set1_ps(o[k[j]]);
+   }
+
+/* The blocks in halves of four. */
+   for (uint32_t i = first; i < first + count; i = i + 4)
+   {
+      const __m128 valid = _mm_castsi128_ps(_mm_cmpgt_epi32(_mm_set1_epi32((int) (first + count - i)), lane));
+
+      __m128 a[3], b[3], c[3];
+
+      for (size_t j = 0; j < 3; ++j)
+      {
+         a[j] = _mm_sub_ps(_mm_loadu_ps(v0[k[j]] + i), origin[j]);
+         b[j] = _mm_sub_ps(_mm_loadu_ps(v1[k[j]] + i), origin[j]);
+         c[j] = _mm_sub_ps(_mm_loadu_ps(v2[k[j]] + i), origin[j]);
+      }
+
+      const __m128 ax = _mm_sub_ps(a[0], _mm_mul_ps(sx, a[2])), ay = _mm_sub_ps(a[1], _mm_mul_ps(sy, a[2]));
+      const __m128 bx = _mm_sub_ps(b[0], _mm_mul_ps(sx, b[2])), by = _mm_sub_ps(b[1], _mm_mul_ps(sy, b[2]));
+      const __m128 cx = _mm_sub_ps(c[0], _mm_mul_ps(sx, c[2])), cy = _mm_sub_ps(c[1], _mm_mul_ps(sy, c[2]));
+
+      __m128 eu = _mm_sub_ps(_mm_mul_ps(cx, by), _mm_mul_ps(cy, bx));
+      __m128 ev = _mm_sub_ps(_mm_mul_ps(ax, cy), _mm_mul_ps(ay, cx));
+      __m128 ew = _mm_sub_ps(_mm_mul_ps(bx, ay), _mm_mul_ps(by, ax));
+
+      const __m128 exact = _mm_and_ps(_mm_or_ps(_mm_or_ps(_mm_cmpeq_ps(eu, zero), _mm_cmpeq_ps(ev, zero)), _mm_cmpeq_ps(ew, zero)), valid);
+      const uint32_t redo = (uint32_t) _mm_movemask_ps(exact);
+
+      if (redo != 0)
+      {
+         float p[6][4], e[3][4];
+
+         const __m128 projected[6] = {ax, ay, bx, by, cx, cy}, edges[3] = {eu, ev, ew};
+
+         for (size_t j = 0; j < 6; ++j)
+         {
+            _mm_storeu_ps(p[j], projected[j]);
+         }
+
+         for (size_t j = 0; j < 3; ++j)
+         {
+            _mm_storeu_ps(e[j], edges[j]);
+         }
+
+         for (size_t r = 0; r < 4; ++r)
+         {
+            if ((redo >> r) & 1)
+            {
+               ExactEdges(p[0][r], p[1][r], p[2][r], p[3][r], p[4][r], p[5][r], e[0][r], e[1][r], e[2][r]);
+            }
+         }
+
+         eu = _mm_loadu_ps(e[0]);
+         ev = _mm_loadu_ps(e[1]);
+         ew = _mm_loadu_ps(e[2]);
+      }
+
+      const __m128 negative = _mm_or_ps(_mm_or_ps(_mm_cmplt_ps(eu, zero), _mm_cmplt_ps(ev, zero)), _mm_cmplt_ps(ew, zero));
+      const __m128 positive = _mm_or_ps(_mm_or_ps(_mm_cmpgt_ps(eu, zero), _mm_cmpgt_ps(ev, zero)), _mm_cmpgt_ps(ew, zero));
+
+      const __m128 det = _mm_add_ps(_mm_add_ps(eu, ev), ew);
+      const __m128 scaled = _mm_add_ps(_mm_add_ps(_mm_mul_ps(eu, _mm_mul_ps(sz, a[2])), _mm_mul_ps(ev, _mm_mul_ps(sz, b[2]))), _mm_mul_ps(ew, _mm_mul_ps(sz, c[2])));
+
+      const __m128 inverse_det = _mm_div_ps(_mm_set1_ps(1.0f), det);
+      const __m128 distance = _mm_mul_ps(scaled, inverse_det);
+
+      __m128 hit = _mm_andnot_ps(_mm_and_ps(negative, positive), valid);
+
+      hit = _mm_and_ps(hit, _mm_cmpneq_ps(det, zero));
+      hit = _mm_and_ps(hit, _mm_and_ps(_mm_cmpgt_ps(distance, _mm_set1_ps(tmin)), _mm_cmplt_ps(distance, _mm_set1_ps(t))));
+
+      uint32_t bits = (uint32_t) _mm_movemask_ps(hit);
+
+      if (bits != 0)
+      {
+         __m128 m = _mm_blendv_ps(_mm_set1_ps(FLT_MAX), distance, hit);
+
+         m = _mm_min_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(1, 0, 3, 2)));
+         m = _mm_min_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+
+         bits = bits & (uint32_t) _mm_movemask_ps(_mm_cmpeq_ps(distance, m));
+
+         uint32_t r = 0;
+
+         while (((bits >> r) & 1) == 0)
+         {
+            ++r;
+         }
+
+         float d[4], q[4], e[2][4];
+
+         _mm_storeu_ps(d, distance);
+         _mm_storeu_ps(q, inverse_det);
+         _mm_storeu_ps(e[0], ev);
+         _mm_storeu_ps(e[1], ew);
+
+         t = d[r];
+         u = e[0][r] * q[r];
+         v = e[1][r] * q[r];
+         face = i + r;
+         result = true;
+      }
+   }
+#else
+   for (uint32_t i = first; i < first + count; ++i)
+   {
+      const float a[3] = {v0[k[0]][i] - o[k[0]], v0[k[1]][i] - o[k[1]], v0[k[2]][i] - o[k[2]]};
+      const float b[3] = {v1[k[0]][i] - o[k[0]], v1[k[1]][i] - o[k[1]], v1[k[2]][i] - o[k[2]]};
+      const float c[3] = {v2[k[0]][i] - o[k[0]], v2[k[1]][i] - o[k[1]], v2[k[2]][i] - o[k[2]]};
+
+      const float ax = a[0] - s[0] * a[2], ay = a[1] - s[1] * a[2];
+      const float bx = b[0] - s[0] * b[2], by = b[1] - s[1] * b[2];
+      const float cx = c[0] - s[0] * c[2], cy = c[1] - s[1] * c[2];
+
+      float eu = cx * by - cy * bx;
+      float ev = ax * cy - ay * cx;
+      float ew = bx * ay - by * ax;
+
+      if (eu == 0.0f || ev == 0.0f || ew == 0.0f)
+      {
+         ExactEdges(ax, ay, bx, by, cx, cy, eu, ev, ew);
+      }
+
+   /* Inside only with no two of the signs opposed. */
+      if ((eu < 0.0f || ev < 0.0f || ew < 0.0f) && (eu > 0.0f || ev > 0.0f || ew > 0.0f))
+      {
+         continue;
+      }
+
+      const float det = eu + ev + ew;
+
+      if (det == 0.0f)
+      {
+         continue;
+      }
+
+      const float scaled = eu * (s[2] * a[2]) + ev * (s[2] * b[2]) + ew * (s[2] * c[2]);
+
+      const float inverse_det = 1.0f / det;
+      const float distance = scaled * inverse_det;
+
+      if (distance > tmin && distance < t)
+      {
+         t = distance;
+         u = ev * inverse_det;
+         v = ew * inverse_det;
+         face = i;
+         result = true;
+      }
+   }
+#endif
+
+   return result;
+}
+
+/* Ken Perlin's improved noise, as in perlin.h. The eight wide sets have
+   Noise8 below in its place. */
+
+#if !defined(KERNEL_AVX2)
+
+float Fade(float t)
+{
+   return t * t * t * (t * (t * 6 - 15) + 10);
+}
+
+float Lerp(float t, float a, float b)
+{
+   return a + t * (b - a);
+}
+
+float Grad(int hash, float x, float y, float z)
+{
+   int h = hash & 15;
+
+   float u = h < 8 ? x : y;
+   float v = h < 4 ? y : h == 12 || h == 14 ? x : z;
+
+   return ((h & 1) == 0 ? u : -u) + ((h & 2) == 0 ? v : -v);
+}
+
+float Noise(const int p[512], float x, float y, float z)
+{
+   int X = (int) floorf(x) & 255;
+   int Y = (int) floorf(y) & 255;
+   int Z = (int) floorf(z) & 255;
+   x -= floorf(x);
+   y -= floorf(y);
+   z -= floorf(z);
+
+   float u = Fade(x);
+   float v = Fade(y);
+   float w = Fade(z);
+
+   int A = p[X    ] + Y; int AA = p[A] + Z; int AB = p[A + 1] + Z;
+   int B = p[X + 1] + Y; int BA = p[B] + Z; int BB = p[B + 1] + Z;
+
+   return Lerp(w, Lerp(v, Lerp(u, Grad(p[AA    ], x    , y    , z    ),
+                                  Grad(p[BA    ], x - 1, y    , z    )),
+                          Lerp(u, Grad(p[AB    ], x    , y - 1, z    ),
+                                  Grad(p[BB    ], x - 1, y - 1, z    ))),
+                  Lerp(v, Lerp(u, Grad(p[AA + 1], x    , y    , z - 1),
+                                  Grad(p[BA + 1], x - 1, y    , z - 1)),
+                          Lerp(u, Grad(p[AB + 1], x    , y - 1, z - 1),
+                                  Grad(p[BB + 1], x - 1, y - 1, z - 1))));
+}
+
+#endif
+
+#if defined(KERNEL_AVX2)
+
+/* The same noise at eight points, one per lane, every step rounding as the
+   scalar one does. */
+
+__m256 Fade8(__m256 t)
+{
+   const __m256 a = _mm256_mul_ps(_mm256_mul_ps(t, t), t);
+   const __m256 b = _mm256_sub_ps(_mm256_mul_ps(t, _mm256_set1_ps(6.0f)), _mm256_set1_ps(15.0f));
+
+   return _mm256_mul_ps(a, _mm256_add_ps(_mm256_mul_ps(t, b), _mm256_set1_ps(10.0f)));
+}
+
+__m256 Lerp8(__m256 t, __m256 a, __m256 b)
+{
+   return _mm256_add_ps(a, _mm256_mul_ps(t, _mm256_sub_ps(b, a)));
+}
+
+__m256 Grad8(__m256i hash, __m256 x, __m256 y, __m256 z)
+{
+   const __m256i h = _mm256_and_si256(hash, _mm256_set1_epi32(15));
+
+   const __m256 below8 = _mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_set1_epi32(8), h));
+   const __m256 below4 = _mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_set1_epi32(4), h));
+   const __m256 x_axis = _mm256_castsi256_ps(_mm256_or_si256(_mm256_cmpeq_epi32(h, _mm256_set1_epi32(12)), _mm256_cmpeq_epi32(h, _mm256_set1_epi32(14))));
+
+   const __m256 u = _mm256_blendv_ps(y, x, below8);
+   const __m256 v = _mm256_blendv_ps(_mm256_blendv_ps(z, x, x_axis), y, below4);
+
+/* Bits 0 and 1 of the hash moved to the sign bit negate u and v. */
+   const __m256 su = _mm256_castsi256_ps(_mm256_slli_epi32(h, 31));
+   const __m256 sv = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_srli_epi32(h, 1), 31));
+
+   return _mm256_add_ps(_mm256_xor_ps(u, su), _mm256_xor_ps(v, sv));
+}
+
+__m256 Noise8(const int p[512], __m256 x, __m256 y, __m256 z)
+{
+   const __m256 fx = _mm256_floor_ps(x), fy = _mm256_floor_ps(y), fz = _mm256_floor_ps(z);
+   const __m256i mask = _mm256_set1_epi32(255), one = _mm256_set1_epi32(1);
+
+   const __m256i X = _mm256_and_si256(_mm256_cvttps_epi32(fx), mask);
+   const __m256i Y = _mm256_and_si256(_mm256_cvttps_epi32(fy), mask);
+   const __m256i Z = _mm256_and_si256(_mm256_cvttps_epi32(fz), mask);
+
+   x = _mm256_sub_ps(x, fx);
+   y = _mm256_sub_ps(y, fy);
+   z = _mm256_sub_ps(z, fz);
+
+   const __m256 u = Fade8(x);
+   const __m256 v = Fade8(y);
+   const __m256 w = Fade8(z);
+
+   const __m256i A  = _mm256_add_epi32(_mm256_i32gather_epi32(p, X, 4), Y);
+   const __m256i AA = _mm256_add_epi32(_mm256_i32gather_epi32(p, A, 4), Z);
+   const __m256i AB = _mm256_add_epi32(_mm256_i32gather_epi32(p, _mm256_add_epi32(A, one), 4), Z);
+   const __m256i B  = _mm256_add_epi32(_mm256_i32gather_epi32(p, _mm256_add_epi32(X, one), 4), Y);
+   const __m256i BA = _mm256_add_epi32(_mm256_i32gather_epi32(p, B, 4), Z);
+   const __m256i BB = _mm256_add_epi32(_mm256_i32gather_epi32(p, _mm256_add_epi32(B, one), 4), Z);
+
+   const __m256 x1 = _mm256_sub_ps(x, _mm256_set1_ps(1.0f));
+   const __m256 y1 = _mm256_sub_ps(y, _mm256_set1_ps(1.0f));
+   const __m256 z1 = _mm256_sub_ps(z, _mm256_set1_ps(1.0f));
+
+   const __m256 g0 = Grad8(_mm256_i32gather_epi32(p, AA, 4), x,  y,  z);
+   const __m256 g1 = Grad8(_mm256_i32gather_epi32(p, BA, 4), x1, y,  z);
+   const __m256 g2 = Grad8(_mm256_i32gather_epi32(p, AB, 4), x,  y1, z);
+   const __m256 g3 = Grad8(_mm256_i32gather_epi32(p, BB, 4), x1, y1, z);
+   const __m256 g4 = Grad8(_mm256_i32gather_epi32(p, _mm256_add_epi32(AA, one), 4), x,  y,  z1);
+   const __m256 g5 = Grad8(_mm256_i32gather_epi32(p, _mm256_add_epi32(BA, one), 4), x1, y,  z1);
+   const __m256 g6 = Grad8(_mm256_i32gather_epi32(p, _mm256_add_epi32(AB, one), 4), x,  y1, z1);
+   const __m256 g7 = Grad8(_mm256_i32gather_epi32(p, _mm256_add_epi32(BB, one), 4), x1, y1, z1);
+
+   return Lerp8(w, Lerp8(v, Lerp8(u, g0, g1), Lerp8(u, g2, g3)),
+                   Lerp8(v, Lerp8(u, g4, g5), Lerp8(u, g6, g7)));
+}
+
+#endif
+
+float Turbulence(const int p[512], float x, float y, float z, size_t octaves)
+{
+   float noise = 0.0f;
+   size_t i = 0, j = 1;
+
+#if defined(KERNEL_AVX2)
+/* Eight octaves at a time, their sum still taken in order. */
+   for (; i < octaves; i += 8, j = j << 8)
+   {
+      float scale[8], octave[8];
+
+      for (size_t k = 0; k < 8; ++k)
+      {
+         scale[k] = (float) (j << k);
+      }
+
+      const __m256 s = _mm256_loadu_ps(scale);
+
+      _mm256_storeu_ps(octave, _mm256_div_ps(Noise8(p, _mm256_mul_ps(_mm256_set1_ps(x), s), _mm256_mul_ps(_mm256_set1_ps(y), s), _mm256_mul_ps(_mm256_set1_ps(z), s)), s));
+
+      for (size_t k = 0; k < 8 && i + k < octaves; ++k)
+      {
+         noise = noise + octave[k];
+      }
+   }
+#else
+   for (; i < octaves; ++i, j = 2 * j)
+   {
+      noise = noise + Noise(p, x * j, y * j, z * j) / j;
+   }
+#endif
+
+   return noise;
+}
+
+void ConvertToBGR(const float* rgb, size_t count, uint8_t* bgr)
+{
+   size_t i = 0;
+
+#if defined(KERNEL_SSE42)
+/* Four pixels at a time. The saturating packs clamp as the scalar code does. */
+   const __m128 scale = _mm_set1_ps(255.0f);
+   const __m128i order = _mm_setr_epi8(2, 1, 0, 5, 4, 3, 8, 7, 6, 11, 10, 9, -1, -1, -1, -1);
+
+   for (; i + 4 <= count; i += 4)
+   {
+      const float* s = rgb + 3 * i;
+
+      const __m128i a = _mm_cvttps_epi32(_mm_mul_ps(_mm_loadu_ps(s),     scale));
+      const __m128i b = _mm_cvttps_epi32(_mm_mul_ps(_mm_loadu_ps(s + 4), scale));
+      const __m128i c = _mm_cvttps_epi32(_mm_mul_ps(_mm_loadu_ps(s + 8), scale));
+
+      const __m128i bytes = _mm_shuffle_epi8(_mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, c)), order);
+
+      _mm_storel_epi64((__m128i*) (bgr + 3 * i), bytes);
+
+      const int last = _mm_cvtsi128_si32(_mm_srli_si128(bytes, 8));
+      memcpy(bgr + 3 * i + 8, &last, 4);
+   }
+#endif
+
+   for (; i < count; ++i)
+   {
+      for (size_t k = 0; k < 3; ++k)
+      {
+         int c = (int) (rgb[3 * i + 2 - k] * 255.0f);
+
+         if (c <   0) c = 0;
+         if (c > 255) c = 255;
+
+         bgr[3 * i + k] = (uint8_t) c;
+      }
+   }
+
+   return;
+}
+
+}
+
+extern const KernelTable KERNEL_TABLE = {KERNEL_NAME, IntersectChildren, IntersectChildrenPacket, IntersectTriangles, Turbulence, ConvertToBGR};
+
+#endif
@@ -0,0 +1,9 @@
+/* File: kernels_sse42.cpp; Mode: C++; Tab-width: 3; Author: Simon Flannery;  */
+
+/* The kernels built with SSE4.2 enabled; only run where Kernels finds it. */
+
+#define KERNEL_SSE42
+#define KERNEL_TABLE kernels_sse42
+#define KERNEL_NAME "sse42"
+
+#include "kernels_isa.h"
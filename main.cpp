@@ -9,22 +9,36 @@
 #include <string.h>
 #include <assert.h>
 
+#include <string>
+#include <chrono>
+
 #include "math.h"
 #include "camera.h"
 #include "scene.h"
+#include "object.h"
 #include "pathtracer.h"
+#include "scheduler.h"
+#include "renderer.h"
+#include "sampler.h"
 #include "image.h"
+#include "kernels.h"
+#include "wavefront.h"
 
 /* Render the scene to an image. */
-void Biscuit(Scene* scene, const char* szImageFileName, const size_t width, const size_t height, size_t max_bounces, const float epsilon, const size_t samples_per_pixel);
+void Biscuit(Scene* scene, const char* szImageFileName, const size_t width, const size_t height, size_t max_bounces, const size_t rr_depth, const float epsilon, const size_t samples_per_pixel, Scheduler& scheduler, const size_t seed, const Sampler::Type sampler_type, const float noise_threshold, const size_t min_samples, const char* szSampleFileName, const float checkpoint_seconds, const size_t checkpoint_passes, const char* szStateFileName, const bool resume, const float time_limit, const bool packets, const Renderer::Integrator integrator, const size_t wavefront_paths, const bool reorder, const std::chrono::steady_clock::time_point launch);
 
 int main(size_t argc, char* argv[])
 {
-   srand((unsigned int) time(NULL));
+   const auto launch = std::chrono::steady_clock::now();
 
-   size_t width = 0, height = 0, max_bounces = 0, samples_per_pixel = 10;
-   float epsilon = EPSILON;
-   char* szInputFileName = NULL, * szImageFileName = NULL;
+   size_t width = 0, height = 0, max_bounces = 0, rr_depth = RR_DEPTH, samples_per_pixel = 10, num_threads = 0, seed = 0;
+   float epsilon = EPSILON, noise_threshold = 0.0f, checkpoint_seconds = 0.0f, time_limit = 0.0f;
+   size_t min_samples = ADAPTIVE_MIN_SAMPLES, checkpoint_passes = 0, wavefront_paths = WAVEFRONT_PATHS;
+   bool resume = false, samples_given = false, self_test = false, packets = true, reorder = false;
+   BVH::Type bvh_type = BVH::Type::SAH;
+   Sampler::Type sampler_type = Sampler::Type::Random;
+   Renderer::Integrator integrator = Renderer::Integrator::Recursive;
+   char* szInputFileName = NULL, * szImageFileName = NULL, * szSampleFileName = NULL, * szStateFileName = NULL, * szCacheDirectory = NULL, * szInstructionSet = NULL;
 
    for (size_t i = 1; i < argc; ++i)
    {
@@ -49,24 +63,171 @@ int main(size_t argc, char* argv[])
       {
          ++i; assert(i < argc);
          samples_per_pixel = atoi(argv[i]);
+         samples_given = true;
       }
       else if (strcmp(argv[i], "-bounces") == 0)
       {
          ++i; assert(i < argc);
          max_bounces = atoi(argv[i]);
       }
+      else if (strcmp(argv[i], "-rr-depth") == 0)
+      {
+         ++i; assert(i < argc);
+         rr_depth = atoi(argv[i]);
+      }
       else if (strcmp(argv[i], "-epsilon") == 0)
       {
          ++i; assert(i < argc);
          epsilon = (float) atof(argv[i]);
       }
+      else if (strcmp(argv[i], "-threads") == 0)
+      {
+         ++i; assert(i < argc);
+         num_threads = atoi(argv[i]);
+      }
+      else if (strcmp(argv[i], "-seed") == 0)
+      {
+         ++i; assert(i < argc);
+         seed = atoi(argv[i]);
+      }
+      else if (strcmp(argv[i], "-noise-threshold") == 0)
+      {
+         ++i; assert(i < argc);
+         noise_threshold = (float) atof(argv[i]);
+      }
+      else if (strcmp(argv[i], "-min-samples") == 0)
+      {
+         ++i; assert(i < argc);
+         min_samples = atoi(argv[i]);
+      }
+      else if (strcmp(argv[i], "-spp-output") == 0)
+      {
+         ++i; assert(i < argc);
+         szSampleFileName = argv[i];
+      }
+      else if (strcmp(argv[i], "-checkpoint") == 0)
+      {
+         ++i; assert(i < argc);
+         checkpoint_seconds = (float) atof(argv[i]);
+      }
+      else if (strcmp(argv[i], "-checkpoint-passes") == 0)
+      {
+         ++i; assert(i < argc);
+         checkpoint_passes = atoi(argv[i]);
+      }
+      else if (strcmp(argv[i], "-state") == 0)
+      {
+         ++i; assert(i < argc);
+         szStateFileName = argv[i];
+      }
+      else if (strcmp(argv[i], "-time-limit") == 0)
+      {
+         ++i; assert(i < argc);
+         time_limit = (float) atof(argv[i]);
+      }
+      else if (strcmp(argv[i], "-resume") == 0)
+      {
+         resume = true;
+      }
+      else if (strcmp(argv[i], "-cache") == 0)
+      {
+         ++i; assert(i < argc);
+         szCacheDirectory = argv[i];
+      }
+      else if (strcmp(argv[i], "-isa") == 0)
+      {
+         ++i; assert(i < argc);
+         szInstructionSet = argv[i];
+      }
+      else if (strcmp(argv[i], "-selftest") == 0)
+      {
+         self_test = true;
+      }
+      else if (strcmp(argv[i], "-no-packets") == 0)
+      {
+         packets = false;
+      }
+      else if (strcmp(argv[i], "-integrator") == 0)
+      {
+         ++i; assert(i < argc);
+         integrator = strcmp(argv[i], "wavefront") == 0 ? Renderer::Integrator::Wavefront : Renderer::Integrator::Recursive;
+      }
+      else if (strcmp(argv[i], "-wavefront-paths") == 0)
+      {
+         ++i; assert(i < argc);
+         wavefront_paths = atoi(argv[i]);
+      }
+      else if (strcmp(argv[i], "-ray-sort") == 0)
+      {
+         reorder = true;
+      }
+      else if (strcmp(argv[i], "-bvh") == 0)
+      {
+         ++i; assert(i < argc);
+         bvh_type = strcmp(argv[i], "lbvh") == 0 ? BVH::Type::Morton : BVH::Type::SAH;
+      }
+      else if (strcmp(argv[i], "-sampler") == 0)
+      {
+         ++i; assert(i < argc);
+
+         if (strcmp(argv[i], "sobol") == 0)
+         {
+            sampler_type = Sampler::Type::Sobol;
+         }
+         else if (strcmp(argv[i], "halton") == 0)
+         {
+            sampler_type = Sampler::Type::Halton;
+         }
+         else
+         {
+            sampler_type = Sampler::Type::Random;
+         }
+      }
+   }
+
+/* The best kernels the processor runs, unless others are asked for. */
+   if (Kernels::Select(szInstructionSet) == false)
+   {
+      printf("The %s kernels are unknown or not supported here; using the best that are\n", szInstructionSet);
+
+      Kernels::Select();
+   }
+
+   if (self_test != false)
+   {
+      bool passed = Kernels::SelfTest();
+
+      passed = CSGPair::SelfTest() && passed;
+
+      return passed != false ? 0 : 1;
    }
 
-   Scene* scene = new Scene(szInputFileName);
+/* With only a time limit, the render runs until the deadline. */
+   if (time_limit > 0.0f && samples_given == false)
+   {
+      samples_per_pixel = UINT32_MAX;
+   }
+
+/* Checkpoints and resuming keep the state next to the image unless told otherwise. */
+   std::string state;
+
+   if (szStateFileName == NULL && szImageFileName != NULL && (checkpoint_seconds > 0.0f || checkpoint_passes > 0 || resume != false))
+   {
+      state = std::string(szImageFileName) + ".state";
+      szStateFileName = &state[0];
+   }
+
+   Scheduler scheduler(num_threads);
+
+   auto load_start = std::chrono::steady_clock::now();
+
+   Scene* scene = new Scene(szInputFileName, &scheduler, bvh_type, szCacheDirectory);
+
+   double load_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - load_start).count();
 
    auto start_time = time(NULL);
 
-   Biscuit(scene, szImageFileName, width, height, max_bounces, epsilon, samples_per_pixel);
+   Biscuit(scene, szImageFileName, width, height, max_bounces, rr_depth, epsilon, samples_per_pixel, scheduler, seed, sampler_type, noise_threshold, min_samples, szSampleFileName, checkpoint_seconds, checkpoint_passes, szStateFileName, resume, time_limit, packets, integrator, wavefront_paths, reorder, launch);
 
    auto finish_time = time(NULL);
 
@@ -82,6 +243,7 @@ int main(size_t argc, char* argv[])
    int hours = (int) (delta_time / (60 * 60));
 
    printf("\n\n");
+   printf("Loading time: %.2f s, of which BVH build %.2f s\n", load_time, scene->GetBuildTime());
    printf("Rendering time: %02d:%02d:%02d\n", hours, minutes, seconds);
 
    delete scene;
@@ -89,67 +251,45 @@ int main(size_t argc, char* argv[])
    return 0;
 }
 
-void Biscuit(Scene* scene, const char* szImageFileName, const size_t width, const size_t height, size_t max_bounces, const float epsilon, const size_t samples_per_pixel)
+void Biscuit(Scene* scene, const char* szImageFileName, const size_t width, const size_t height, size_t max_bounces, const size_t rr_depth, const float epsilon, const size_t samples_per_pixel, Scheduler& scheduler, const size_t seed, const Sampler::Type sampler_type, const float noise_threshold, const size_t min_samples, const char* szSampleFileName, const float checkpoint_seconds, const size_t checkpoint_passes, const char* szStateFileName, const bool resume, const float time_limit, const bool packets, const Renderer::Integrator integrator, const size_t wavefront_paths, const bool reorder, const std::chrono::steady_clock::time_point launch)
 {
-   PathTracer* trace = new PathTracer(scene, max_bounces);
+   PathTracer* trace = new PathTracer(scene, max_bounces, rr_depth);
 
    Camera* camera = scene->GetCamera();
 
    if (camera != NULL && scene->GetGroup() != NULL)
    {
-      const size_t num_pixels = height * width;
-      int last_percent = 0;
-
-      Image capture(width, height);
-
-      for (size_t i = 0; i < width; ++i)
-      {
-         for (size_t j = 0; j < height; ++j)
-         {
-            float pc = (float) (i * width + j);
-            int percent = (int) (100.0f * (pc / num_pixels));
+      printf("Rendering with %d threads and the %s kernels\n", (int) scheduler.GetNumThreads(), Kernels::Get().name);
 
-            if (percent != last_percent)
-            {
-               printf("%2d%c ", percent, '%'); fflush(NULL);
+      Image capture(width, height), samples(width, height);
 
-               last_percent = percent;
-            }
+      Renderer renderer(scene, trace, &scheduler, samples_per_pixel, seed, sampler_type);
 
-            color3f color;
-
-            for (size_t t = 0; t < samples_per_pixel; ++t)
-            {
-               point2f jitter(random_float(), random_float());
-
-               point2f p((i + jitter[x]) / (float) width,
-                         (j + jitter[y]) / (float) height);
-
-               const Ray ray = camera->GenerateRay(p);
-
-               color3f color_contribution = trace->TracePath(ray, 0);
-
-               color = color + color_contribution;
-            }
-
-            const float s = 1.0f / (float) samples_per_pixel;
+      if (noise_threshold > 0.0f)
+      {
+         renderer.SetAdaptive(noise_threshold, min_samples);
+      }
 
-            color[r] = (float) sqrt(color[r] * s);
-            color[g] = (float) sqrt(color[g] * s);
-            color[b] = (float) sqrt(color[b] * s);
+      renderer.SetCheckpoint(szImageFileName, checkpoint_seconds, checkpoint_passes);
+      renderer.SetStateFile(szStateFileName, resume);
+      renderer.SetPackets(packets);
+      renderer.SetIntegrator(integrator);
+      renderer.SetWavefront(wavefront_paths, reorder);
 
-            capture.SetPixel(i, j, color);
-         }
+   /* The time limit counts from launch, so loading the scene is part of it. */
+      if (time_limit > 0.0f)
+      {
+         renderer.SetDeadline(launch + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<float>(time_limit)));
       }
 
-      Image::Format type = Image::Format::TGA;
+      renderer.Render(capture, szSampleFileName != NULL ? &samples : NULL);
+
+      capture.Save(szImageFileName);
 
-      if (strstr(szImageFileName, ".bmp") != NULL)
+      if (szSampleFileName != NULL)
       {
-         type = Image::Format::BMP;
+         samples.Save(szSampleFileName);
       }
-
-      capture.Save(szImageFileName, type);
    }
 
    delete trace;
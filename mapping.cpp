@@ -0,0 +1,133 @@
+/* File: mapping.cpp; Mode: C++; Tab-width: 3; Author: Simon Flannery;        */
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "mapping.h"
+
+#ifdef _WIN32
+
+MappedFile::MappedFile() : data(NULL), size(0), file(INVALID_HANDLE_VALUE), mapping(NULL)
+{
+}
+
+bool MappedFile::Open(const char* szFileName)
+{
+   Close();
+
+   file = CreateFileA(szFileName, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+
+   LARGE_INTEGER length;
+
+   if (file == INVALID_HANDLE_VALUE || GetFileSizeEx(file, &length) == FALSE || length.QuadPart == 0)
+   {
+      Close();
+
+      return false;
+   }
+
+   mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+
+   if (mapping != NULL)
+   {
+      data = (const uint8_t*) MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+   }
+
+   if (data == NULL)
+   {
+      Close();
+
+      return false;
+   }
+
+   size = (size_t) length.QuadPart;
+
+   return true;
+}
+
+void MappedFile::Close()
+{
+   if (data != NULL)
+   {
+      UnmapViewOfFile(data);
+   }
+
+   if (mapping != NULL)
+   {
+      CloseHandle(mapping);
+   }
+
+   if (file != INVALID_HANDLE_VALUE)
+   {
+      CloseHandle(file);
+   }
+
+   data = NULL;
+   size = 0;
+   mapping = NULL;
+   file = INVALID_HANDLE_VALUE;
+
+   return;
+}
+
+#else
+
+MappedFile::MappedFile() : data(NULL), size(0)
+{
+}
+
+bool MappedFile::Open(const char* szFileName)
+{
+   Close();
+
+   int file = open(szFileName, O_RDONLY);
+
+   if (file < 0)
+   {
+      return false;
+   }
+
+   struct stat status;
+
+   if (fstat(file, &status) == 0 && status.st_size > 0)
+   {
+      void* view = mmap(NULL, (size_t) status.st_size, PROT_READ, MAP_SHARED, file, 0);
+
+      if (view != MAP_FAILED)
+      {
+         data = (const uint8_t*) view;
+         size = (size_t) status.st_size;
+      }
+   }
+
+/* The mapping holds its own reference to the file. */
+   close(file);
+
+   return data != NULL;
+}
+
+void MappedFile::Close()
+{
+   if (data != NULL)
+   {
+      munmap((void*) data, size);
+   }
+
+   data = NULL;
+   size = 0;
+
+   return;
+}
+
+#endif
+
+MappedFile::~MappedFile()
+{
+   Close();
+}
@@ -0,0 +1,38 @@
+/* File: mapping.h; Mode: C++; Tab-width: 3; Author: Simon Flannery;          */
+
+#ifndef MAPPING_H
+#define MAPPING_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* A whole file mapped read only into memory. The pages are read in by the
+   system as they are touched and are shared with any other process mapping
+   the same file. */
+
+class MappedFile
+{
+public:
+   MappedFile();
+   ~MappedFile();
+
+   bool Open(const char* szFileName);
+   void Close();
+
+   const uint8_t* GetData() const {   return data;   }
+   size_t GetSize()         const {   return size;   }
+
+private:
+   MappedFile(const MappedFile&);
+   MappedFile& operator = (const MappedFile&);
+
+   const uint8_t* data;
+   size_t size;
+
+#ifdef _WIN32
+   void* file;
+   void* mapping;
+#endif
+};
+
+#endif
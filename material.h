@@ -7,10 +7,17 @@
 #include "ray.h"
 #include "hit.h"
 #include "perlin.h"
+#include "sampler.h"
+#include "pdf.h"
+
+#define MATERIAL_TYPES 5 /* The number of Material::Type values. */
 
 class Material
 {
 public:
+/* The families of material, by which the wavefront integrator queues its hits. */
+   enum class Type { Diffuse, Reflective, Glass, Noise, Checkerboard };
+
    Material() { }
 
    Material(const vector3f& c)
@@ -22,15 +29,35 @@ public:
 
    virtual color3f Emitted(const point3f&) const { return color3f(0.0f, 0.0f, 0.0f); }
 
+   virtual bool IsEmitter() const {   return false;   }
+
    virtual bool IsSpecular(const point3f&) const {   return false;   }
 
-   virtual bool Scatter(const Ray& ray, const Hit& hit, vector3f& scattered) const = 0;
+   virtual Type GetType() const = 0;
 
-// virtual float ScatterPdf(const Hit& hit, const vector3f& scattered) const {   return 0.0f;   }
+   virtual bool Scatter(const Ray& ray, const Hit& hit, vector3f& scattered, Sampler& sampler) const = 0;
+
+/* The pdf of a direction Scatter may return, with the BRDF times the cosine
+   equal to the colour times this pdf. Zero marks a perfect mirror or glass,
+   whose one direction cannot be weighed against a light sample. */
+   virtual float ScatterPdf(const Ray&, const Hit&, const vector3f&) const {   return 0.0f;   }
 
    virtual ~Material() { }
 
 protected:
+/* Cosine lobe on the side the ray arrived from. */
+   static float LambertianPdf(const Ray& ray, const Hit& hit, const vector3f& scattered)
+   {
+      float cosine = vector3f::Dot(hit.GetNormal(), scattered);
+
+      if (vector3f::Dot(hit.GetNormal(), ray.GetDirection()) > 0.0f)
+      {
+         cosine = -cosine;
+      }
+
+      return cosine > 0.0f ? cosine / PI : 0.0f;
+   }
+
    color3f color;
 
 private:
@@ -45,20 +72,22 @@ public:
 
    }
 
-   virtual bool Scatter(const Ray& ray, const Hit& hit, vector3f& scattered) const
+   virtual Type GetType() const {   return Type::Diffuse;   }
+
+   virtual bool Scatter(const Ray& ray, const Hit& hit, vector3f& scattered, Sampler& sampler) const
    {
       return true;
    }
 
-// virtual float ScatterPdf(const Hit& hit, const vector3f& scattered) const
-// {
-//    float cosine = vector3f::Dot(hit.GetNormal(), scattered);
-//
-//    return (float) fmax(FLT_EPSILON, cosine / PI);
-// }
+   virtual float ScatterPdf(const Ray& ray, const Hit& hit, const vector3f& scattered) const
+   {
+      return LambertianPdf(ray, hit, scattered);
+   }
 
    virtual color3f Emitted(const point3f&) const {   return glow;   }
 
+   virtual bool IsEmitter() const {   return glow[r] > 0.0f || glow[g] > 0.0f || glow[b] > 0.0f;   }
+
 protected:
 private:
    color3f glow;
@@ -74,11 +103,40 @@ public:
 
    virtual bool IsSpecular(const point3f&) const { return true; }
 
-   virtual bool Scatter(const Ray& ray, const Hit& hit, vector3f& scattered) const
+   virtual Type GetType() const {   return Type::Reflective;   }
+
+   virtual bool Scatter(const Ray& ray, const Hit& hit, vector3f& scattered, Sampler& sampler) const
    {
-      scattered = ReflectDirection(ray.GetDirection(), hit.GetNormal()) + blur * vector3f::RandomInHemisphere(hit.GetNormal());
+      vector3f reflected = ReflectDirection(ray.GetDirection(), hit.GetNormal());
 
-      return true;
+      if (blur <= 0.0f)
+      {
+         scattered = reflected;
+
+         return true;
+      }
+
+      scattered = GlossyPdf(reflected, GetExponent()).Generate(sampler);
+
+   /* Directions from the lobe that dip below the surface are absorbed. */
+      return vector3f::Dot(scattered, hit.GetNormal()) * vector3f::Dot(reflected, hit.GetNormal()) > 0.0f;
+   }
+
+   virtual float ScatterPdf(const Ray& ray, const Hit& hit, const vector3f& scattered) const
+   {
+      if (blur <= 0.0f)
+      {
+         return 0.0f;
+      }
+
+      vector3f reflected = ReflectDirection(ray.GetDirection(), hit.GetNormal());
+
+      if (vector3f::Dot(scattered, hit.GetNormal()) * vector3f::Dot(reflected, hit.GetNormal()) <= 0.0f)
+      {
+         return 0.0f;
+      }
+
+      return GlossyPdf(reflected, GetExponent()).GetValue(scattered);
    }
 
 protected:
@@ -88,6 +146,9 @@ protected:
    }
 
 private:
+/* A lobe that strays about blur radians from the mirror direction, as the old perturbation did. */
+   float GetExponent() const {   return (float) fmax(1.0f, 2.0f / (blur * blur) - 2.0f);   }
+
    float blur;
 };
 
@@ -101,7 +162,9 @@ public:
 
    virtual bool IsSpecular(const point3f&) const { return true; }
 
-   virtual bool Scatter(const Ray& ray, const Hit& hit, vector3f& scattered) const
+   virtual Type GetType() const {   return Type::Glass;   }
+
+   virtual bool Scatter(const Ray& ray, const Hit& hit, vector3f& scattered, Sampler& sampler) const
    {
       float refraction_ratio = 1.0f / refraction_index;
 
@@ -119,7 +182,7 @@ public:
       float sin_theta = (float) sqrt(1.0f - (cos_theta * cos_theta));
 
       if ((refraction_ratio * sin_theta) > 1.0f ||
-           Reflectance(cos_theta, refraction_ratio) > random_float())
+           Reflectance(cos_theta, refraction_ratio) > sampler.Get1D())
       {
          scattered = ReflectDirection(ray.GetDirection(), normal);
       }
@@ -229,7 +292,9 @@ public:
       return specular;
    }
 
-   virtual bool Scatter(const Ray& ray, const Hit& hit, vector3f& scattered) const
+   virtual Type GetType() const {   return Type::Checkerboard;   }
+
+   virtual bool Scatter(const Ray& ray, const Hit& hit, vector3f& scattered, Sampler& sampler) const
    {
       point3f t = hit.GetIntersectionPoint();
       matrix.Transform(t);
@@ -241,16 +306,38 @@ public:
       bool scatter;
       if ((cx + cy + cz) % 2 == 0) /* Even! */
       {
-         scatter = material1->Scatter(ray, hit, scattered);
+         scatter = material1->Scatter(ray, hit, scattered, sampler);
       }
       else
       {
-         scatter = material2->Scatter(ray, hit, scattered);
+         scatter = material2->Scatter(ray, hit, scattered, sampler);
       }
 
       return scatter;
    }
 
+   virtual float ScatterPdf(const Ray& ray, const Hit& hit, const vector3f& scattered) const
+   {
+      point3f t = hit.GetIntersectionPoint();
+      matrix.Transform(t);
+
+      int cx = (int) floor(t[x]);
+      int cy = (int) floor(t[y]);
+      int cz = (int) floor(t[z]);
+
+      float pdf;
+      if ((cx + cy + cz) % 2 == 0) /* Even! */
+      {
+         pdf = material1->ScatterPdf(ray, hit, scattered);
+      }
+      else
+      {
+         pdf = material2->ScatterPdf(ray, hit, scattered);
+      }
+
+      return pdf;
+   }
+
 
 protected:
    Matrix matrix;
@@ -267,25 +354,27 @@ public:
 
    }
 
-   virtual bool Scatter(const Ray& ray, const Hit& hit, vector3f& scattered) const
+   virtual Type GetType() const {   return Type::Noise;   }
+
+   virtual bool Scatter(const Ray& ray, const Hit& hit, vector3f& scattered, Sampler& sampler) const
    {
-      scattered = hit.GetNormal() + vector3f::RandomInHemisphere(hit.GetNormal());
+      scattered = hit.GetNormal() + vector3f::RandomInHemisphere(hit.GetNormal(), sampler.Get2D());
 
       return true;
    }
 
+   virtual float ScatterPdf(const Ray& ray, const Hit& hit, const vector3f& scattered) const
+   {
+      return LambertianPdf(ray, hit, scattered);
+   }
+
 protected:
    virtual float CalulateNoise(const point3f& point) const
    {
       point3f t = point;
       matrix.Transform(t);
 
-      float noise = 0.0f;
-
-      for (size_t i = 0, j = 1; i < octaves; ++i, j = 2 * j)
-      {
-         noise = noise + (float) (Perlin::noise(t[x] * j, t[y] * j, t[z] * j) / j);
-      }
+      float noise = Perlin::Turbulence(t[x], t[y], t[z], octaves);
 
       return noise;
    }
@@ -321,12 +410,7 @@ protected:
       point3f t = point;
       matrix.Transform(t);
 
-      float noise = 0.0f;
-
-      for (size_t i = 0, j = 1; i < octaves; ++i, j = 2 * j)
-      {
-         noise = noise + (float) (Perlin::noise(t[x] * j, t[y] * j, t[z] * j) / j);
-      }
+      float noise = Perlin::Turbulence(t[x], t[y], t[z], octaves);
 
       noise = (float) sin(frequency * t[x] + amplitude * noise);
 
@@ -352,12 +436,7 @@ protected:
       point3f t = point;
       matrix.Transform(t);
 
-      float noise = 0.0f;
-
-      for (size_t i = 0, j = 1; i < octaves; ++i, j = 2 * j)
-      {
-         noise = noise + (float) (Perlin::noise(t[x] * j, t[y] * j, t[z] * j) / j);
-      }
+      float noise = Perlin::Turbulence(t[x], t[y], t[z], octaves);
 
       noise = noise + (float) sin(frequency * sqrt(t[x] * t[x] + t[y] * t[y]) * amplitude);
 
@@ -7,6 +7,20 @@
 #include <stdio.h>
 #include <assert.h>
 #include <math.h>
+#include <float.h>
+#include <stdint.h>
+
+/* The eight wide types at the end of the file are built on AVX, on pairs of
+   SSE registers, or, with SIMD_SCALAR defined, on plain arrays. */
+
+#if defined(SIMD_SCALAR)
+#elif defined(__AVX__)
+#include <immintrin.h>
+#define SIMD_AVX
+#elif defined(__SSE__) || defined(_M_X64) || defined(_M_IX86)
+#include <xmmintrin.h>
+#define SIMD_SSE
+#endif
 
 enum {r, g, b};
 
@@ -14,16 +28,6 @@ enum {x, y, z, w};
 
 #define PI 3.1415926535897932384626433832795f
 
-inline float random_float() // [0, 1]
-{
-   return rand() / (RAND_MAX + 1.0f);
-}
-
-inline float random_float(float mi, float ma) // [mi, ma)
-{
-   return mi + (ma - mi) * random_float();
-}
-
 struct vector4f
 {
    float m[4];
@@ -47,6 +51,29 @@ struct vector4f
    }
 };
 
+struct vector2f
+{
+   float m[2];
+
+   vector2f(float a = 0.0f, float b = 0.0f)
+   {
+      m[x] = a;
+      m[y] = b;
+   }
+
+   float& operator[](size_t i)
+   { 
+      return m[i];
+   }
+
+   float operator[](size_t i) const
+   { 
+      return m[i];
+   }
+};
+
+typedef vector2f point2f;
+
 struct vector3f
 {
    float m[3];
@@ -211,9 +238,9 @@ struct vector3f
       return a[x] * b[x] + a[y] * b[y] + a[z] * b[z];
    }
 
-   static vector3f RandomInHemisphere(const vector3f& normal)
+   static vector3f RandomInHemisphere(const vector3f& normal, const vector2f& u)
    {
-      vector3f v = RandomVectorOnUnitSphere();
+      vector3f v = RandomVectorOnUnitSphere(u);
 
       if (vector3f::Dot(v, normal) <= 0.0f) // Is not in the same hemisphere as the normal.
       {
@@ -223,16 +250,14 @@ struct vector3f
       return v;
    }
 
-   static vector3f RandomVectorOnUnitSphere()
+   static vector3f RandomVectorOnUnitSphere(const vector2f& u)
    {
-      vector3f p;
-
-      do
-      {
-         p = 2.0f * vector3f(random_float(), random_float(), random_float()) - vector3f(1.0f, 1.0f, 1.0f);
-      } while (p.LengthSq() >= 1.0f);
+   /* Map a pair of uniform numbers in [0, 1) straight onto the sphere. */
+      float _z = 1.0f - 2.0f * u[x];
+      float radius = (float) sqrt(fmax(0.0f, 1.0f - _z * _z));
+      float phi = 2.0f * PI * u[y];
 
-      return p.Normalize();
+      return vector3f(radius * (float) cos(phi), radius * (float) sin(phi), _z);
    }
 
    static void ConstructBasisFromSingleVector(const vector3f& a, vector3f& w, vector3f& u, vector3f& v)
@@ -268,28 +293,96 @@ struct vector3f
 typedef vector3f point3f;
 typedef vector3f color3f;
 
-struct vector2f
+/* Axis aligned box; starts empty (inverted) so the first Expand sets it. */
+
+struct AABox
 {
-   float m[2];
+   vector3f vmin, vmax;
 
-   vector2f(float a = 0.0f, float b = 0.0f)
+   AABox() : vmin(FLT_MAX, FLT_MAX, FLT_MAX), vmax(-FLT_MAX, -FLT_MAX, -FLT_MAX) {   }
+
+   AABox(const vector3f& a, const vector3f& b) : vmin(a), vmax(b) {   }
+
+   bool IsEmpty() const
    {
-      m[x] = a;
-      m[y] = b;
+      return vmin[x] > vmax[x] || vmin[y] > vmax[y] || vmin[z] > vmax[z];
    }
 
-   float& operator[](size_t i)
-   { 
-      return m[i];
+/* Written as selects rather than branches, which builders on unordered
+   primitives would mispredict about half the time. */
+   void Expand(const vector3f& p)
+   {
+      for (size_t i = 0; i < 3; ++i)
+      {
+         vmin[i] = p[i] < vmin[i] ? p[i] : vmin[i];
+         vmax[i] = p[i] > vmax[i] ? p[i] : vmax[i];
+      }
+
+      return;
    }
 
-   float operator[](size_t i) const
-   { 
-      return m[i];
+   void Expand(const AABox& box)
+   {
+      for (size_t i = 0; i < 3; ++i)
+      {
+         vmin[i] = box.vmin[i] < vmin[i] ? box.vmin[i] : vmin[i];
+         vmax[i] = box.vmax[i] > vmax[i] ? box.vmax[i] : vmax[i];
+      }
+
+      return;
    }
-};
 
-typedef vector2f point2f;
+   vector3f GetCentroid() const
+   {
+      return (vmin + vmax) * 0.5f;
+   }
+
+   vector3f GetExtent() const
+   {
+      return vmax - vmin;
+   }
+
+   float GetSurfaceArea() const
+   {
+      vector3f d = vmax - vmin;
+
+      return 2.0f * (d[x] * d[y] + d[y] * d[z] + d[z] * d[x]);
+   }
+
+   size_t GetLongestAxis() const
+   {
+      vector3f d = vmax - vmin;
+
+      return (d[x] > d[y] && d[x] > d[z]) ? x : (d[y] > d[z] ? y : z);
+   }
+
+/* Slab test against [tmin, tmax]; the ray supplies its reciprocal direction. */
+   bool Intersect(const point3f& origin, const vector3f& inverse_direction, float tmin, float tmax) const
+   {
+      for (size_t i = 0; i < 3; ++i)
+      {
+         float t0 = (vmin[i] - origin[i]) * inverse_direction[i];
+         float t1 = (vmax[i] - origin[i]) * inverse_direction[i];
+
+         if (inverse_direction[i] < 0.0f)
+         {
+            float tmp = t0;
+            t0 = t1;
+            t1 = tmp;
+         }
+
+         tmin = t0 > tmin ? t0 : tmin;
+         tmax = t1 < tmax ? t1 : tmax;
+
+         if (tmin > tmax)
+         {
+            return false;
+         }
+      }
+
+      return true;
+   }
+};
 
 inline float Det2x2(float a, float b,
                     float c, float d)
@@ -319,6 +412,17 @@ inline float Det4x4(float a1, float a2, float a3, float a4,
     - d1 * Det3x3(a2, a3, a4, b2, b3, b4, c2, c3, c4);
 }
 
+/* Spreads the low ten bits of v out to every third bit, for Morton codes. */
+inline uint32_t ExpandBits(uint32_t v)
+{
+   v = (v * 0x00010001u) & 0xFF0000FFu;
+   v = (v * 0x00000101u) & 0x0F00F00Fu;
+   v = (v * 0x00000011u) & 0xC30C30C3u;
+   v = (v * 0x00000005u) & 0x49249249u;
+
+   return v;
+}
+
 struct Matrix
 {
    float data[4][4];
@@ -363,41 +467,31 @@ struct Matrix
 
    void Transform(vector4f& v) const
    {
-      vector4f answer;
+      vector4f answer(data[0][0] * v[x] + data[0][1] * v[y] + data[0][2] * v[z] + data[0][3] * v[w],
+                      data[1][0] * v[x] + data[1][1] * v[y] + data[1][2] * v[z] + data[1][3] * v[w],
+                      data[2][0] * v[x] + data[2][1] * v[y] + data[2][2] * v[z] + data[2][3] * v[w],
+                      data[3][0] * v[x] + data[3][1] * v[y] + data[3][2] * v[z] + data[3][3] * v[w]);
 
-      for (size_t k = 0; k < 4; ++k)
-      {
-         answer[k] = 0.0f;
-
-         for (size_t i = 0; i < 4; ++i)
-         {
-            answer[k] += data[k][i] * v[i];
-         }
-      }
-      
       v = answer;
 
       return;
    }
 
+/* The bottom row only scales w, which is dropped, so it is not worked out. */
    void Transform(vector3f& v) const
    {
-      vector4f v2(v[x], v[y], v[z], 1.0f);
-      
-      Transform(v2);
-    
-      v.Set(v2[x], v2[y], v2[z]);
+      v.Set(data[0][0] * v[x] + data[0][1] * v[y] + data[0][2] * v[z] + data[0][3],
+            data[1][0] * v[x] + data[1][1] * v[y] + data[1][2] * v[z] + data[1][3],
+            data[2][0] * v[x] + data[2][1] * v[y] + data[2][2] * v[z] + data[2][3]);
 
       return;
    }
 
    void TransformDirection(vector3f& v) const
    {
-      vector4f v2(v[x], v[y], v[z], 0.0f);
-
-      Transform(v2);
-      
-      v.Set(v2[x], v2[y], v2[z]);
+      v.Set(data[0][0] * v[x] + data[0][1] * v[y] + data[0][2] * v[z],
+            data[1][0] * v[x] + data[1][1] * v[y] + data[1][2] * v[z],
+            data[2][0] * v[x] + data[2][1] * v[y] + data[2][2] * v[z]);
 
       return;
    }
@@ -587,4 +681,532 @@ struct Matrix
    }
 };
 
+/* The top three rows of a Matrix. Points and directions only ever read these,
+   as the w the fourth row makes is dropped, so applying one gives the same
+   result as the full matrix at three quarters of the work. */
+
+struct Matrix3x4
+{
+   float data[3][4];
+
+   Matrix3x4()
+   {
+      for (size_t k = 0; k < 3; ++k)
+      {
+         for (size_t j = 0; j < 4; ++j)
+         {
+            data[k][j] = (j == k);
+         }
+      }
+   }
+
+   explicit Matrix3x4(const Matrix& m)
+   {
+      for (size_t k = 0; k < 3; ++k)
+      {
+         for (size_t j = 0; j < 4; ++j)
+         {
+            data[k][j] = m.data[k][j];
+         }
+      }
+   }
+
+   void Transform(vector3f& v) const
+   {
+      v.Set(data[0][0] * v[x] + data[0][1] * v[y] + data[0][2] * v[z] + data[0][3],
+            data[1][0] * v[x] + data[1][1] * v[y] + data[1][2] * v[z] + data[1][3],
+            data[2][0] * v[x] + data[2][1] * v[y] + data[2][2] * v[z] + data[2][3]);
+
+      return;
+   }
+
+   void TransformDirection(vector3f& v) const
+   {
+      v.Set(data[0][0] * v[x] + data[0][1] * v[y] + data[0][2] * v[z],
+            data[1][0] * v[x] + data[1][1] * v[y] + data[1][2] * v[z],
+            data[2][0] * v[x] + data[2][1] * v[y] + data[2][2] * v[z]);
+
+      return;
+   }
+
+/* Applies the transpose of the upper 3x3, which for an inverse is the matrix
+   that carries normals, without keeping a second copy. */
+   void TransformNormal(vector3f& v) const
+   {
+      v.Set(data[0][0] * v[x] + data[1][0] * v[y] + data[2][0] * v[z],
+            data[0][1] * v[x] + data[1][1] * v[y] + data[2][1] * v[z],
+            data[0][2] * v[x] + data[1][2] * v[y] + data[2][2] * v[z]);
+
+      return;
+   }
+
+   float Determinant() const
+   {
+      return Det3x3(data[0][0], data[1][0], data[2][0],
+                    data[0][1], data[1][1], data[2][1],
+                    data[0][2], data[1][2], data[2][2]);
+   }
+
+/* True if the upper 3x3 only scales along the axes, which keeps boxes axis aligned. */
+   bool IsDiagonal() const
+   {
+      return data[0][1] == 0.0f && data[0][2] == 0.0f && data[1][0] == 0.0f &&
+             data[1][2] == 0.0f && data[2][0] == 0.0f && data[2][1] == 0.0f;
+   }
+
+/* True if the upper 3x3 is a rotation or reflection times a uniform scale,
+   to within rounding, which keeps spheres round. */
+   bool IsSimilarity(float& scale) const
+   {
+      vector3f column[3];
+
+      for (size_t j = 0; j < 3; ++j)
+      {
+         column[j].Set(data[0][j], data[1][j], data[2][j]);
+      }
+
+      const float s2 = vector3f::Dot(column[0], column[0]);
+      const float tolerance = 1e-5f * s2;
+
+      scale = (float) sqrt(s2);
+
+      return s2 > 0.0f &&
+             fabs(vector3f::Dot(column[1], column[1]) - s2) <= tolerance &&
+             fabs(vector3f::Dot(column[2], column[2]) - s2) <= tolerance &&
+             fabs(vector3f::Dot(column[0], column[1])) <= tolerance &&
+             fabs(vector3f::Dot(column[0], column[2])) <= tolerance &&
+             fabs(vector3f::Dot(column[1], column[2])) <= tolerance;
+   }
+
+/* Applies m2 then m1, both taken as affine. */
+   friend Matrix3x4 operator * (const Matrix3x4& m1, const Matrix3x4& m2)
+   {
+      Matrix3x4 m;
+
+      for (size_t k = 0; k < 3; ++k)
+      {
+         for (size_t j = 0; j < 4; ++j)
+         {
+            m.data[k][j] = m1.data[k][0] * m2.data[0][j] + m1.data[k][1] * m2.data[1][j] + m1.data[k][2] * m2.data[2][j];
+         }
+
+         m.data[k][3] = m.data[k][3] + m1.data[k][3];
+      }
+
+      return m;
+   }
+};
+
+/* Eight floats, one per ray or primitive. Each lane rounds exactly as the
+   scalar code does, so the SIMD_SCALAR build gives the same bits, except for
+   RsqrtFast which is an estimate. Min and Max return b unless a < b (or
+   b < a), as the SSE instructions do, and so as the ternary does here. */
+
+struct mask8;
+
+struct float8
+{
+#if defined(SIMD_AVX)
+   __m256 v;
+#elif defined(SIMD_SSE)
+   __m128 v[2];
+#else
+   float v[8];
+#endif
+
+   float8()
+   {
+      *this = float8(0.0f);
+   }
+
+   float8(float f)
+   {
+#if defined(SIMD_AVX)
+      v = _mm256_set1_ps(f);
+#elif defined(SIMD_SSE)
+      v[0] = v[1] = _mm_set1_ps(f);
+#else
+      for (size_t i = 0; i < 8; ++i) v[i] = f;
+#endif
+   }
+
+/* Neither pointer needs to be aligned. */
+   static float8 Load(const float* p)
+   {
+      float8 a;
+#if defined(SIMD_AVX)
+      a.v = _mm256_loadu_ps(p);
+#elif defined(SIMD_SSE)
+      a.v[0] = _mm_loadu_ps(p);
+      a.v[1] = _mm_loadu_ps(p + 4);
+#else
+      for (size_t i = 0; i < 8; ++i) a.v[i] = p[i];
+#endif
+      return a;
+   }
+
+   void Store(float* p) const
+   {
+#if defined(SIMD_AVX)
+      _mm256_storeu_ps(p, v);
+#elif defined(SIMD_SSE)
+      _mm_storeu_ps(p, v[0]);
+      _mm_storeu_ps(p + 4, v[1]);
+#else
+      for (size_t i = 0; i < 8; ++i) p[i] = v[i];
+#endif
+      return;
+   }
+
+   float operator[](size_t i) const
+   {
+      float lanes[8];
+
+      Store(lanes);
+
+      return lanes[i];
+   }
+
+   void Set(size_t i, float f)
+   {
+      float lanes[8];
+
+      Store(lanes);
+      lanes[i] = f;
+      *this = Load(lanes);
+
+      return;
+   }
+
+#if defined(SIMD_AVX)
+#define FLOAT8_OP(name, avx, sse, expression) \
+   friend float8 name(const float8& a, const float8& b) {   float8 c; c.v = avx(a.v, b.v); return c;   }
+#elif defined(SIMD_SSE)
+#define FLOAT8_OP(name, avx, sse, expression) \
+   friend float8 name(const float8& a, const float8& b) {   float8 c; c.v[0] = sse(a.v[0], b.v[0]); c.v[1] = sse(a.v[1], b.v[1]); return c;   }
+#else
+#define FLOAT8_OP(name, avx, sse, expression) \
+   friend float8 name(const float8& a, const float8& b) {   float8 c; for (size_t i = 0; i < 8; ++i) c.v[i] = (expression); return c;   }
+#endif
+
+   FLOAT8_OP(operator +, _mm256_add_ps, _mm_add_ps, a.v[i] + b.v[i])
+   FLOAT8_OP(operator -, _mm256_sub_ps, _mm_sub_ps, a.v[i] - b.v[i])
+   FLOAT8_OP(operator *, _mm256_mul_ps, _mm_mul_ps, a.v[i] * b.v[i])
+   FLOAT8_OP(operator /, _mm256_div_ps, _mm_div_ps, a.v[i] / b.v[i])
+   FLOAT8_OP(Min, _mm256_min_ps, _mm_min_ps, a.v[i] < b.v[i] ? a.v[i] : b.v[i])
+   FLOAT8_OP(Max, _mm256_max_ps, _mm_max_ps, a.v[i] > b.v[i] ? a.v[i] : b.v[i])
+
+#undef FLOAT8_OP
+
+   float8& operator += (const float8& a) {   *this = *this + a; return *this;   }
+   float8& operator -= (const float8& a) {   *this = *this - a; return *this;   }
+   float8& operator *= (const float8& a) {   *this = *this * a; return *this;   }
+
+/* Flips the sign bit, as the scalar negation does. */
+   friend float8 operator - (const float8& a)
+   {
+      float8 c;
+#if defined(SIMD_AVX)
+      c.v = _mm256_xor_ps(a.v, _mm256_set1_ps(-0.0f));
+#elif defined(SIMD_SSE)
+      c.v[0] = _mm_xor_ps(a.v[0], _mm_set1_ps(-0.0f));
+      c.v[1] = _mm_xor_ps(a.v[1], _mm_set1_ps(-0.0f));
+#else
+      for (size_t i = 0; i < 8; ++i) c.v[i] = -a.v[i];
+#endif
+      return c;
+   }
+
+   friend float8 Abs(const float8& a)
+   {
+      float8 c;
+#if defined(SIMD_AVX)
+      c.v = _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a.v);
+#elif defined(SIMD_SSE)
+      c.v[0] = _mm_andnot_ps(_mm_set1_ps(-0.0f), a.v[0]);
+      c.v[1] = _mm_andnot_ps(_mm_set1_ps(-0.0f), a.v[1]);
+#else
+      for (size_t i = 0; i < 8; ++i) c.v[i] = (float) fabs(a.v[i]);
+#endif
+      return c;
+   }
+
+   friend float8 Sqrt(const float8& a)
+   {
+      float8 c;
+#if defined(SIMD_AVX)
+      c.v = _mm256_sqrt_ps(a.v);
+#elif defined(SIMD_SSE)
+      c.v[0] = _mm_sqrt_ps(a.v[0]);
+      c.v[1] = _mm_sqrt_ps(a.v[1]);
+#else
+      for (size_t i = 0; i < 8; ++i) c.v[i] = (float) sqrt(a.v[i]);
+#endif
+      return c;
+   }
+
+/* The hardware estimate of 1 / sqrt(a), good to 12 bits, refined by one
+   Newton step to about 22. Unlike the rest it differs between builds. */
+   friend float8 RsqrtFast(const float8& a)
+   {
+#if defined(SIMD_AVX) || defined(SIMD_SSE)
+      float8 c;
+#if defined(SIMD_AVX)
+      c.v = _mm256_rsqrt_ps(a.v);
+#else
+      c.v[0] = _mm_rsqrt_ps(a.v[0]);
+      c.v[1] = _mm_rsqrt_ps(a.v[1]);
+#endif
+      return c * (float8(1.5f) - float8(0.5f) * a * c * c);
+#else
+      float8 c;
+      for (size_t i = 0; i < 8; ++i) c.v[i] = 1.0f / (float) sqrt(a.v[i]);
+      return c;
+#endif
+   }
+
+   friend mask8 operator <  (const float8& a, const float8& b);
+   friend mask8 operator <= (const float8& a, const float8& b);
+   friend mask8 operator >  (const float8& a, const float8& b);
+   friend mask8 operator >= (const float8& a, const float8& b);
+   friend mask8 operator == (const float8& a, const float8& b);
+};
+
+/* One all-ones or all-zeros lane per float8 lane, from comparing them. */
+
+struct mask8
+{
+#if defined(SIMD_AVX)
+   __m256 v;
+#elif defined(SIMD_SSE)
+   __m128 v[2];
+#else
+   uint32_t v[8];
+#endif
+
+   mask8(bool b = false)
+   {
+#if defined(SIMD_AVX)
+      v = _mm256_setzero_ps();
+      if (b != false) v = _mm256_cmp_ps(v, v, _CMP_EQ_OQ);
+#elif defined(SIMD_SSE)
+      v[0] = v[1] = _mm_setzero_ps();
+      if (b != false) v[0] = v[1] = _mm_cmpeq_ps(v[0], v[0]);
+#else
+      for (size_t i = 0; i < 8; ++i) v[i] = b != false ? ~0u : 0u;
+#endif
+   }
+
+/* Lane i is bit i. */
+   int Bits() const
+   {
+#if defined(SIMD_AVX)
+      return _mm256_movemask_ps(v);
+#elif defined(SIMD_SSE)
+      return _mm_movemask_ps(v[0]) | (_mm_movemask_ps(v[1]) << 4);
+#else
+      int bits = 0;
+      for (size_t i = 0; i < 8; ++i) bits |= (v[i] != 0u) << i;
+      return bits;
+#endif
+   }
+
+   bool Any()  const {   return Bits() != 0;   }
+   bool All()  const {   return Bits() == 0xFF;   }
+   bool None() const {   return Bits() == 0;   }
+
+   bool operator[](size_t i) const {   return ((Bits() >> i) & 1) != 0;   }
+
+#if defined(SIMD_AVX)
+#define MASK8_OP(name, avx, sse, expression) \
+   friend mask8 name(const mask8& a, const mask8& b) {   mask8 c; c.v = avx(a.v, b.v); return c;   }
+#elif defined(SIMD_SSE)
+#define MASK8_OP(name, avx, sse, expression) \
+   friend mask8 name(const mask8& a, const mask8& b) {   mask8 c; c.v[0] = sse(a.v[0], b.v[0]); c.v[1] = sse(a.v[1], b.v[1]); return c;   }
+#else
+#define MASK8_OP(name, avx, sse, expression) \
+   friend mask8 name(const mask8& a, const mask8& b) {   mask8 c; for (size_t i = 0; i < 8; ++i) c.v[i] = (expression); return c;   }
+#endif
+
+   MASK8_OP(operator &, _mm256_and_ps, _mm_and_ps, a.v[i] & b.v[i])
+   MASK8_OP(operator |, _mm256_or_ps, _mm_or_ps, a.v[i] | b.v[i])
+   MASK8_OP(operator ^, _mm256_xor_ps, _mm_xor_ps, a.v[i] ^ b.v[i])
+   MASK8_OP(AndNot, _mm256_andnot_ps, _mm_andnot_ps, ~a.v[i] & b.v[i])
+
+#undef MASK8_OP
+
+/* Picks a where the mask is set and b elsewhere. */
+   friend float8 Select(const mask8& m, const float8& a, const float8& b)
+   {
+      float8 c;
+#if defined(SIMD_AVX)
+      c.v = _mm256_blendv_ps(b.v, a.v, m.v);
+#elif defined(SIMD_SSE)
+      c.v[0] = _mm_or_ps(_mm_and_ps(m.v[0], a.v[0]), _mm_andnot_ps(m.v[0], b.v[0]));
+      c.v[1] = _mm_or_ps(_mm_and_ps(m.v[1], a.v[1]), _mm_andnot_ps(m.v[1], b.v[1]));
+#else
+      for (size_t i = 0; i < 8; ++i) c.v[i] = m.v[i] != 0u ? a.v[i] : b.v[i];
+#endif
+      return c;
+   }
+};
+
+/* Ordered comparisons, so any lane holding a NaN compares false. */
+
+#if defined(SIMD_AVX)
+#define FLOAT8_CMP(name, avx, sse, expression) \
+   inline mask8 name(const float8& a, const float8& b) {   mask8 c; c.v = _mm256_cmp_ps(a.v, b.v, avx); return c;   }
+#elif defined(SIMD_SSE)
+#define FLOAT8_CMP(name, avx, sse, expression) \
+   inline mask8 name(const float8& a, const float8& b) {   mask8 c; c.v[0] = sse(a.v[0], b.v[0]); c.v[1] = sse(a.v[1], b.v[1]); return c;   }
+#else
+#define FLOAT8_CMP(name, avx, sse, expression) \
+   inline mask8 name(const float8& a, const float8& b) {   mask8 c; for (size_t i = 0; i < 8; ++i) c.v[i] = (expression) ? ~0u : 0u; return c;   }
+#endif
+
+FLOAT8_CMP(operator <,  _CMP_LT_OQ, _mm_cmplt_ps, a.v[i] <  b.v[i])
+FLOAT8_CMP(operator <=, _CMP_LE_OQ, _mm_cmple_ps, a.v[i] <= b.v[i])
+FLOAT8_CMP(operator >,  _CMP_GT_OQ, _mm_cmpgt_ps, a.v[i] >  b.v[i])
+FLOAT8_CMP(operator >=, _CMP_GE_OQ, _mm_cmpge_ps, a.v[i] >= b.v[i])
+FLOAT8_CMP(operator ==, _CMP_EQ_OQ, _mm_cmpeq_ps, a.v[i] == b.v[i])
+
+#undef FLOAT8_CMP
+
+/* Declared again out here so that qualified calls can find them. */
+
+float8 Min(const float8& a, const float8& b);
+float8 Max(const float8& a, const float8& b);
+float8 Select(const mask8& m, const float8& a, const float8& b);
+
+/* Eight vectors stored as three float8s, one per axis. Dot, Cross and
+   Normalize work out each lane in the same order as vector3f does. */
+
+struct vec3x8
+{
+   float8 m[3];
+
+   vec3x8() {   }
+
+   vec3x8(const float8& a, const float8& b, const float8& c)
+   {
+      m[x] = a;
+      m[y] = b;
+      m[z] = c;
+   }
+
+/* The same vector in every lane. */
+   explicit vec3x8(const vector3f& v)
+   {
+      m[x] = float8(v[x]);
+      m[y] = float8(v[y]);
+      m[z] = float8(v[z]);
+   }
+
+   float8& operator[](size_t i)
+   {
+      return m[i];
+   }
+
+   const float8& operator[](size_t i) const
+   {
+      return m[i];
+   }
+
+   vector3f Get(size_t lane) const
+   {
+      return vector3f(m[x][lane], m[y][lane], m[z][lane]);
+   }
+
+   void Set(size_t lane, const vector3f& v)
+   {
+      m[x].Set(lane, v[x]);
+      m[y].Set(lane, v[y]);
+      m[z].Set(lane, v[z]);
+
+      return;
+   }
+
+   friend vec3x8 operator - (const vec3x8& a)
+   {
+      return vec3x8(-a[x], -a[y], -a[z]);
+   }
+
+   friend vec3x8 operator + (const vec3x8& a, const vec3x8& b)
+   {
+      return vec3x8(a[x] + b[x], a[y] + b[y], a[z] + b[z]);
+   }
+
+   friend vec3x8 operator - (const vec3x8& a, const vec3x8& b)
+   {
+      return vec3x8(a[x] - b[x], a[y] - b[y], a[z] - b[z]);
+   }
+
+   friend vec3x8 operator * (const vec3x8& a, const vec3x8& b)
+   {
+      return vec3x8(a[x] * b[x], a[y] * b[y], a[z] * b[z]);
+   }
+
+   friend vec3x8 operator * (const vec3x8& a, const float8& f)
+   {
+      return vec3x8(a[x] * f, a[y] * f, a[z] * f);
+   }
+
+   friend vec3x8 operator * (const float8& f, const vec3x8& a)
+   {
+      return vec3x8(a[x] * f, a[y] * f, a[z] * f);
+   }
+
+   friend vec3x8 operator / (const vec3x8& a, const float8& f)
+   {
+      return vec3x8(a[x] / f, a[y] / f, a[z] / f);
+   }
+
+   static float8 Dot(const vec3x8& a, const vec3x8& b)
+   {
+      return a[x] * b[x] + a[y] * b[y] + a[z] * b[z];
+   }
+
+   static vec3x8 Cross(const vec3x8& a, const vec3x8& b)
+   {
+      return vec3x8(a[y] * b[z] - a[z] * b[y],
+                    a[z] * b[x] - a[x] * b[z],
+                    a[x] * b[y] - a[y] * b[x]);
+   }
+
+   static vec3x8 Min(const vec3x8& a, const vec3x8& b)
+   {
+      return vec3x8(::Min(a[x], b[x]), ::Min(a[y], b[y]), ::Min(a[z], b[z]));
+   }
+
+   static vec3x8 Max(const vec3x8& a, const vec3x8& b)
+   {
+      return vec3x8(::Max(a[x], b[x]), ::Max(a[y], b[y]), ::Max(a[z], b[z]));
+   }
+
+   static vec3x8 Select(const mask8& mask, const vec3x8& a, const vec3x8& b)
+   {
+      return vec3x8(::Select(mask, a[x], b[x]), ::Select(mask, a[y], b[y]), ::Select(mask, a[z], b[z]));
+   }
+
+   float8 Length() const
+   {
+      return Sqrt(Dot(*this, *this));
+   }
+
+   vec3x8& Normalize()
+   {
+      *this = *this / Length();
+
+      return *this;
+   }
+
+/* Multiplies by the refined reciprocal square root instead of dividing. */
+   vec3x8& NormalizeFast()
+   {
+      *this = *this * RsqrtFast(Dot(*this, *this));
+
+      return *this;
+   }
+};
+
 #endif
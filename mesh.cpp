@@ -0,0 +1,368 @@
+/* File: mesh.cpp; Mode: C++; Tab-width: 3; Author: Simon Flannery;           */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <string>
+
+#include "mesh.h"
+#include "ray.h"
+#include "hit.h"
+#include "mapping.h"
+
+namespace
+{
+/* Leads a saved mesh. Every array starts on a cache line, counted from the
+   start of the file, which a mapping places on a page. */
+   struct CacheHeader
+   {
+      uint32_t magic, version;
+      uint32_t width, node_size;
+      uint64_t num_vertices, num_triangles, num_nodes;
+      float bounds[6];
+      uint64_t vertex, index, v0[3], v1[3], v2[3], nodes;
+      uint64_t size;
+   };
+
+   inline uint64_t Place(uint64_t& end, uint64_t length)
+   {
+      uint64_t offset = (end + BVH_CACHE_LINE - 1) & ~(uint64_t) (BVH_CACHE_LINE - 1);
+
+      end = offset + length;
+
+      return offset;
+   }
+
+   inline bool Fits(const CacheHeader& header, uint64_t offset, uint64_t length)
+   {
+      return offset % BVH_CACHE_LINE == 0 && offset <= header.size && length <= header.size - offset;
+   }
+}
+
+TriangleMesh::TriangleMesh(point3f* vertices, size_t nv, uint32_t* indices, size_t nt, Material* m, Scheduler* scheduler, BVH::Type type) : num_vertices(nv), num_triangles(nt), vertex(vertices), index(indices), mapping(NULL)
+{
+   material = m;
+
+   AABox* bounds = new AABox[num_triangles];
+
+   for (size_t i = 0; i < num_triangles; ++i)
+   {
+      bounds[i].Expand(vertex[index[3 * i + 0]]);
+      bounds[i].Expand(vertex[index[3 * i + 1]]);
+      bounds[i].Expand(vertex[index[3 * i + 2]]);
+   }
+
+   uint32_t* order = new uint32_t[num_triangles];
+
+   bvh.Build(bounds, num_triangles, order, scheduler, type, MESH_LEAF_SIZE);
+
+/* Put the faces in leaf order, then copy out their vertices. */
+   uint32_t* sorted = new uint32_t[3 * num_triangles];
+
+   for (size_t i = 0; i < num_triangles; ++i)
+   {
+      sorted[3 * i + 0] = index[3 * order[i] + 0];
+      sorted[3 * i + 1] = index[3 * order[i] + 1];
+      sorted[3 * i + 2] = index[3 * order[i] + 2];
+   }
+
+   delete [] index;
+   index = sorted;
+
+   float* p0[3], * p1[3], * p2[3];
+
+   const size_t padded = num_triangles + KERNEL_LANES - 1;
+
+   for (size_t k = 0; k < 3; ++k)
+   {
+      v0[k] = p0[k] = new float[padded]();
+      v1[k] = p1[k] = new float[padded]();
+      v2[k] = p2[k] = new float[padded]();
+   }
+
+   for (size_t i = 0; i < num_triangles; ++i)
+   {
+      const point3f& a = vertex[index[3 * i + 0]];
+      const point3f& b = vertex[index[3 * i + 1]];
+      const point3f& c = vertex[index[3 * i + 2]];
+
+      for (size_t k = 0; k < 3; ++k)
+      {
+         p0[k][i] = a[k];
+         p1[k][i] = b[k];
+         p2[k][i] = c[k];
+      }
+   }
+
+   delete [] order;
+   delete [] bounds;
+}
+
+TriangleMesh::TriangleMesh(Material* m) : num_vertices(0), num_triangles(0), vertex(NULL), index(NULL), mapping(NULL)
+{
+   material = m;
+
+   for (size_t k = 0; k < 3; ++k)
+   {
+      v0[k] = v1[k] = v2[k] = NULL;
+   }
+}
+
+TriangleMesh::~TriangleMesh()
+{
+   if (mapping != NULL)
+   {
+      delete mapping;
+
+      return;
+   }
+
+   for (size_t k = 0; k < 3; ++k)
+   {
+      delete [] v0[k];
+      delete [] v1[k];
+      delete [] v2[k];
+   }
+
+   delete [] index;
+   delete [] vertex;
+}
+
+TriangleMesh* TriangleMesh::Load(const char* szFileName, Material* m)
+{
+   MappedFile* file = new MappedFile();
+
+   CacheHeader header;
+
+   if (file->Open(szFileName) == false || file->GetSize() < sizeof(CacheHeader))
+   {
+      delete file;
+
+      return NULL;
+   }
+
+   memcpy(&header, file->GetData(), sizeof(CacheHeader));
+
+   const uint64_t nv = header.num_vertices, nt = header.num_triangles;
+
+   bool valid = header.magic == MESH_CACHE_MAGIC && header.version == MESH_CACHE_VERSION &&
+                header.width == BVH_WIDTH && header.node_size == sizeof(BVHNode) &&
+                header.size == file->GetSize() &&
+                Fits(header, header.vertex, nv * sizeof(point3f)) &&
+                Fits(header, header.index, 3 * nt * sizeof(uint32_t)) &&
+                Fits(header, header.nodes, header.num_nodes * sizeof(BVHNode));
+
+   for (size_t k = 0; k < 3 && valid != false; ++k)
+   {
+      valid = Fits(header, header.v0[k], (nt + KERNEL_LANES - 1) * sizeof(float)) &&
+              Fits(header, header.v1[k], (nt + KERNEL_LANES - 1) * sizeof(float)) &&
+              Fits(header, header.v2[k], (nt + KERNEL_LANES - 1) * sizeof(float));
+   }
+
+   if (valid == false)
+   {
+      delete file;
+
+      return NULL;
+   }
+
+   const uint8_t* base = file->GetData();
+
+   TriangleMesh* mesh = new TriangleMesh(m);
+
+   mesh->mapping = file;
+   mesh->num_vertices = (size_t) nv;
+   mesh->num_triangles = (size_t) nt;
+   mesh->vertex = (const point3f*) (base + header.vertex);
+   mesh->index = (const uint32_t*) (base + header.index);
+
+   for (size_t k = 0; k < 3; ++k)
+   {
+      mesh->v0[k] = (const float*) (base + header.v0[k]);
+      mesh->v1[k] = (const float*) (base + header.v1[k]);
+      mesh->v2[k] = (const float*) (base + header.v2[k]);
+   }
+
+   const AABox bounds(vector3f(header.bounds[0], header.bounds[1], header.bounds[2]),
+                      vector3f(header.bounds[3], header.bounds[4], header.bounds[5]));
+
+   if (mesh->bvh.Attach((const BVHNode*) (base + header.nodes), (size_t) header.num_nodes, bounds) == false)
+   {
+      delete mesh;
+
+      return NULL;
+   }
+
+   return mesh;
+}
+
+bool TriangleMesh::Save(const char* szFileName) const
+{
+   CacheHeader header;
+   memset(&header, 0, sizeof(CacheHeader));
+
+   const AABox bounds = bvh.GetBounds();
+
+   header.magic = MESH_CACHE_MAGIC;
+   header.version = MESH_CACHE_VERSION;
+   header.width = BVH_WIDTH;
+   header.node_size = sizeof(BVHNode);
+   header.num_vertices = num_vertices;
+   header.num_triangles = num_triangles;
+   header.num_nodes = bvh.GetNumNodes();
+
+   for (size_t k = 0; k < 3; ++k)
+   {
+      header.bounds[k + 0] = bounds.vmin[k];
+      header.bounds[k + 3] = bounds.vmax[k];
+   }
+
+/* Lay the arrays out in the order they are written. */
+   struct Section { const void* data; uint64_t length; uint64_t* offset; };
+
+   const uint64_t padded = (num_triangles + KERNEL_LANES - 1) * sizeof(float);
+
+   Section section[] = {{vertex, num_vertices * sizeof(point3f), &header.vertex},
+                        {index, 3 * num_triangles * sizeof(uint32_t), &header.index},
+                        {v0[x], padded, &header.v0[x]}, {v0[y], padded, &header.v0[y]}, {v0[z], padded, &header.v0[z]},
+                        {v1[x], padded, &header.v1[x]}, {v1[y], padded, &header.v1[y]}, {v1[z], padded, &header.v1[z]},
+                        {v2[x], padded, &header.v2[x]}, {v2[y], padded, &header.v2[y]}, {v2[z], padded, &header.v2[z]},
+                        {bvh.GetNodes(), bvh.GetNumNodes() * sizeof(BVHNode), &header.nodes}};
+
+   const size_t num_sections = sizeof(section) / sizeof(Section);
+
+   uint64_t end = sizeof(CacheHeader);
+
+   for (size_t i = 0; i < num_sections; ++i)
+   {
+      *section[i].offset = Place(end, section[i].length);
+   }
+
+   header.size = end;
+
+   const std::string temporary = std::string(szFileName) + ".tmp";
+
+   FILE* file = fopen(temporary.c_str(), "wb");
+
+   if (file == NULL)
+   {
+      return false;
+   }
+
+   const uint8_t padding[BVH_CACHE_LINE] = {0};
+
+   bool success = fwrite(&header, sizeof(CacheHeader), 1, file) == 1;
+
+   uint64_t written = sizeof(CacheHeader);
+
+   for (size_t i = 0; i < num_sections && success != false; ++i)
+   {
+      const size_t gap = (size_t) (*section[i].offset - written);
+
+      success = fwrite(padding, 1, gap, file) == gap &&
+                fwrite(section[i].data, 1, (size_t) section[i].length, file) == section[i].length;
+
+      written = *section[i].offset + section[i].length;
+   }
+
+   success = fclose(file) == 0 && success;
+
+/* As for the film's state, the blob only appears under its name once whole. */
+   if (success == false)
+   {
+      remove(temporary.c_str());
+   }
+   else if (rename(temporary.c_str(), szFileName) != 0)
+   {
+      remove(szFileName);
+
+      success = rename(temporary.c_str(), szFileName) == 0;
+   }
+
+   return success;
+}
+
+bool TriangleMesh::Intersect(const Ray& ray, Hit& h, float tmin) const
+{
+   TriangleRay prepared;
+   Kernels::PrepareTriangleRay(ray.GetOrigin().m, ray.GetDirection().m, prepared);
+
+   return bvh.Traverse(ray, h, tmin, [this, &prepared, &h, tmin](uint32_t first, uint32_t count) {   return IntersectTriangles(first, count, prepared, h, tmin);   });
+}
+
+uint32_t TriangleMesh::IntersectPacket(const RayPacket& packet, Hit hits[PACKET_SIZE], uint32_t active, float tmin) const
+{
+/* The rays walk the hierarchy together, then take the faces of a leaf one at a time. */
+   TriangleRay prepared[PACKET_SIZE];
+
+   for (size_t k = 0; k < PACKET_SIZE; ++k)
+   {
+      if ((active >> k) & 1)
+      {
+         Kernels::PrepareTriangleRay(packet.rays[k].GetOrigin().m, packet.rays[k].GetDirection().m, prepared[k]);
+      }
+   }
+
+   auto leaf = [this, &prepared, hits, tmin](uint32_t first, uint32_t count, uint32_t rays)
+   {
+      uint32_t hit = 0;
+
+      for (size_t k = 0; k < PACKET_SIZE; ++k)
+      {
+         if (((rays >> k) & 1) && IntersectTriangles(first, count, prepared[k], hits[k], tmin) != false)
+         {
+            hit = hit | (1u << k);
+         }
+      }
+
+      return hit;
+   };
+
+   return bvh.TraversePacket(packet, hits, active, tmin, leaf);
+}
+
+bool TriangleMesh::ShadowIntersect(const Ray& ray, Hit& h, float tmin) const
+{
+   TriangleRay prepared;
+   Kernels::PrepareTriangleRay(ray.GetOrigin().m, ray.GetDirection().m, prepared);
+
+   return bvh.Traverse(ray, h, tmin, [this, &prepared, &h, tmin](uint32_t first, uint32_t count) {   return IntersectTriangles(first, count, prepared, h, tmin);   }, true);
+}
+
+bool TriangleMesh::GetBounds(AABox& box) const
+{
+   box = bvh.GetBounds();
+
+   return num_triangles > 0;
+}
+
+void TriangleMesh::Evaluate(const Ray&, Hit& h) const
+{
+   const size_t i = h.GetPrimitive();
+
+   const vector3f edge1(v1[x][i] - v0[x][i], v1[y][i] - v0[y][i], v1[z][i] - v0[z][i]);
+   const vector3f edge2(v2[x][i] - v0[x][i], v2[y][i] - v0[y][i], v2[z][i] - v0[z][i]);
+
+   vector3f normal = vector3f::Cross(edge1, edge2);
+
+   h.SetSurface(material, normal.Normalize());
+
+   return;
+}
+
+bool TriangleMesh::IntersectTriangles(uint32_t first, uint32_t count, const TriangleRay& ray, Hit& h, float tmin) const
+{
+/* The watertight test over the run, in the selected kernels, with the
+   vertices read from the face arrays. */
+   float t = h.GetT(), u = 0.0f, v = 0.0f;
+   uint32_t face = 0;
+
+   if (Kernels::Get().IntersectTriangles(v0, v1, v2, first, count, ray, tmin, t, u, v, face) != false)
+   {
+      h.Record(t, this, face, u, v);
+
+      return true;
+   }
+
+   return false;
+}
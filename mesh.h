@@ -0,0 +1,75 @@
+/* File: mesh.h; Mode: C++; Tab-width: 3; Author: Simon Flannery;             */
+
+#ifndef MESH_H
+#define MESH_H
+
+#include <stdint.h>
+
+#include "object.h"
+#include "bvh.h"
+
+#define MESH_CACHE_MAGIC 0x4853454D /* "MESH" */
+#define MESH_CACHE_VERSION 3
+#define MESH_LEAF_SIZE KERNEL_LANES /* Faces a leaf may hold before it is split, one block of the triangle test. */
+
+class MappedFile;
+
+/* An indexed triangle mesh. The vertices are stored once and shared by every
+   face; each face also keeps its own copy of its three vertices in structure
+   of arrays form, so the intersection test reads them without indirection,
+   a block of faces at a time. The faces are ordered to match the mesh's own
+   hierarchy, and the copies are the shared vertices exactly, so faces meet
+   along their edges with no gap for a ray to slip through.
+
+   A built mesh can be saved as one block of arrays located by their offsets
+   from its start. Loading maps that block and points the mesh and its
+   hierarchy straight into it, with nothing parsed, built or copied. */
+
+class TriangleMesh : public Object
+{
+public:
+/* Takes ownership of both arrays; indices holds three vertex indices per face.
+   The hierarchy is built on the scheduler's threads when one is given. */
+   TriangleMesh(point3f* vertices, size_t nv, uint32_t* indices, size_t nt, Material* m, Scheduler* scheduler = NULL, BVH::Type type = BVH::Type::SAH);
+   ~TriangleMesh();
+
+/* Maps a file written by Save; NULL if it is missing or was written by
+   another version or with other node layout. */
+   static TriangleMesh* Load(const char* szFileName, Material* m);
+
+   bool Save(const char* szFileName) const;
+
+   virtual bool Intersect(const Ray& ray, Hit& h, float tmin) const;
+   virtual uint32_t IntersectPacket(const RayPacket& packet, Hit hits[PACKET_SIZE], uint32_t active, float tmin) const;
+   virtual bool ShadowIntersect(const Ray& ray, Hit& h, float tmin) const;
+   virtual bool GetBounds(AABox& box) const;
+   virtual void Evaluate(const Ray& ray, Hit& h) const;
+
+   size_t GetNumVertices()  const {   return num_vertices;    }
+   size_t GetNumTriangles() const {   return num_triangles;   }
+
+protected:
+private:
+   TriangleMesh(const TriangleMesh&);
+   TriangleMesh& operator = (const TriangleMesh&);
+
+   TriangleMesh(Material* m);
+
+   bool IntersectTriangles(uint32_t first, uint32_t count, const TriangleRay& ray, Hit& h, float tmin) const;
+
+   size_t num_vertices, num_triangles;
+
+   const point3f* vertex;
+   const uint32_t* index;
+
+/* Per face, its vertices, each array padded by KERNEL_LANES - 1 zeros. */
+   const float* v0[3];
+   const float* v1[3];
+   const float* v2[3];
+
+   BVH bvh;
+
+   MappedFile* mapping; /* When loaded, holds all of the above instead of the heap. */
+};
+
+#endif
@@ -1,10 +1,51 @@
 /* File: object.cpp; Mode: C++; Tab-width: 3; Author: Simon Flannery;         */
 
+#include <stdio.h>
 #include <stdlib.h>
 #include "object.h"
 #include "ray.h"
 #include "hit.h"
 
+#define EPSILON_BOUNDS 1e-4f
+
+void Hit::Evaluate(const Ray& ray)
+{
+   if (evaluated == false)
+   {
+      object->Evaluate(ray, *this);
+   }
+
+   intersection_point = ray.PointAtParameter(tmin);
+
+   return;
+}
+
+uint32_t Object::IntersectPacket(const RayPacket& packet, Hit hits[PACKET_SIZE], uint32_t active, float tmin) const
+{
+   uint32_t result = 0;
+
+   for (size_t k = 0; k < PACKET_SIZE; ++k)
+   {
+      if (((active >> k) & 1) && Intersect(packet.rays[k], hits[k], tmin) != false)
+      {
+         result = result | (1u << k);
+      }
+   }
+
+   return result;
+}
+
+/* Det3x3 across the lanes, each worked out in the same order. */
+static float8 Det3x3(const float8& a1, const float8& a2, const float8& a3,
+                     const float8& b1, const float8& b2, const float8& b3,
+                     const float8& c1, const float8& c2, const float8& c3)
+{
+   return
+      a1 * (b2 * c3 - b3 * c2)
+    - b1 * (a2 * c3 - a3 * c2)
+    + c1 * (a2 * b3 - a3 * b2);
+}
+
 Sphere::Sphere(const point3f& p, float r, Material* m) : point(p), radius(r) {   material = m;   }
 
 bool Sphere::Intersect(const Ray& ray, Hit& h, float tmin) const
@@ -27,18 +68,12 @@ bool Sphere::Intersect(const Ray& ray, Hit& h, float tmin) const
 
       if (t1 > tmin && t1 < h.GetT())
       {
-         vector3f n = ray.PointAtParameter(t1) - point;
-         
-      // h.intersection_point = ray.GetOrigin() + t1 * ray.GetDirection() - point;
-         h.Set(t1, material, n.Normalize(), ray);
+         h.Record(t1, this);
          result = true;
       }
       else if (t2 > tmin && t2 < h.GetT())
       {
-         vector3f n = ray.PointAtParameter(t2) - point;
-
-      // h.intersection_point = ray.GetOrigin() + t2 * ray.GetDirection() - point;
-         h.Set(t2, material, n.Normalize(), ray);
+         h.Record(t2, this);
          result = true;
       }
    }
@@ -46,6 +81,52 @@ bool Sphere::Intersect(const Ray& ray, Hit& h, float tmin) const
    return result;
 }
 
+uint32_t Sphere::IntersectPacket(const RayPacket& packet, Hit hits[PACKET_SIZE], uint32_t active, float tmin) const
+{
+   uint32_t result = 0;
+
+   const vec3x8 o = packet.GetOrigin() - vec3x8(point);
+   const vec3x8 direction = packet.GetDirection();
+
+   const float8 b = vec3x8::Dot(o, direction);
+   const float8 c = vec3x8::Dot(o, o) - float8(radius * radius);
+   const float8 d = b * b - c;
+
+   const uint32_t two = (uint32_t) (d > float8(0.0f)).Bits() & active;
+
+   if (two == 0)
+   {
+      return result;
+   }
+
+/* The roots of every lane, then the choice between them as Intersect makes it. */
+   float t1[PACKET_SIZE], t2[PACKET_SIZE];
+
+   (-b - Sqrt(d)).Store(t1);
+   (-b + Sqrt(d)).Store(t2);
+
+   for (size_t k = 0; k < PACKET_SIZE; ++k)
+   {
+      if ((two >> k) & 1)
+      {
+         Hit& h = hits[k];
+
+         if (t1[k] > tmin && t1[k] < h.GetT())
+         {
+            h.Record(t1[k], this);
+            result = result | (1u << k);
+         }
+         else if (t2[k] > tmin && t2[k] < h.GetT())
+         {
+            h.Record(t2[k], this);
+            result = result | (1u << k);
+         }
+      }
+   }
+
+   return result;
+}
+
 bool Sphere::Intersect(const Ray& ray, Hit& h1, Hit& h2, float tmin) const
 {
    bool result = false;
@@ -69,18 +150,18 @@ bool Sphere::Intersect(const Ray& ray, Hit& h1, Hit& h2, float tmin) const
          vector3f n1 = ray.PointAtParameter(t1) - point;
          vector3f n2 = ray.PointAtParameter(t2) - point;
 
-         h1.Set(t1, material, n1.Normalize(), ray);
-         h2.Set(t2, material, n2.Normalize(), ray);
+         h1.Set(t1, material, n1.Normalize(), ray, this);
+         h2.Set(t2, material, n2.Normalize(), ray, this);
 
          result = true;
       }
-      else if (t2 > tmin && t2 < h1.GetT())
+      else if (t2 > tmin && tmin < h1.GetT())
       {
-         vector3f n1 = ray.PointAtParameter(t1) - point;
+      /* Starting inside: the interval opens at tmin, where there is no surface. */
          vector3f n2 = ray.PointAtParameter(t2) - point;
 
-         h1.Set(t2, material, n2.Normalize(), ray);
-         h2.Set(t1, material, n1.Normalize(), ray);
+         h1.Set(tmin, material, vector3f(), ray, this);
+         h2.Set(t2, material, n2.Normalize(), ray, this);
 
          result = true;
       }
@@ -94,15 +175,143 @@ bool Sphere::ShadowIntersect(const Ray& ray, Hit& h, float tmin) const
    return Intersect(ray, h, tmin);
 }
 
+void Sphere::Evaluate(const Ray& ray, Hit& h) const
+{
+   vector3f n = ray.PointAtParameter(h.GetT()) - point;
+
+   h.SetSurface(material, n.Normalize());
+
+   return;
+}
+
+bool Sphere::GetBounds(AABox& box) const
+{
+   box = AABox(point - vector3f(radius, radius, radius), point + vector3f(radius, radius, radius));
+
+   return true;
+}
+
+bool Sphere::SampleDirection(const point3f& origin, const point2f& u, vector3f& direction, float& distance, float& pdf) const
+{
+   vector3f oc = point - origin;
+   float d2 = oc.LengthSq();
+   float r2 = radius * radius;
+
+   if (d2 <= r2)
+   {
+   /* From inside, fall back on a uniform point over the whole surface. */
+      vector3f n = vector3f::RandomVectorOnUnitSphere(u);
+
+      direction = point + radius * n - origin;
+      distance = direction.Length();
+
+      if (distance <= 0.0f)
+      {
+         return false;
+      }
+
+      direction = direction / distance;
+
+      float cosine = (float) fabs(vector3f::Dot(n, direction));
+
+      if (cosine <= 0.0f)
+      {
+         return false;
+      }
+
+      pdf = (distance * distance) / (cosine * 4.0f * PI * r2);
+
+      return true;
+   }
+
+/* Otherwise sample the cone of directions the sphere subtends. */
+   float cos_max = (float) sqrt(fmax(0.0f, 1.0f - r2 / d2));
+   float cos_theta = 1.0f - u[x] * (1.0f - cos_max);
+   float sin_theta = (float) sqrt(fmax(0.0f, 1.0f - cos_theta * cos_theta));
+   float phi = 2.0f * PI * u[y];
+
+   vector3f w = oc / (float) sqrt(d2);
+   vector3f a = (fabs(w[x]) > 0.9f) ? vector3f(0.0f, 1.0f, 0.0f) : vector3f(1.0f, 0.0f, 0.0f);
+   vector3f v = vector3f::Cross(w, a).Normalize();
+   vector3f uu = vector3f::Cross(w, v);
+
+   direction = (float) cos(phi) * sin_theta * uu + (float) sin(phi) * sin_theta * v + cos_theta * w;
+
+   float b = vector3f::Dot(direction, oc);
+   distance = b - (float) sqrt(fmax(0.0f, b * b - d2 + r2));
+
+   pdf = 1.0f / (2.0f * PI * (1.0f - cos_max));
+
+   return 1.0f - cos_max > 0.0f;
+}
+
+float Sphere::GetPdfValue(const point3f& origin, const vector3f& direction) const
+{
+   Hit h;
+
+   if (Intersect(Ray(origin, direction), h, 0.0f) == false)
+   {
+      return 0.0f;
+   }
+
+   vector3f oc = point - origin;
+   float d2 = oc.LengthSq();
+   float r2 = radius * radius;
+
+   if (d2 <= r2)
+   {
+      h.Evaluate(Ray(origin, direction));
+
+      float cosine = (float) fabs(vector3f::Dot(h.GetNormal(), direction));
+
+      return cosine > 0.0f ? (h.GetT() * h.GetT()) / (cosine * 4.0f * PI * r2) : 0.0f;
+   }
+
+   float cos_max = (float) sqrt(fmax(0.0f, 1.0f - r2 / d2));
+
+   return 1.0f - cos_max > 0.0f ? 1.0f / (2.0f * PI * (1.0f - cos_max)) : 0.0f;
+}
+
+Object* Sphere::Bake(const Matrix3x4& m) const
+{
+   float scale = 1.0f;
+
+   if (m.IsSimilarity(scale) == false)
+   {
+      return NULL;
+   }
+
+   point3f p = point;
+   m.Transform(p);
+
+   return new Sphere(p, radius * scale, material);
+}
+
 MotionSphere::MotionSphere(const point3f& p, float r, const vector3f& v, Material* m) : Sphere(p, r, m), velocity(v) {   }
 
+Object* MotionSphere::Bake(const Matrix3x4& m) const
+{
+   float scale = 1.0f;
+
+   if (m.IsSimilarity(scale) == false)
+   {
+      return NULL;
+   }
+
+   point3f p = point;
+   vector3f v = velocity;
+
+   m.Transform(p);
+   m.TransformDirection(v);
+
+   return new MotionSphere(p, radius * scale, v, material);
+}
+
 bool MotionSphere::Intersect(const Ray& ray, Hit& h, float tmin) const
 {
    bool result = false;
 
-   float t = rand() / (float) RAND_MAX;
-
-   vector3f p = point + velocity * t;
+   vector3f p = point + velocity * ray.GetTime();
 
    vector3f o(ray.GetOrigin() - p);
 
@@ -120,18 +329,12 @@ bool MotionSphere::Intersect(const Ray& ray, Hit& h, float tmin) const
 
       if (t1 > tmin && t1 < h.GetT())
       {
-         vector3f n = ray.PointAtParameter(t1) - p;
-         
-      // h.intersection_point = ray.GetOrigin() + t1 * ray.GetDirection() - point;
-         h.Set(t1, material, n.Normalize(), ray);
+         h.Record(t1, this);
          result = true;
       }
       else if (t2 > tmin && t2 < h.GetT())
       {
-         vector3f n = ray.PointAtParameter(t2) - p;
-
-      // h.intersection_point = ray.GetOrigin() + t2 * ray.GetDirection() - point;
-         h.Set(t2, material, n.Normalize(), ray);
+         h.Record(t2, this);
          result = true;
       }
    }
@@ -139,6 +342,33 @@ bool MotionSphere::Intersect(const Ray& ray, Hit& h, float tmin) const
    return result;
 }
 
+uint32_t MotionSphere::IntersectPacket(const RayPacket& packet, Hit hits[PACKET_SIZE], uint32_t active, float tmin) const
+{
+/* Each ray sees the sphere where it is at the ray's own time. */
+   return Object::IntersectPacket(packet, hits, active, tmin);
+}
+
+void MotionSphere::Evaluate(const Ray& ray, Hit& h) const
+{
+   vector3f n = ray.PointAtParameter(h.GetT()) - (point + velocity * ray.GetTime());
+
+   h.SetSurface(material, n.Normalize());
+
+   return;
+}
+
+bool MotionSphere::GetBounds(AABox& box) const
+{
+/* The sphere sweeps from its centre to centre + velocity over the shutter. */
+   const vector3f r(radius, radius, radius);
+
+   box = AABox(point - r, point + r);
+   box.Expand(point + velocity - r);
+   box.Expand(point + velocity + r);
+
+   return true;
+}
+
 Plane::Plane(const vector3f& n, float offset, Material* m) : d(-offset), normal(n) {   material = m;   normal.Normalize();   }
 
 bool Plane::Intersect(const Ray& ray, Hit& h, float tmin) const
@@ -153,7 +383,7 @@ bool Plane::Intersect(const Ray& ray, Hit& h, float tmin) const
 
       if (t > tmin && t < h.GetT())
       {
-         h.Set(t, material, normal, ray);
+         h.Record(t, this);
          result = true;
       }
    }
@@ -161,11 +391,47 @@ bool Plane::Intersect(const Ray& ray, Hit& h, float tmin) const
    return result;
 }
 
+uint32_t Plane::IntersectPacket(const RayPacket& packet, Hit hits[PACKET_SIZE], uint32_t active, float tmin) const
+{
+   uint32_t result = 0;
+
+   const vec3x8 n(normal);
+
+/* A ray parallel to the plane divides by zero, and its infinite or NaN
+   distance fails the range test just as skipping it would. */
+   float t[PACKET_SIZE];
+
+   (-(float8(d) + vec3x8::Dot(n, packet.GetOrigin())) / vec3x8::Dot(n, packet.GetDirection())).Store(t);
+
+   for (size_t k = 0; k < PACKET_SIZE; ++k)
+   {
+      if (((active >> k) & 1) && t[k] > tmin && t[k] < hits[k].GetT())
+      {
+         hits[k].Record(t[k], this);
+         result = result | (1u << k);
+      }
+   }
+
+   return result;
+}
+
 bool Plane::ShadowIntersect(const Ray& ray, Hit& h, float tmin) const
 {
    return Intersect(ray, h, tmin);
 }
 
+void Plane::Evaluate(const Ray&, Hit& h) const
+{
+   h.SetSurface(material, normal);
+
+   return;
+}
+
+bool Plane::GetBounds(AABox&) const
+{
+   return false;
+}
+
 Triangle::Triangle(const point3f& a, const point3f& b, const point3f& c, Material* m) : va(a), vb(b), vc(c)
 {
    material = m;
@@ -206,7 +472,7 @@ bool Triangle::Intersect(const Ray& ray, Hit& h, float tmin) const
          if (b >= 0.0f && b <= (1.0f - g))
          {
             result = true;
-            h.Set(t, material, normal, ray);
+            h.Record(t, this, 0, b, g);
          }
       }
    }
@@ -214,11 +480,87 @@ bool Triangle::Intersect(const Ray& ray, Hit& h, float tmin) const
    return result;
 }
 
+uint32_t Triangle::IntersectPacket(const RayPacket& packet, Hit hits[PACKET_SIZE], uint32_t active, float tmin) const
+{
+   uint32_t result = 0;
+
+   const vec3x8 o = packet.GetOrigin();
+   const vec3x8 direction = packet.GetDirection();
+
+   const float8 ab[3] = {float8(va[x] - vb[x]), float8(va[y] - vb[y]), float8(va[z] - vb[z])};
+   const float8 ac[3] = {float8(va[x] - vc[x]), float8(va[y] - vc[y]), float8(va[z] - vc[z])};
+   const float8 ao[3] = {float8(va[x]) - o[x], float8(va[y]) - o[y], float8(va[z]) - o[z]};
+
+   const float8 a = Det3x3(ab[x], ac[x], direction[x],
+                           ab[y], ac[y], direction[y],
+                           ab[z], ac[z], direction[z]);
+
+/* All three ratios for every lane; each lane then passes or fails as Intersect would. */
+   float t[PACKET_SIZE], g[PACKET_SIZE], b[PACKET_SIZE];
+
+   (Det3x3(ab[x], ac[x], ao[x],
+           ab[y], ac[y], ao[y],
+           ab[z], ac[z], ao[z]) / a).Store(t);
+   (Det3x3(ab[x], ao[x], direction[x],
+           ab[y], ao[y], direction[y],
+           ab[z], ao[z], direction[z]) / a).Store(g);
+   (Det3x3(ao[x], ac[x], direction[x],
+           ao[y], ac[y], direction[y],
+           ao[z], ac[z], direction[z]) / a).Store(b);
+
+   for (size_t k = 0; k < PACKET_SIZE; ++k)
+   {
+      if (((active >> k) & 1) && t[k] > tmin && t[k] < hits[k].GetT() &&
+          g[k] >= 0.0f && g[k] <= 1.0f && b[k] >= 0.0f && b[k] <= (1.0f - g[k]))
+      {
+         hits[k].Record(t[k], this, 0, b[k], g[k]);
+         result = result | (1u << k);
+      }
+   }
+
+   return result;
+}
+
 bool Triangle::ShadowIntersect(const Ray& ray, Hit& h, float tmin) const
 {
    return Intersect(ray, h, tmin);
 }
 
+void Triangle::Evaluate(const Ray&, Hit& h) const
+{
+   h.SetSurface(material, normal);
+
+   return;
+}
+
+bool Triangle::GetBounds(AABox& box) const
+{
+   box = AABox();
+   box.Expand(va);
+   box.Expand(vb);
+   box.Expand(vc);
+
+   return true;
+}
+
+Object* Triangle::Bake(const Matrix3x4& m) const
+{
+   point3f a = va, b = vb, c = vc;
+
+   m.Transform(a);
+   m.Transform(b);
+   m.Transform(c);
+
+/* A reflection turns the winding over; swap two corners so the normal still
+   faces the way the transformed one would. */
+   if (m.Determinant() < 0.0f)
+   {
+      return new Triangle(b, a, c, material);
+   }
+
+   return new Triangle(a, b, c, material);
+}
+
 Cone::Cone(const point3f& tip, const vector3f& ax, const float cos2a, const float h, Material* m) : v(tip), axis(ax), cos2_angle_sq(cos2a), height(h)
 {
    material = m;
@@ -253,16 +595,10 @@ bool Cone::Intersect(const Ray& ray, Hit& h, float tmin) const
       {
          result = false;
       }
-      else
+      else if (t > tmin && t < h.GetT())
       {
-         vector3f n = (cp * vector3f::Dot(axis, cp) / vector3f::Dot(cp, cp)) - axis;
-         n.Normalize();
-
-         if (t > tmin && t < h.GetT())
-         {
-            h.Set(t, material, n, ray);
-            result = true;
-         }
+         h.Record(t, this);
+         result = true;
       }
    }
 
@@ -274,6 +610,30 @@ bool Cone::ShadowIntersect(const Ray& ray, Hit& h, float tmin) const
    return Intersect(ray, h, tmin);
 }
 
+void Cone::Evaluate(const Ray& ray, Hit& h) const
+{
+   vector3f cp = ray.GetOrigin() + h.GetT() * ray.GetDirection() - v;
+   vector3f n = (cp * vector3f::Dot(axis, cp) / vector3f::Dot(cp, cp)) - axis;
+
+   h.SetSurface(material, n.Normalize());
+
+   return;
+}
+
+bool Cone::GetBounds(AABox& box) const
+{
+/* The cone runs from the tip along the axis for height; Intersect treats
+   cos2_angle_sq as the squared cosine, so the base radius follows from it. */
+   const float base_radius = height * (float) sqrt((1.0f - cos2_angle_sq) / cos2_angle_sq);
+   const point3f base = v + axis * height;
+   const vector3f r(base_radius, base_radius, base_radius);
+
+   box = AABox(base - r, base + r);
+   box.Expand(v);
+
+   return true;
+}
+
 XYRectangle::XYRectangle(const point2f low, const point2f up, const float _k, const float n, Material* m)
 {
    material = m;
@@ -300,7 +660,7 @@ bool XYRectangle::Intersect(const Ray& ray, Hit& h, float tmin) const
 
       if (fx > lower[x] && fx < upper[x] && fy > lower[y] && fy < upper[y])
       {
-         h.Set(t, material, normal, ray);
+         h.Record(t, this);
 
          result = true;
       }
@@ -309,52 +669,99 @@ bool XYRectangle::Intersect(const Ray& ray, Hit& h, float tmin) const
    return result;
 }
 
+uint32_t XYRectangle::IntersectPacket(const RayPacket& packet, Hit hits[PACKET_SIZE], uint32_t active, float tmin) const
+{
+   uint32_t result = 0;
+
+   const vec3x8 o = packet.GetOrigin();
+   const vec3x8 direction = packet.GetDirection();
+
+   const float8 t = (float8(k) - o[z]) * float8::Load(packet.inverse_direction[z]);
+   const float8 fx = o[x] + t * direction[x];
+   const float8 fy = o[y] + t * direction[y];
+
+   const mask8 inside = (t > float8(tmin)) & (fx > float8(lower[x])) & (fx < float8(upper[x])) & (fy > float8(lower[y])) & (fy < float8(upper[y]));
+
+   const uint32_t candidates = (uint32_t) inside.Bits() & active;
+
+   for (size_t lane = 0; lane < PACKET_SIZE; ++lane)
+   {
+      if (((candidates >> lane) & 1) && t[lane] < hits[lane].GetT())
+      {
+         hits[lane].Record(t[lane], this);
+         result = result | (1u << lane);
+      }
+   }
+
+   return result;
+}
+
 bool XYRectangle::ShadowIntersect(const Ray& ray, Hit& h, float tmin) const
 {
    return Intersect(ray, h, tmin);
 }
 
-XZRectangle::XZRectangle(const point2f low, const point2f up, const float _k, const float n, Material* m)
+void XYRectangle::Evaluate(const Ray&, Hit& h) const
 {
-   material = m;
+   h.SetSurface(material, normal);
 
-   lower = low;
-   upper = up;
+   return;
+}
 
-   k = _k;
+bool XYRectangle::GetBounds(AABox& box) const
+{
+/* Pad the flat side a little so the slab test always has something to hit. */
+   box = AABox(point3f(lower[x], lower[y], k - EPSILON_BOUNDS), point3f(upper[x], upper[y], k + EPSILON_BOUNDS));
 
-   normal = vector3f(0.0f, n, 0.0f);
-   normal.Normalize();
+   return true;
 }
 
-bool XZRectangle::Intersect(const Ray& ray, Hit& h, float tmin) const
+bool XYRectangle::SampleDirection(const point3f& origin, const point2f& u, vector3f& direction, float& distance, float& pdf) const
 {
-   bool result = false;
+   point3f p(lower[x] + u[x] * (upper[x] - lower[x]),
+             lower[y] + u[y] * (upper[y] - lower[y]),
+             k);
 
-   float t = (k - ray.GetOrigin()[y]) * ray.GetInverseDirectionForAABoxFaceIntersection()[y];
+   direction = p - origin;
+   distance = direction.Length();
 
-   if (t > tmin && t < h.GetT())
+   if (distance <= 0.0f)
    {
-      float fx = ray.GetOrigin()[x] + t * ray.GetDirection()[x];
-      float fz = ray.GetOrigin()[z] + t * ray.GetDirection()[z];
+      return false;
+   }
 
-      if (fx > lower[x] && fx < upper[x] && fz > lower[y] && fz < upper[y])
-      {
-         h.Set(t, material, normal, ray);
+   direction = direction / distance;
 
-         result = true;
-      }
+   float cosine = (float) fabs(direction[z]);
+   float area = (upper[x] - lower[x]) * (upper[y] - lower[y]);
+
+   if (cosine < 1e-6f || area <= 0.0f)
+   {
+      return false;
    }
 
-   return result;
+/* Convert the uniform area density to solid angle. */
+   pdf = (distance * distance) / (cosine * area);
+
+   return true;
 }
 
-bool XZRectangle::ShadowIntersect(const Ray& ray, Hit& h, float tmin) const
+float XYRectangle::GetPdfValue(const point3f& origin, const vector3f& direction) const
 {
-   return Intersect(ray, h, tmin);
+   Hit h;
+
+   if (Intersect(Ray(origin, direction), h, 0.0f) == false)
+   {
+      return 0.0f;
+   }
+
+   float cosine = (float) fabs(direction[z]);
+   float area = (upper[x] - lower[x]) * (upper[y] - lower[y]);
+
+   return cosine < 1e-6f || area <= 0.0f ? 0.0f : (h.GetT() * h.GetT()) / (cosine * area);
 }
 
-YZRectangle::YZRectangle(const point2f low, const point2f up, const float _k, const float n, Material* m)
+XZRectangle::XZRectangle(const point2f low, const point2f up, const float _k, const float n, Material* m)
 {
    material = m;
 
@@ -363,24 +770,24 @@ YZRectangle::YZRectangle(const point2f low, const point2f up, const float _k, co
 
    k = _k;
 
-   normal = vector3f(n, 0.0f, 0.0f);
+   normal = vector3f(0.0f, n, 0.0f);
    normal.Normalize();
 }
 
-bool YZRectangle::Intersect(const Ray& ray, Hit& h, float tmin) const
+bool XZRectangle::Intersect(const Ray& ray, Hit& h, float tmin) const
 {
    bool result = false;
 
-   float t = (k - ray.GetOrigin()[x]) * ray.GetInverseDirectionForAABoxFaceIntersection()[x];
+   float t = (k - ray.GetOrigin()[y]) * ray.GetInverseDirectionForAABoxFaceIntersection()[y];
 
    if (t > tmin && t < h.GetT())
    {
-      float fy = ray.GetOrigin()[y] + t * ray.GetDirection()[y];
+      float fx = ray.GetOrigin()[x] + t * ray.GetDirection()[x];
       float fz = ray.GetOrigin()[z] + t * ray.GetDirection()[z];
 
-      if (fy > lower[x] && fy < upper[x] && fz > lower[y] && fz < upper[y])
+      if (fx > lower[x] && fx < upper[x] && fz > lower[y] && fz < upper[y])
       {
-         h.Set(t, material, normal, ray);
+         h.Record(t, this);
 
          result = true;
       }
@@ -389,11 +796,225 @@ bool YZRectangle::Intersect(const Ray& ray, Hit& h, float tmin) const
    return result;
 }
 
-bool YZRectangle::ShadowIntersect(const Ray& ray, Hit& h, float tmin) const
+uint32_t XZRectangle::IntersectPacket(const RayPacket& packet, Hit hits[PACKET_SIZE], uint32_t active, float tmin) const
+{
+   uint32_t result = 0;
+
+   const vec3x8 o = packet.GetOrigin();
+   const vec3x8 direction = packet.GetDirection();
+
+   const float8 t = (float8(k) - o[y]) * float8::Load(packet.inverse_direction[y]);
+   const float8 fx = o[x] + t * direction[x];
+   const float8 fz = o[z] + t * direction[z];
+
+   const mask8 inside = (t > float8(tmin)) & (fx > float8(lower[x])) & (fx < float8(upper[x])) & (fz > float8(lower[y])) & (fz < float8(upper[y]));
+
+   const uint32_t candidates = (uint32_t) inside.Bits() & active;
+
+   for (size_t lane = 0; lane < PACKET_SIZE; ++lane)
+   {
+      if (((candidates >> lane) & 1) && t[lane] < hits[lane].GetT())
+      {
+         hits[lane].Record(t[lane], this);
+         result = result | (1u << lane);
+      }
+   }
+
+   return result;
+}
+
+bool XZRectangle::ShadowIntersect(const Ray& ray, Hit& h, float tmin) const
+{
+   return Intersect(ray, h, tmin);
+}
+
+void XZRectangle::Evaluate(const Ray&, Hit& h) const
+{
+   h.SetSurface(material, normal);
+
+   return;
+}
+
+bool XZRectangle::GetBounds(AABox& box) const
+{
+/* Pad the flat side a little so the slab test always has something to hit. */
+   box = AABox(point3f(lower[x], k - EPSILON_BOUNDS, lower[y]), point3f(upper[x], k + EPSILON_BOUNDS, upper[y]));
+
+   return true;
+}
+
+bool XZRectangle::SampleDirection(const point3f& origin, const point2f& u, vector3f& direction, float& distance, float& pdf) const
+{
+   point3f p(lower[x] + u[x] * (upper[x] - lower[x]),
+             k,
+             lower[y] + u[y] * (upper[y] - lower[y]));
+
+   direction = p - origin;
+   distance = direction.Length();
+
+   if (distance <= 0.0f)
+   {
+      return false;
+   }
+
+   direction = direction / distance;
+
+   float cosine = (float) fabs(direction[y]);
+   float area = (upper[x] - lower[x]) * (upper[y] - lower[y]);
+
+   if (cosine < 1e-6f || area <= 0.0f)
+   {
+      return false;
+   }
+
+/* Convert the uniform area density to solid angle. */
+   pdf = (distance * distance) / (cosine * area);
+
+   return true;
+}
+
+float XZRectangle::GetPdfValue(const point3f& origin, const vector3f& direction) const
+{
+   Hit h;
+
+   if (Intersect(Ray(origin, direction), h, 0.0f) == false)
+   {
+      return 0.0f;
+   }
+
+   float cosine = (float) fabs(direction[y]);
+   float area = (upper[x] - lower[x]) * (upper[y] - lower[y]);
+
+   return cosine < 1e-6f || area <= 0.0f ? 0.0f : (h.GetT() * h.GetT()) / (cosine * area);
+}
+
+YZRectangle::YZRectangle(const point2f low, const point2f up, const float _k, const float n, Material* m)
+{
+   material = m;
+
+   lower = low;
+   upper = up;
+
+   k = _k;
+
+   normal = vector3f(n, 0.0f, 0.0f);
+   normal.Normalize();
+}
+
+bool YZRectangle::Intersect(const Ray& ray, Hit& h, float tmin) const
+{
+   bool result = false;
+
+   float t = (k - ray.GetOrigin()[x]) * ray.GetInverseDirectionForAABoxFaceIntersection()[x];
+
+   if (t > tmin && t < h.GetT())
+   {
+      float fy = ray.GetOrigin()[y] + t * ray.GetDirection()[y];
+      float fz = ray.GetOrigin()[z] + t * ray.GetDirection()[z];
+
+      if (fy > lower[x] && fy < upper[x] && fz > lower[y] && fz < upper[y])
+      {
+         h.Record(t, this);
+
+         result = true;
+      }
+   }
+
+   return result;
+}
+
+uint32_t YZRectangle::IntersectPacket(const RayPacket& packet, Hit hits[PACKET_SIZE], uint32_t active, float tmin) const
+{
+   uint32_t result = 0;
+
+   const vec3x8 o = packet.GetOrigin();
+   const vec3x8 direction = packet.GetDirection();
+
+   const float8 t = (float8(k) - o[x]) * float8::Load(packet.inverse_direction[x]);
+   const float8 fy = o[y] + t * direction[y];
+   const float8 fz = o[z] + t * direction[z];
+
+   const mask8 inside = (t > float8(tmin)) & (fy > float8(lower[x])) & (fy < float8(upper[x])) & (fz > float8(lower[y])) & (fz < float8(upper[y]));
+
+   const uint32_t candidates = (uint32_t) inside.Bits() & active;
+
+   for (size_t lane = 0; lane < PACKET_SIZE; ++lane)
+   {
+      if (((candidates >> lane) & 1) && t[lane] < hits[lane].GetT())
+      {
+         hits[lane].Record(t[lane], this);
+         result = result | (1u << lane);
+      }
+   }
+
+   return result;
+}
+
+bool YZRectangle::ShadowIntersect(const Ray& ray, Hit& h, float tmin) const
 {
    return Intersect(ray, h, tmin);
 }
 
+void YZRectangle::Evaluate(const Ray&, Hit& h) const
+{
+   h.SetSurface(material, normal);
+
+   return;
+}
+
+bool YZRectangle::GetBounds(AABox& box) const
+{
+/* Pad the flat side a little so the slab test always has something to hit. */
+   box = AABox(point3f(k - EPSILON_BOUNDS, lower[x], lower[y]), point3f(k + EPSILON_BOUNDS, upper[x], upper[y]));
+
+   return true;
+}
+
+bool YZRectangle::SampleDirection(const point3f& origin, const point2f& u, vector3f& direction, float& distance, float& pdf) const
+{
+   point3f p(k,
+             lower[x] + u[x] * (upper[x] - lower[x]),
+             lower[y] + u[y] * (upper[y] - lower[y]));
+
+   direction = p - origin;
+   distance = direction.Length();
+
+   if (distance <= 0.0f)
+   {
+      return false;
+   }
+
+   direction = direction / distance;
+
+   float cosine = (float) fabs(direction[x]);
+   float area = (upper[x] - lower[x]) * (upper[y] - lower[y]);
+
+   if (cosine < 1e-6f || area <= 0.0f)
+   {
+      return false;
+   }
+
+/* Convert the uniform area density to solid angle. */
+   pdf = (distance * distance) / (cosine * area);
+
+   return true;
+}
+
+float YZRectangle::GetPdfValue(const point3f& origin, const vector3f& direction) const
+{
+   Hit h;
+
+   if (Intersect(Ray(origin, direction), h, 0.0f) == false)
+   {
+      return 0.0f;
+   }
+
+   float cosine = (float) fabs(direction[x]);
+   float area = (upper[x] - lower[x]) * (upper[y] - lower[y]);
+
+   return cosine < 1e-6f || area <= 0.0f ? 0.0f : (h.GetT() * h.GetT()) / (cosine * area);
+}
+
 Cube::Cube(const point3f& p, float size, Material* m)
 {
    size = size / 2.0f;
@@ -416,7 +1037,7 @@ bool Cube::Intersect(const Ray& ray, Hit& h, float tmin) const
 {
    bool result = false;
 
-   vector3f n;
+   vector3f n, nmax;
    float tmax = FLT_MAX;
 
    float tx0 = (min[x] - ray.GetOrigin()[x]) * ray.GetInverseDirectionForAABoxFaceIntersection()[x];
@@ -433,6 +1054,7 @@ bool Cube::Intersect(const Ray& ray, Hit& h, float tmin) const
       if (tx1 < tmax)
       {
          tmax = tx1;
+         nmax = vector3f(1.0f, 0.0f, 0.0f);
       }
    }
    else
@@ -446,6 +1068,7 @@ bool Cube::Intersect(const Ray& ray, Hit& h, float tmin) const
       if (tx0 < tmax)
       {
          tmax = tx0;
+         nmax = vector3f(-1.0f, 0.0f, 0.0f);
       }
    }
 
@@ -465,6 +1088,7 @@ bool Cube::Intersect(const Ray& ray, Hit& h, float tmin) const
          if (ty1 < tmax)
          {
             tmax = ty1;
+            nmax = vector3f(0.0f, 1.0f, 0.0f);
          }
       }
       else
@@ -478,6 +1102,7 @@ bool Cube::Intersect(const Ray& ray, Hit& h, float tmin) const
          if (ty0 < tmax)
          {
             tmax = ty0;
+            nmax = vector3f(0.0f, -1.0f, 0.0f);
          }
       }
 
@@ -497,6 +1122,7 @@ bool Cube::Intersect(const Ray& ray, Hit& h, float tmin) const
             if (tz1 < tmax)
             {
                tmax = tz1;
+               nmax = vector3f(0.0f, 0.0f, 1.0f);
             }
          }
          else
@@ -510,14 +1136,25 @@ bool Cube::Intersect(const Ray& ray, Hit& h, float tmin) const
             if (tz0 < tmax)
             {
                tmax = tz0;
+               nmax = vector3f(0.0f, 0.0f, -1.0f);
             }
          }
 
          if (tmin < tmax)
          {
+         /* No face was entered past tmin: the ray starts inside and leaves through the far one. */
+            if (n.LengthSq() == 0.0f)
+            {
+               tmin = tmax;
+               n = nmax;
+            }
+
             if (tmin > 0.0 && tmin < h.GetT())
             {
-               h.Set(tmin, material, n, ray);
+            /* The face is kept as twice its axis, plus one on the positive side. */
+               const uint32_t axis = n[x] != 0.0f ? 0 : (n[y] != 0.0f ? 1 : 2);
+
+               h.Record(tmin, this, 2 * axis + (n[axis] > 0.0f ? 1 : 0));
 
                result = true;
             }
@@ -528,6 +1165,66 @@ bool Cube::Intersect(const Ray& ray, Hit& h, float tmin) const
    return result;
 }
 
+uint32_t Cube::IntersectPacket(const RayPacket& packet, Hit hits[PACKET_SIZE], uint32_t active, float tmin) const
+{
+   uint32_t result = 0;
+
+/* Intersect's slabs across the lanes, each of its branches a select. The
+   faces are numbered as Intersect records them, and a ray that enters no
+   face before tmin leaves by the far one. */
+   const vec3x8 o = packet.GetOrigin();
+   const vec3x8 inverse_direction = packet.GetInverseDirection();
+
+   float8 t_enter(tmin), t_leave(FLT_MAX), face_enter(0.0f), face_leave(4.0f);
+   mask8 entered(false), alive(true);
+
+   for (size_t i = 0; i < 3; ++i)
+   {
+      const float8 t0 = (float8(min[i]) - o[i]) * inverse_direction[i];
+      const float8 t1 = (float8(max[i]) - o[i]) * inverse_direction[i];
+
+      const mask8 ordered = t0 < t1;
+      const float8 low = Select(ordered, t0, t1), high = Select(ordered, t1, t0);
+      const float8 face_low = Select(ordered, float8((float) (2 * i)), float8((float) (2 * i + 1)));
+      const float8 face_high = Select(ordered, float8((float) (2 * i + 1)), float8((float) (2 * i)));
+
+      const mask8 enters = low > t_enter, leaves = high < t_leave;
+
+      t_enter = Select(enters, low, t_enter);
+      face_enter = Select(enters, face_low, face_enter);
+      entered = entered | enters;
+
+      t_leave = Select(leaves, high, t_leave);
+      face_leave = Select(leaves, face_high, face_leave);
+
+      alive = alive & (t_enter < t_leave);
+   }
+
+   const float8 t = Select(entered, t_enter, t_leave);
+   const uint32_t candidates = (uint32_t) (alive & (t > float8(0.0f))).Bits() & active;
+
+   if (candidates == 0)
+   {
+      return result;
+   }
+
+   float distance[PACKET_SIZE], face[PACKET_SIZE];
+
+   t.Store(distance);
+   Select(entered, face_enter, face_leave).Store(face);
+
+   for (size_t k = 0; k < PACKET_SIZE; ++k)
+   {
+      if (((candidates >> k) & 1) && distance[k] < hits[k].GetT())
+      {
+         hits[k].Record(distance[k], this, (uint32_t) face[k]);
+         result = result | (1u << k);
+      }
+   }
+
+   return result;
+}
+
 bool Cube::Intersect(const Ray& ray, Hit& h1, Hit& h2, float tmin) const
 {
    bool result = false;
@@ -637,10 +1334,12 @@ bool Cube::Intersect(const Ray& ray, Hit& h1, Hit& h2, float tmin) const
 
          if (tmin < tmax)
          {
+         /* Starting inside, no face was entered past tmin: the interval opens
+            there without a normal, as Solid describes. */
             if (tmin > 0.0 && tmin < h1.GetT())
             {
-               h1.Set(tmin, material, nmin, ray);
-               h2.Set(tmax, material, nmax, ray);
+               h1.Set(tmin, material, nmin, ray, this);
+               h2.Set(tmax, material, nmax, ray, this);
 
                result = true;
             }
@@ -656,7 +1355,128 @@ bool Cube::ShadowIntersect(const Ray& ray, Hit& h, float tmin) const
    return Intersect(ray, h, tmin);
 }
 
-Group::Group(size_t s) : size(s), bb_vmin(FLT_MAX, FLT_MAX, FLT_MAX), bb_vmax(-FLT_MAX, -FLT_MAX, -FLT_MAX)
+void Cube::Evaluate(const Ray&, Hit& h) const
+{
+   vector3f n;
+   n[h.GetPrimitive() / 2] = (h.GetPrimitive() & 1) ? 1.0f : -1.0f;
+
+   h.SetSurface(material, n);
+
+   return;
+}
+
+bool Cube::GetBounds(AABox& box) const
+{
+   box = AABox(min, max);
+
+   return true;
+}
+
+Object* Cube::Bake(const Matrix3x4& m) const
+{
+/* Only scaling along the axes and moving keep the box axis aligned. */
+   if (m.IsDiagonal() == false)
+   {
+      return NULL;
+   }
+
+   point3f a = min, b = max;
+
+   m.Transform(a);
+   m.Transform(b);
+
+   AABox box;
+   box.Expand(a);
+   box.Expand(b);
+
+   return new Cube(box.vmin, box.vmax, material);
+}
+
+namespace
+{
+/* The loops over a run of one kind. Naming the class in the call skips the
+   table of virtual functions and lets the test be inlined. */
+   template <class T>
+   bool IntersectRun(const T* p, uint32_t count, const Ray& ray, Hit& h, float tmin, bool any)
+   {
+      bool hit = false;
+
+      for (uint32_t i = 0; i < count && (hit == false || any == false); ++i)
+      {
+         if (p[i].T::Intersect(ray, h, tmin) != false)
+         {
+            hit = true;
+         }
+      }
+
+      return hit;
+   }
+
+   template <class T>
+   uint32_t IntersectRunPacket(const T* p, uint32_t count, const RayPacket& packet, Hit hits[PACKET_SIZE], uint32_t active, float tmin)
+   {
+      uint32_t hit = 0;
+
+      for (uint32_t i = 0; i < count; ++i)
+      {
+         hit = hit | p[i].T::IntersectPacket(packet, hits, active, tmin);
+      }
+
+      return hit;
+   }
+
+/* For the kinds without a packet test of their own, a ray at a time. */
+   template <class T>
+   uint32_t IntersectRunRays(const T* p, uint32_t count, const RayPacket& packet, Hit hits[PACKET_SIZE], uint32_t active, float tmin)
+   {
+      uint32_t hit = 0;
+
+      for (uint32_t i = 0; i < count; ++i)
+      {
+         for (size_t k = 0; k < PACKET_SIZE; ++k)
+         {
+            if (((active >> k) & 1) && p[i].T::Intersect(packet.rays[k], hits[k], tmin) != false)
+            {
+               hit = hit | (1u << k);
+            }
+         }
+      }
+
+      return hit;
+   }
+
+/* Moves the children of kind k into the array, keeping their order, and
+   notes where each went in index. */
+   template <class T>
+   void Keep(Object** object, size_t size, const Object::Kind* kind, Object::Kind k, uint32_t* index, std::vector<T>& array)
+   {
+      size_t count = 0;
+
+      for (size_t i = 0; i < size; ++i)
+      {
+         count = count + (kind[i] == k ? 1 : 0);
+      }
+
+   /* Reserved up front, so the array never moves under the pointers. */
+      array.reserve(count);
+
+      for (size_t i = 0; i < size; ++i)
+      {
+         if (kind[i] == k)
+         {
+            index[i] = (uint32_t) array.size();
+            array.push_back(*static_cast<const T*>(object[i]));
+
+            delete object[i];
+            object[i] = &array.back();
+         }
+      }
+
+      return;
+   }
+}
+
+Group::Group(size_t s) : size(s), kind(s, Kind::Other), num_unbounded_runs(0), num_bounded(0)
 {
    object = new Object*[size];
 
@@ -668,129 +1488,320 @@ Group::Group(size_t s) : size(s), bb_vmin(FLT_MAX, FLT_MAX, FLT_MAX), bb_vmax(-F
 
 Group::~Group()
 {
+/* The kept children belong to their arrays. */
    for (size_t i = 0; i < size; ++i)
    {
-      delete object[i];
+      if (kind[i] == Kind::Other)
+      {
+         delete object[i];
+      }
    }
 
    delete [] object;
 }
 
-bool Group::Intersect(const Ray& ray, Hit& h, float tmin) const
+bool Group::IntersectRuns(uint32_t first, uint32_t count, const Ray& ray, Hit& h, float tmin, bool any) const
 {
    bool result = false;
 
-   if (PossibleHit(ray, tmin) != false)
+   for (uint32_t r = first; r < first + count && (result == false || any == false); ++r)
    {
-      for (size_t i = 0; i < size; ++i)
+      const Run& run = runs[r];
+
+      bool hit = false;
+
+      switch (run.kind)
+      {
+      case Kind::Sphere:
+         hit = IntersectRun(spheres.data() + run.first, run.count, ray, h, tmin, any);
+         break;
+
+      case Kind::MotionSphere:
+         hit = IntersectRun(motion_spheres.data() + run.first, run.count, ray, h, tmin, any);
+         break;
+
+      case Kind::Cube:
+         hit = IntersectRun(cubes.data() + run.first, run.count, ray, h, tmin, any);
+         break;
+
+      case Kind::Cone:
+         hit = IntersectRun(cones.data() + run.first, run.count, ray, h, tmin, any);
+         break;
+
+      case Kind::XYRectangle:
+         hit = IntersectRun(xy_rectangles.data() + run.first, run.count, ray, h, tmin, any);
+         break;
+
+      case Kind::XZRectangle:
+         hit = IntersectRun(xz_rectangles.data() + run.first, run.count, ray, h, tmin, any);
+         break;
+
+      case Kind::YZRectangle:
+         hit = IntersectRun(yz_rectangles.data() + run.first, run.count, ray, h, tmin, any);
+         break;
+
+      case Kind::Triangle:
+         hit = IntersectRun(triangles.data() + run.first, run.count, ray, h, tmin, any);
+         break;
+
+      case Kind::Plane:
+         hit = IntersectRun(planes.data() + run.first, run.count, ray, h, tmin, any);
+         break;
+
+      default:
+         for (uint32_t i = run.first; i < run.first + run.count && (hit == false || any == false); ++i)
+         {
+            if (others[i]->Intersect(ray, h, tmin) != false)
+            {
+               hit = true;
+            }
+         }
+         break;
+      }
+
+      if (hit != false)
       {
-         if (object[i]->Intersect(ray, h, tmin) != false)
+         result = true;
+      }
+   }
+
+   return result;
+}
+
+uint32_t Group::IntersectRunsPacket(uint32_t first, uint32_t count, const RayPacket& packet, Hit hits[PACKET_SIZE], uint32_t active, float tmin) const
+{
+   uint32_t result = 0;
+
+   for (uint32_t r = first; r < first + count; ++r)
+   {
+      const Run& run = runs[r];
+
+      switch (run.kind)
+      {
+      case Kind::Sphere:
+         result = result | IntersectRunPacket(spheres.data() + run.first, run.count, packet, hits, active, tmin);
+         break;
+
+      case Kind::MotionSphere:
+         result = result | IntersectRunRays(motion_spheres.data() + run.first, run.count, packet, hits, active, tmin);
+         break;
+
+      case Kind::Cube:
+         result = result | IntersectRunPacket(cubes.data() + run.first, run.count, packet, hits, active, tmin);
+         break;
+
+      case Kind::Cone:
+         result = result | IntersectRunRays(cones.data() + run.first, run.count, packet, hits, active, tmin);
+         break;
+
+      case Kind::XYRectangle:
+         result = result | IntersectRunPacket(xy_rectangles.data() + run.first, run.count, packet, hits, active, tmin);
+         break;
+
+      case Kind::XZRectangle:
+         result = result | IntersectRunPacket(xz_rectangles.data() + run.first, run.count, packet, hits, active, tmin);
+         break;
+
+      case Kind::YZRectangle:
+         result = result | IntersectRunPacket(yz_rectangles.data() + run.first, run.count, packet, hits, active, tmin);
+         break;
+
+      case Kind::Triangle:
+         result = result | IntersectRunPacket(triangles.data() + run.first, run.count, packet, hits, active, tmin);
+         break;
+
+      case Kind::Plane:
+         result = result | IntersectRunPacket(planes.data() + run.first, run.count, packet, hits, active, tmin);
+         break;
+
+      default:
+         for (uint32_t i = run.first; i < run.first + run.count; ++i)
          {
-            result = true;
+            result = result | others[i]->IntersectPacket(packet, hits, active, tmin);
          }
+         break;
       }
    }
 
    return result;
 }
 
-bool Group::ShadowIntersect(const Ray& ray, Hit& h, float tmin) const
+bool Group::Intersect(const Ray& ray, Hit& h, float tmin) const
 {
-   bool result = false;
+   bool result = IntersectRuns(0, num_unbounded_runs, ray, h, tmin, false);
 
-   for (size_t i = 0; i < size && result == false; ++i)
+   auto leaf = [this, &ray, &h, tmin](uint32_t first, uint32_t count)
    {
-      result = object[i]->Intersect(ray, h, tmin);
+      return IntersectRuns(first, count, ray, h, tmin, false);
+   };
+
+   if (bvh.Traverse(ray, h, tmin, leaf) != false)
+   {
+      result = true;
    }
 
    return result;
 }
 
-void Group::SetAt(size_t i, Object* obj)
+uint32_t Group::IntersectPacket(const RayPacket& packet, Hit hits[PACKET_SIZE], uint32_t active, float tmin) const
 {
-   if (i < size)
+   uint32_t result = IntersectRunsPacket(0, num_unbounded_runs, packet, hits, active, tmin);
+
+   auto leaf = [this, &packet, hits, tmin](uint32_t first, uint32_t count, uint32_t rays)
    {
-      object[i] = obj;
+      return IntersectRunsPacket(first, count, packet, hits, rays, tmin);
+   };
+
+   result = result | bvh.TraversePacket(packet, hits, active, tmin, leaf);
+
+   return result;
+}
+
+bool Group::ShadowIntersect(const Ray& ray, Hit& h, float tmin) const
+{
+   bool result = IntersectRuns(0, num_unbounded_runs, ray, h, tmin, true);
+
+   if (result == false)
+   {
+      auto leaf = [this, &ray, &h, tmin](uint32_t first, uint32_t count)
+      {
+         return IntersectRuns(first, count, ray, h, tmin, true);
+      };
+
+      result = bvh.Traverse(ray, h, tmin, leaf, true);
    }
 
-   return;
+   return result;
 }
 
-void Group::SetBB(const point3f& vmin, const point3f& vmax)
+bool Group::GetBounds(AABox& box) const
 {
-   bb_vmin = vmin;
-   bb_vmax = vmax;
+   box = bvh.GetBounds();
+
+   return num_bounded == size && num_bounded > 0;
+}
+
+void Group::SetAt(size_t i, Object* obj)
+{
+   if (i < size)
+   {
+      object[i] = obj;
+   }
 
    return;
 }
 
-bool Group::PossibleHit(const Ray& ray, float tmin) const
+uint32_t Group::AddRuns(size_t begin, size_t end, const uint32_t* index)
 {
-   float tmax = FLT_MAX;
-   bool result = true; /* Assume a hit. */
+   uint32_t result = 0;
+   uint32_t added = 0; /* Bit k set once the run of kind k is in. */
 
-   if (bb_vmax > bb_vmin)
+   for (size_t i = begin; i < end; ++i)
    {
-      float t0 = (bb_vmin[x] - ray.GetOrigin()[x]) * ray.GetInverseDirectionForAABoxFaceIntersection()[x];
-      float t1 = (bb_vmax[x] - ray.GetOrigin()[x]) * ray.GetInverseDirectionForAABoxFaceIntersection()[x];
+      uint32_t bit = 1u << (uint32_t) kind[i];
 
-      if (ray.GetInverseDirectionForAABoxFaceIntersection()[x] < 0.0f)
+      if ((added & bit) == 0)
       {
-         float tmp = t0;
-         t0 = t1;
-         t1 = tmp;
+      /* The children of a kind sit in their array in the order of object,
+         so those in the range follow on from the first. */
+         Run run = {index[i], 0, kind[i]};
+
+         for (size_t j = i; j < end; ++j)
+         {
+            run.count = run.count + (kind[j] == kind[i] ? 1 : 0);
+         }
+
+         runs.push_back(run);
+
+         added = added | bit;
+         ++result;
       }
+   }
+
+   return result;
+}
 
-      tmin = t0 > tmin ? t0 : tmin;
-      tmax = t1 < tmax ? t1 : tmax;
+void Group::Build(Scheduler* scheduler, BVH::Type type)
+{
+   AABox* bounds = new AABox[size];
+   Object** bounded = new Object*[size];
+   Object** sorted = new Object*[size];
+   uint32_t* order = new uint32_t[size];
+
+   size_t num_unbounded = 0;
+   num_bounded = 0;
 
-      if (tmin > tmax)
+   for (size_t i = 0; i < size; ++i)
+   {
+      if (object[i]->GetBounds(bounds[num_bounded]) != false)
       {
-         result = false;
+         bounded[num_bounded++] = object[i];
       }
       else
       {
-         t0 = (bb_vmin[y] - ray.GetOrigin()[y]) * ray.GetInverseDirectionForAABoxFaceIntersection()[y];
-         t1 = (bb_vmax[y] - ray.GetOrigin()[y]) * ray.GetInverseDirectionForAABoxFaceIntersection()[y];
+      /* Unbounded objects (planes) sit after the tree and are always tested. */
+         sorted[size - 1 - num_unbounded++] = object[i];
+      }
+   }
 
-         if (ray.GetInverseDirectionForAABoxFaceIntersection()[y] < 0.0f)
-         {
-            float tmp = t0;
-            t0 = t1;
-            t1 = tmp;
-         }
+   bvh.Build(bounds, num_bounded, order, scheduler, type);
 
-         tmin = t0 > tmin ? t0 : tmin;
-         tmax = t1 < tmax ? t1 : tmax;
+   for (size_t i = 0; i < num_bounded; ++i)
+   {
+      sorted[i] = bounded[order[i]];
+   }
 
-         if (tmin > tmax)
-         {
-            result = false;
-         }
-         else
-         {
-            t0 = (bb_vmin[z] - ray.GetOrigin()[z]) * ray.GetInverseDirectionForAABoxFaceIntersection()[z];
-            t1 = (bb_vmax[z] - ray.GetOrigin()[z]) * ray.GetInverseDirectionForAABoxFaceIntersection()[z];
+   delete [] object;
+   object = sorted;
 
-            if (ray.GetInverseDirectionForAABoxFaceIntersection()[z] < 0.0f)
-            {
-               float tmp = t0;
-               t0 = t1;
-               t1 = tmp;
-            }
+   uint32_t* index = order; /* Done with, and the same size. */
 
-            tmin = t0 > tmin ? t0 : tmin;
-            tmax = t1 < tmax ? t1 : tmax;
+   for (size_t i = 0; i < size; ++i)
+   {
+      kind[i] = object[i]->GetKind();
 
-            if (tmin > tmax)
-            {
-               result = false;
-            }
-         }
+      if (kind[i] == Kind::Other)
+      {
+         index[i] = (uint32_t) others.size();
+         others.push_back(object[i]);
       }
    }
 
-   return result;
+   Keep(object, size, kind.data(), Kind::Sphere, index, spheres);
+   Keep(object, size, kind.data(), Kind::MotionSphere, index, motion_spheres);
+   Keep(object, size, kind.data(), Kind::Cube, index, cubes);
+   Keep(object, size, kind.data(), Kind::Cone, index, cones);
+   Keep(object, size, kind.data(), Kind::XYRectangle, index, xy_rectangles);
+   Keep(object, size, kind.data(), Kind::XZRectangle, index, xz_rectangles);
+   Keep(object, size, kind.data(), Kind::YZRectangle, index, yz_rectangles);
+   Keep(object, size, kind.data(), Kind::Triangle, index, triangles);
+   Keep(object, size, kind.data(), Kind::Plane, index, planes);
+
+/* Each leaf then names its runs rather than its children. */
+   num_unbounded_runs = AddRuns(num_bounded, size, index);
+
+   auto remap = [this, index](uint32_t& offset, uint16_t& count)
+   {
+      uint32_t first = (uint32_t) runs.size();
+
+      count = (uint16_t) AddRuns(offset, offset + count, index);
+      offset = first;
+   };
+
+   bvh.RemapLeaves(remap);
+
+   delete [] order;
+   delete [] bounded;
+   delete [] bounds;
+
+   return;
+}
+
+/* Whether the interval a solid gave opens at the start of the ray, rather
+   than at a surface it enters by. */
+static bool StartsInside(const Hit& enter, float tmin)
+{
+   return enter.GetT() <= tmin;
 }
 
 CSGPair::CSGPair(Solid* sa, Solid* sb) : a(sa), b(sb), type(Type::Union)
@@ -805,92 +1816,105 @@ CSGPair::~CSGPair()
 
 bool CSGPair::Intersect(const Ray& ray, Hit& h, float tmin) const
 {
-   bool result = false;
+   Hit h1_min, h1_max, h2_min, h2_max;
+
+/* The surface the ray meets first, and whether it meets it from inside b,
+   which turns the normal round. An interval that opens at tmin is no
+   surface, so a ray starting inside a solid meets where it leaves first. */
+   const Hit* surface = NULL;
+   bool flip = false;
 
    if (type == Type::Difference)
    {
-      Hit h1_min, h1_max, h2_min, h2_max;
-
-      result = a->Intersect(ray, h1_min, h1_max, tmin);
-
-      if (result != false)
+      if (a->Intersect(ray, h1_min, h1_max, tmin) != false)
       {
-         bool h2 = b->Intersect(ray, h2_min, h2_max, tmin);
+         const bool inside = StartsInside(h1_min, tmin);
 
-         if (h2 != false)
+         if (b->Intersect(ray, h2_min, h2_max, tmin) == false)
+         {
+            surface = inside != false ? &h1_max : &h1_min;
+         }
+         else if (h1_min.GetT() < h2_min.GetT())
          {
-            if (h1_min.GetT() < h2_min.GetT())
+            if (inside == false)
             {
-               h.Set(h1_min.GetT(), h1_min.GetMaterial(), h1_min.GetNormal(), ray);
+               surface = &h1_min;
             }
-            else if (h2_max.GetT() < h1_max.GetT())
+            else if (h2_min.GetT() < h1_max.GetT())
             {
-               if (h2_max.GetT() > h1_min.GetT())
-               {
-                  h.Set(h2_max.GetT(), h2_max.GetMaterial(), h2_max.GetNormal().Negate(), ray);
-               }
-               else
-               {
-                  h.Set(h1_min.GetT(), h1_min.GetMaterial(), h1_min.GetNormal(), ray);
-               }
+               surface = &h2_min;
+               flip = true;
             }
             else
             {
-               result = false;
+               surface = &h1_max;
             }
          }
-         else
+         else if (h2_max.GetT() < h1_max.GetT())
          {
-            h.Set(h1_min.GetT(), h1_min.GetMaterial(), h1_min.GetNormal(), ray);
+            if (h2_max.GetT() > h1_min.GetT())
+            {
+               surface = &h2_max;
+               flip = true;
+            }
+            else
+            {
+               surface = &h1_min;
+            }
          }
       }
    }
    else if (type == Type::Intersection)
    {
-      Hit h1_min, h1_max, h2_min, h2_max;
-
-      result = a->Intersect(ray, h1_min, h1_max, tmin);
-
-      if (result != false)
+      if (a->Intersect(ray, h1_min, h1_max, tmin) != false && b->Intersect(ray, h2_min, h2_max, tmin) != false)
       {
-         bool h2 = b->Intersect(ray, h2_min, h2_max, tmin);
-
-         if (h2 != false)
+         if (StartsInside(h1_min, tmin) != false && StartsInside(h2_min, tmin) != false)
          {
-            if ((h2_min.GetT() < h1_min.GetT()) && (h2_max.GetT() > h1_min.GetT()))
-            {
-               h.Set(h1_min.GetT(), h1_min.GetMaterial(), h1_min.GetNormal(), ray);
-            }
-            else if ((h1_min.GetT() < h2_min.GetT()) && (h1_max.GetT() > h2_min.GetT()))
-            {
-               if (h2_max.GetT() < h.GetT())
-               {
-                  h.Set(h2_min.GetT(), h2_min.GetMaterial(), h2_min.GetNormal(), ray);
-               }
-            }
-            else
-            {
-               result = false;
-            }
+            surface = h1_max.GetT() < h2_max.GetT() ? &h1_max : &h2_max;
+         }
+         else if ((h2_min.GetT() < h1_min.GetT()) && (h2_max.GetT() > h1_min.GetT()))
+         {
+            surface = &h1_min;
+         }
+         else if ((h1_min.GetT() < h2_min.GetT()) && (h1_max.GetT() > h2_min.GetT()))
+         {
+            surface = &h2_min;
          }
       }
    }
    else if (type == Type::Union)
    {
-      Hit h1_max;
-      if (a->Intersect(ray, h, h1_max, tmin) != false)
+      if (a->Intersect(ray, h1_min, h1_max, tmin) != false)
       {
-         result = true;
+         surface = StartsInside(h1_min, tmin) != false ? &h1_max : &h1_min;
       }
 
-      Hit h2_max;
-      if (b->Intersect(ray, h, h2_max, tmin) != false)
+      if (b->Intersect(ray, h2_min, h2_max, tmin) != false)
       {
-         result = true;
+         const Hit* nearest = StartsInside(h2_min, tmin) != false ? &h2_max : &h2_min;
+
+         if (surface == NULL || nearest->GetT() < surface->GetT())
+         {
+            surface = nearest;
+         }
       }
    }
 
-   return result;
+   if (surface == NULL || surface->GetT() >= h.GetT())
+   {
+      return false;
+   }
+
+   vector3f normal = surface->GetNormal();
+
+   if (flip != false)
+   {
+      normal.Negate();
+   }
+
+   h.Set(surface->GetT(), surface->GetMaterial(), normal, ray, this);
+
+   return true;
 }
 
 bool CSGPair::ShadowIntersect(const Ray& ray, Hit& h, float tmin) const
@@ -898,7 +1922,89 @@ bool CSGPair::ShadowIntersect(const Ray& ray, Hit& h, float tmin) const
    return Intersect(ray, h, tmin);
 }
 
-Transform::Transform(const Matrix& m, Object* o) : matrix(m), object(o) { }
+bool CSGPair::GetBounds(AABox& box) const
+{
+   AABox box_a, box_b;
+
+   bool result = a->GetBounds(box_a) && b->GetBounds(box_b);
+
+   if (type == Type::Difference)
+   {
+      box = box_a; /* Carving b out never grows a. */
+   }
+   else if (type == Type::Intersection)
+   {
+      for (size_t i = 0; i < 3; ++i)
+      {
+         box.vmin[i] = box_a.vmin[i] > box_b.vmin[i] ? box_a.vmin[i] : box_b.vmin[i];
+         box.vmax[i] = box_a.vmax[i] < box_b.vmax[i] ? box_a.vmax[i] : box_b.vmax[i];
+      }
+   }
+   else
+   {
+      box = box_a;
+      box.Expand(box_b);
+   }
+
+   return result;
+}
+
+bool CSGPair::SelfTest()
+{
+   struct Case
+   {
+      const char* szName;
+      Type type;
+      Solid* a, * b;
+      point3f origin;
+      vector3f direction;
+      float t;
+      vector3f normal;
+   };
+
+/* The rays that start inside must come out by the face they leave through,
+   never at their own start. */
+   Case cases[] =
+   {
+      {"union, inside a", Type::Union, new Cube(point3f(0.0f, 0.0f, 0.0f), 1.0f, NULL), new Cube(point3f(3.0f, 0.0f, 0.0f), 1.0f, NULL), point3f(0.0f, 0.0f, 0.0f), vector3f(1.0f, 0.0f, 0.0f), 0.5f, vector3f(1.0f, 0.0f, 0.0f)},
+      {"union, inside b", Type::Union, new Cube(point3f(0.0f, 0.0f, 0.0f), 1.0f, NULL), new Cube(point3f(3.0f, 0.0f, 0.0f), 1.0f, NULL), point3f(3.0f, 0.2f, 0.0f), vector3f(0.0f, -1.0f, 0.0f), 0.7f, vector3f(0.0f, -1.0f, 0.0f)},
+      {"union, outside", Type::Union, new Cube(point3f(0.0f, 0.0f, 0.0f), 1.0f, NULL), new Cube(point3f(3.0f, 0.0f, 0.0f), 1.0f, NULL), point3f(-2.0f, 0.0f, 0.0f), vector3f(1.0f, 0.0f, 0.0f), 1.5f, vector3f(-1.0f, 0.0f, 0.0f)},
+      {"difference, inside a", Type::Difference, new Cube(point3f(0.0f, 0.0f, 0.0f), 1.0f, NULL), new Sphere(point3f(0.3f, 0.0f, 0.0f), 0.1f, NULL), point3f(0.0f, 0.0f, 0.0f), vector3f(1.0f, 0.0f, 0.0f), 0.2f, vector3f(1.0f, 0.0f, 0.0f)},
+      {"difference, inside b", Type::Difference, new Cube(point3f(0.0f, 0.0f, 0.0f), 1.0f, NULL), new Sphere(point3f(0.3f, 0.0f, 0.0f), 0.1f, NULL), point3f(0.3f, 0.0f, 0.0f), vector3f(-1.0f, 0.0f, 0.0f), 0.1f, vector3f(1.0f, 0.0f, 0.0f)},
+      {"intersection, inside", Type::Intersection, new Cube(point3f(0.0f, 0.0f, 0.0f), 1.0f, NULL), new Cube(point3f(0.4f, 0.0f, 0.0f), 1.0f, NULL), point3f(0.2f, 0.0f, 0.0f), vector3f(-1.0f, 0.0f, 0.0f), 0.3f, vector3f(-1.0f, 0.0f, 0.0f)}
+   };
+
+   bool passed = true;
+
+   for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i)
+   {
+      const Case& c = cases[i];
+
+      CSGPair pair(c.a, c.b);
+      pair.SetType(c.type);
+
+      Ray ray(c.origin, c.direction, 0.0f);
+      Hit h;
+
+      if (pair.Intersect(ray, h, 1e-4f) == false || fabs(h.GetT() - c.t) > 1e-5f || (h.GetNormal() - c.normal).LengthSq() > 1e-10f)
+      {
+         printf("%-8s FAILED %s\n", "csg", c.szName);
+
+         passed = false;
+      }
+   }
+
+   if (passed != false)
+   {
+      printf("%-8s passed\n", "csg");
+   }
+
+   return passed;
+}
+
+Transform::Transform(const Matrix& m, Object* o) : matrix(m), inverse(m.Inverse()), object(o) { }
+
+Transform::Transform(const Matrix3x4& m, const Matrix3x4& inverse_m, Object* o) : matrix(m), inverse(inverse_m), object(o) { }
 
 bool Transform::Intersect(const Ray& ray, Hit& h, float tmin) const
 {
@@ -906,30 +2012,109 @@ bool Transform::Intersect(const Ray& ray, Hit& h, float tmin) const
    vector3f direction = ray.GetDirection();
 
 /* Remember, points and directions transform differently! */
-   matrix.Inverse().Transform(origin);
-   matrix.Inverse().TransformDirection(direction);
+   inverse.Transform(origin);
+   inverse.TransformDirection(direction);
 
    const float scale = direction.Length();
 
-   const Ray new_ray(origin, direction.Normalize());
+   const Ray new_ray(origin, direction.Normalize(), ray.GetTime());
 
-   h.Set(h.GetT() * scale, h.GetMaterial(), h.GetNormal(), new_ray);
+   h.SetT(h.GetT() * scale);
 
    const bool intersect = object->Intersect(new_ray, h, tmin);
 
+/* The surface of a closer hit is only known on the ray in the object's
+   space, so it is evaluated here and its normal carried out. */
    if (intersect != false)
    {
+      if (h.IsEvaluated() == false)
+      {
+         h.GetObject()->Evaluate(new_ray, h);
+      }
+
       vector3f normal = h.GetNormal();
-      
-      matrix.Inverse().Transpose().TransformDirection(normal);
-      h.Set(h.GetT() / scale, h.GetMaterial(), normal, ray);
+
+      inverse.TransformNormal(normal);
+      h.SetSurface(h.GetMaterial(), normal.Normalize());
    }
-   else
+
+   h.SetT(h.GetT() / scale);
+
+   return intersect;
+}
+
+uint32_t Transform::IntersectPacket(const RayPacket& packet, Hit hits[PACKET_SIZE], uint32_t active, float tmin) const
+{
+   if (CountRays(active) < BVH_PACKET_MIN_RAYS)
    {
-      h.Set(h.GetT() / scale, h.GetMaterial(), h.GetNormal(), ray);
+      return Object::IntersectPacket(packet, hits, active, tmin);
    }
 
-   return intersect;
+/* The rays are carried into the object's space across the lanes, each in
+   the same steps as Intersect and the Ray constructor take. */
+   const vec3x8 o = packet.GetOrigin();
+   const vec3x8 d = packet.GetDirection();
+
+   const float8 m[3][4] = {{float8(inverse.data[0][0]), float8(inverse.data[0][1]), float8(inverse.data[0][2]), float8(inverse.data[0][3])},
+                           {float8(inverse.data[1][0]), float8(inverse.data[1][1]), float8(inverse.data[1][2]), float8(inverse.data[1][3])},
+                           {float8(inverse.data[2][0]), float8(inverse.data[2][1]), float8(inverse.data[2][2]), float8(inverse.data[2][3])}};
+
+   vec3x8 origin, direction, inverse_direction;
+
+   for (size_t i = 0; i < 3; ++i)
+   {
+      origin[i]    = m[i][0] * o[x] + m[i][1] * o[y] + m[i][2] * o[z] + m[i][3];
+      direction[i] = m[i][0] * d[x] + m[i][1] * d[y] + m[i][2] * d[z];
+   }
+
+   float scale[PACKET_SIZE];
+
+   direction.Length().Store(scale);
+   direction.Normalize().Normalize();
+
+   for (size_t i = 0; i < 3; ++i)
+   {
+      inverse_direction[i] = float8(1.0f) / direction[i];
+   }
+
+   Ray local[PACKET_SIZE];
+
+   for (size_t k = 0; k < PACKET_SIZE; ++k)
+   {
+      if ((active >> k) & 1)
+      {
+         local[k] = Ray(origin.Get(k), direction.Get(k), inverse_direction.Get(k), packet.rays[k].GetTime());
+
+         hits[k].SetT(hits[k].GetT() * scale[k]);
+      }
+   }
+
+   const uint32_t result = object->IntersectPacket(RayPacket(local, active, origin, direction, inverse_direction), hits, active, tmin);
+
+   for (size_t k = 0; k < PACKET_SIZE; ++k)
+   {
+      if ((result >> k) & 1)
+      {
+         Hit& h = hits[k];
+
+         if (h.IsEvaluated() == false)
+         {
+            h.GetObject()->Evaluate(local[k], h);
+         }
+
+         vector3f normal = h.GetNormal();
+
+         inverse.TransformNormal(normal);
+         h.SetSurface(h.GetMaterial(), normal.Normalize());
+      }
+
+      if ((active >> k) & 1)
+      {
+         hits[k].SetT(hits[k].GetT() / scale[k]);
+      }
+   }
+
+   return result;
 }
 
 bool Transform::Intersect(const Ray& ray, Hit& h1, Hit&, float tmin) const
@@ -941,3 +2126,28 @@ bool Transform::ShadowIntersect(const Ray& ray, Hit& h, float tmin) const
 {
    return Intersect(ray, h, tmin);
 }
+
+bool Transform::GetBounds(AABox& box) const
+{
+   AABox local;
+
+   if (object->GetBounds(local) == false)
+   {
+      return false;
+   }
+
+/* Bound the eight transformed corners of the local box. */
+   box = AABox();
+
+   for (size_t i = 0; i < 8; ++i)
+   {
+      point3f corner((i & 1) ? local.vmax[x] : local.vmin[x],
+                     (i & 2) ? local.vmax[y] : local.vmin[y],
+                     (i & 4) ? local.vmax[z] : local.vmin[z]);
+
+      matrix.Transform(corner);
+      box.Expand(corner);
+   }
+
+   return true;
+}
@@ -4,7 +4,11 @@
 #define OBJECT_H
 
 #include <float.h>
+
+#include <vector>
+
 #include "math.h"
+#include "bvh.h"
 
 class Ray;
 class Hit;
@@ -13,11 +17,45 @@ class Material;
 class Object
 {
 public:
+/* The primitives a group keeps by value, in an array of their own type.
+   Everything else, such as pairs, transforms and meshes, is Other. A class
+   derived from one of these must give its own kind, or Other. */
+   enum class Kind : uint8_t { Other, Sphere, MotionSphere, Cube, Cone, XYRectangle, XZRectangle, YZRectangle, Triangle, Plane };
+
    Object() : material(NULL) {    }
 
    virtual bool Intersect(const Ray& ray, Hit& h, float tmin) const = 0;
    virtual bool ShadowIntersect(const Ray& ray, Hit& h, float tmin) const = 0;
 
+/* Intersect for each ray of the packet set in active, hits[k] being the hit
+   of ray k; returns the mask of the rays that found a closer hit. Objects
+   with no test of their own take the rays one at a time. */
+   virtual uint32_t IntersectPacket(const RayPacket& packet, Hit hits[PACKET_SIZE], uint32_t active, float tmin) const;
+
+/* Returns false for objects without finite extent, such as planes. */
+   virtual bool GetBounds(AABox& box) const = 0;
+
+   virtual Kind GetKind() const {   return Kind::Other;   }
+
+/* Emitters that can be sampled directly. SampleDirection picks a direction
+   from origin towards a point on the surface and returns the distance to
+   that point and the pdf of the direction in solid angle. */
+   virtual bool IsSampleable() const {   return false;   }
+   virtual bool SampleDirection(const point3f&, const point2f&, vector3f&, float&, float&) const {   return false;   }
+
+/* The pdf SampleDirection would give a direction, zero if it misses the surface. */
+   virtual float GetPdfValue(const point3f&, const vector3f&) const {   return 0.0f;   }
+
+/* Works out the material and normal of a hit the object recorded, on the ray
+   it was found with. Objects that only ever Set their hits have nothing to do. */
+   virtual void Evaluate(const Ray&, Hit&) const {   }
+
+/* A copy of the object carried into world space by m, or NULL where that
+   cannot be done exactly and a Transform has to stay. */
+   virtual Object* Bake(const Matrix3x4&) const {   return NULL;   }
+
+   Material* GetMaterial() const {   return material;   }
+
    virtual ~Object() { }
 
 protected:
@@ -26,6 +64,11 @@ protected:
 private:
 };
 
+/* A closed object that CSGPair can combine. The two-hit Intersect gives the
+   interval the ray spends inside: h1 where it enters, h2 where it leaves.
+   For a ray that starts inside, h1 is at tmin, is no surface and has no
+   normal. */
+
 class Solid : public Object
 {
 public:
@@ -38,8 +81,16 @@ public:
    Sphere(const point3f& p, float r, Material* m);
 
    virtual bool Intersect(const Ray& ray, Hit& h, float tmin) const;
+   virtual uint32_t IntersectPacket(const RayPacket& packet, Hit hits[PACKET_SIZE], uint32_t active, float tmin) const;
    virtual bool Intersect(const Ray& ray, Hit& h1, Hit& h2, float tmin) const;
    virtual bool ShadowIntersect(const Ray& ray, Hit& h, float tmin) const;
+   virtual bool GetBounds(AABox& box) const;
+   virtual Kind GetKind() const {   return Kind::Sphere;   }
+   virtual bool IsSampleable() const {   return true;   }
+   virtual bool SampleDirection(const point3f& origin, const point2f& u, vector3f& direction, float& distance, float& pdf) const;
+   virtual float GetPdfValue(const point3f& origin, const vector3f& direction) const;
+   virtual void Evaluate(const Ray& ray, Hit& h) const;
+   virtual Object* Bake(const Matrix3x4& m) const;
 
 protected:
    point3f point;
@@ -54,6 +105,12 @@ public:
    MotionSphere(const point3f& p, float r, const vector3f& v, Material* m);
 
    virtual bool Intersect(const Ray& ray, Hit& h, float tmin) const;
+   virtual uint32_t IntersectPacket(const RayPacket& packet, Hit hits[PACKET_SIZE], uint32_t active, float tmin) const;
+   virtual bool GetBounds(AABox& box) const;
+   virtual Kind GetKind() const {   return Kind::MotionSphere;   }
+   virtual bool IsSampleable() const {   return false;   } /* The centre moves over the shutter. */
+   virtual void Evaluate(const Ray& ray, Hit& h) const;
+   virtual Object* Bake(const Matrix3x4& m) const;
 
 protected:
 private:
@@ -66,7 +123,11 @@ public:
    Plane(const vector3f& n, float offset, Material* m);
 
    virtual bool Intersect(const Ray& ray, Hit& h, float tmin) const;
+   virtual uint32_t IntersectPacket(const RayPacket& packet, Hit hits[PACKET_SIZE], uint32_t active, float tmin) const;
    virtual bool ShadowIntersect(const Ray& ray, Hit& h, float tmin) const;
+   virtual bool GetBounds(AABox& box) const;
+   virtual Kind GetKind() const {   return Kind::Plane;   }
+   virtual void Evaluate(const Ray& ray, Hit& h) const;
 
 protected:
 private:
@@ -80,7 +141,12 @@ public:
    Triangle(const point3f& a, const point3f& b, const point3f& c, Material* m);
 
    virtual bool Intersect(const Ray& ray, Hit& h, float tmin) const;
+   virtual uint32_t IntersectPacket(const RayPacket& packet, Hit hits[PACKET_SIZE], uint32_t active, float tmin) const;
    virtual bool ShadowIntersect(const Ray& ray, Hit& h, float tmin) const;
+   virtual bool GetBounds(AABox& box) const;
+   virtual Kind GetKind() const {   return Kind::Triangle;   }
+   virtual void Evaluate(const Ray& ray, Hit& h) const;
+   virtual Object* Bake(const Matrix3x4& m) const;
 
 protected:
 private:
@@ -95,6 +161,9 @@ public:
 
    virtual bool Intersect(const Ray& ray, Hit& h, float tmin) const;
    virtual bool ShadowIntersect(const Ray& ray, Hit& h, float tmin) const;
+   virtual bool GetBounds(AABox& box) const;
+   virtual Kind GetKind() const {   return Kind::Cone;   }
+   virtual void Evaluate(const Ray& ray, Hit& h) const;
 
 protected:
 private:
@@ -109,7 +178,14 @@ public:
    XYRectangle(const point2f low, const point2f up, const float _k, const float n, Material* m);
 
    virtual bool Intersect(const Ray& ray, Hit& h, float tmin) const;
+   virtual uint32_t IntersectPacket(const RayPacket& packet, Hit hits[PACKET_SIZE], uint32_t active, float tmin) const;
    virtual bool ShadowIntersect(const Ray& ray, Hit& h, float tmin) const;
+   virtual bool GetBounds(AABox& box) const;
+   virtual Kind GetKind() const {   return Kind::XYRectangle;   }
+   virtual void Evaluate(const Ray& ray, Hit& h) const;
+   virtual bool IsSampleable() const {   return true;   }
+   virtual bool SampleDirection(const point3f& origin, const point2f& u, vector3f& direction, float& distance, float& pdf) const;
+   virtual float GetPdfValue(const point3f& origin, const vector3f& direction) const;
 
 protected:
 private:
@@ -124,7 +200,14 @@ public:
    XZRectangle(const point2f low, const point2f up, const float _k, const float n, Material* m);
 
    virtual bool Intersect(const Ray& ray, Hit& h, float tmin) const;
+   virtual uint32_t IntersectPacket(const RayPacket& packet, Hit hits[PACKET_SIZE], uint32_t active, float tmin) const;
    virtual bool ShadowIntersect(const Ray& ray, Hit& h, float tmin) const;
+   virtual bool GetBounds(AABox& box) const;
+   virtual Kind GetKind() const {   return Kind::XZRectangle;   }
+   virtual void Evaluate(const Ray& ray, Hit& h) const;
+   virtual bool IsSampleable() const {   return true;   }
+   virtual bool SampleDirection(const point3f& origin, const point2f& u, vector3f& direction, float& distance, float& pdf) const;
+   virtual float GetPdfValue(const point3f& origin, const vector3f& direction) const;
 
 protected:
 private:
@@ -139,7 +222,14 @@ public:
    YZRectangle(const point2f low, const point2f up, const float _k, const float n, Material* m);
 
    virtual bool Intersect(const Ray& ray, Hit& h, float tmin) const;
+   virtual uint32_t IntersectPacket(const RayPacket& packet, Hit hits[PACKET_SIZE], uint32_t active, float tmin) const;
    virtual bool ShadowIntersect(const Ray& ray, Hit& h, float tmin) const;
+   virtual bool GetBounds(AABox& box) const;
+   virtual Kind GetKind() const {   return Kind::YZRectangle;   }
+   virtual void Evaluate(const Ray& ray, Hit& h) const;
+   virtual bool IsSampleable() const {   return true;   }
+   virtual bool SampleDirection(const point3f& origin, const point2f& u, vector3f& direction, float& distance, float& pdf) const;
+   virtual float GetPdfValue(const point3f& origin, const vector3f& direction) const;
 
 protected:
 private:
@@ -155,14 +245,23 @@ public:
    Cube(const point3f& p, const point3f& z, Material* m);
 
    virtual bool Intersect(const Ray& ray, Hit& h, float tmin) const;
+   virtual uint32_t IntersectPacket(const RayPacket& packet, Hit hits[PACKET_SIZE], uint32_t active, float tmin) const;
    virtual bool Intersect(const Ray& ray, Hit& h1, Hit& h2, float tmin) const;
    virtual bool ShadowIntersect(const Ray& ray, Hit& h, float tmin) const;
+   virtual bool GetBounds(AABox& box) const;
+   virtual Kind GetKind() const {   return Kind::Cube;   }
+   virtual void Evaluate(const Ray& ray, Hit& h) const;
+   virtual Object* Bake(const Matrix3x4& m) const;
 
 protected:
 private:
    point3f max, min;
 };
 
+/* Build moves the primitives of the kinds in Object::Kind into arrays of
+   their own, in hierarchy order, so the children a leaf tests lie side by
+   side in memory rather than wherever each was allocated. */
+
 class Group : public Object
 {
 public:
@@ -170,21 +269,63 @@ public:
    ~Group();
 
    virtual bool Intersect(const Ray& ray, Hit& h, float tmin) const;
+   virtual uint32_t IntersectPacket(const RayPacket& packet, Hit hits[PACKET_SIZE], uint32_t active, float tmin) const;
    virtual bool ShadowIntersect(const Ray& ray, Hit& h, float tmin) const;
+   virtual bool GetBounds(AABox& box) const;
 
    void SetAt(size_t i, Object* obj);
-   size_t GetSize() {   return size;   }
+   Object* GetAt(size_t i) const {   return object[i];   }
+   size_t GetSize() const {   return size;   }
 
-   void SetBB(const point3f& vmin, const point3f& vmax);
+/* Builds the hierarchy over the bounded children; call once every child is
+   set, and before the group is intersected. The children of the kept kinds
+   are replaced by their copies in the arrays, which GetAt then returns. */
+   void Build(Scheduler* scheduler = NULL, BVH::Type type = BVH::Type::SAH);
 
 protected:
 private:
-   bool PossibleHit(const Ray& ray, float tmin) const;
+   Group(const Group&);
+   Group& operator = (const Group&);
 
-   size_t size;
-   Object** object;
+/* Children of one kind that are tested together, first being the place of
+   the first of them in the array of that kind. */
+   struct Run
+   {
+      uint32_t first;
+      uint32_t count;
+      Kind kind;
+   };
+
+/* Appends the runs of the children from begin to end, returning how many. */
+   uint32_t AddRuns(size_t begin, size_t end, const uint32_t* index);
 
-   point3f bb_vmin, bb_vmax;
+   bool IntersectRuns(uint32_t first, uint32_t count, const Ray& ray, Hit& h, float tmin, bool any) const;
+   uint32_t IntersectRunsPacket(uint32_t first, uint32_t count, const RayPacket& packet, Hit hits[PACKET_SIZE], uint32_t active, float tmin) const;
+
+   size_t size;
+   Object** object; /* Bounded children in hierarchy order, then the unbounded ones. */
+
+/* Which children the arrays hold; the Other ones the group owns itself. */
+   std::vector<Kind> kind;
+
+/* The leaves of the tree name runs here in place of children. The runs of
+   the unbounded children come first. */
+   std::vector<Run> runs;
+   uint32_t num_unbounded_runs;
+
+   std::vector<Object*> others;
+   std::vector<Sphere> spheres;
+   std::vector<MotionSphere> motion_spheres;
+   std::vector<Cube> cubes;
+   std::vector<Cone> cones;
+   std::vector<XYRectangle> xy_rectangles;
+   std::vector<XZRectangle> xz_rectangles;
+   std::vector<YZRectangle> yz_rectangles;
+   std::vector<Triangle> triangles;
+   std::vector<Plane> planes;
+
+   size_t num_bounded;
+   BVH bvh;
 };
 
 class CSGPair : public Object
@@ -197,9 +338,14 @@ public:
 
    virtual bool Intersect(const Ray& ray, Hit& h, float tmin) const;
    virtual bool ShadowIntersect(const Ray& ray, Hit& h, float tmin) const;
+   virtual bool GetBounds(AABox& box) const;
 
    void SetType(Type t) { type = t;   return; };
 
+/* Fires rays with known answers at a few pairs, starting inside and out,
+   and prints what it finds; true when every one matches. */
+   static bool SelfTest();
+
 protected:
 private:
    Type type;
@@ -207,18 +353,29 @@ private:
    Solid* a, *b;
 };
 
+/* An instance: places an object by a matrix without copying it. Many
+   transforms may share one object, which belongs to the scene. */
+
 class Transform : public Object
 {
 public:
    Transform(const Matrix& m, Object* o);
+   Transform(const Matrix3x4& m, const Matrix3x4& inverse_m, Object* o);
 
    virtual bool Intersect(const Ray& ray, Hit& h, float tmin) const;
+   virtual uint32_t IntersectPacket(const RayPacket& packet, Hit hits[PACKET_SIZE], uint32_t active, float tmin) const;
    virtual bool Intersect(const Ray& ray, Hit& h1, Hit& h2, float tmin) const;
    virtual bool ShadowIntersect(const Ray& ray, Hit& h, float tmin) const;
+   virtual bool GetBounds(AABox& box) const;
+
+   const Matrix3x4& GetMatrix()  const {   return matrix;    }
+   const Matrix3x4& GetInverse() const {   return inverse;   }
+   Object* GetObject()           const {   return object;    }
 
 protected:
 private:
-   Matrix matrix;
+   Matrix3x4 matrix;
+   Matrix3x4 inverse; /* Worked out once here rather than for every ray. */
    Object* object;
 };
 
@@ -0,0 +1,87 @@
+/* File: packet.h; Mode: C++; Tab-width: 3; Author: Simon Flannery;           */
+
+#ifndef PACKET_H
+#define PACKET_H
+
+#include <stdint.h>
+
+#include "math.h"
+#include "ray.h"
+#include "kernels.h"
+
+#define PACKET_SIZE KERNEL_LANES
+
+/* Up to PACKET_SIZE rays traced together, such as the camera rays of
+   neighbouring pixels, which mostly reach the same nodes and objects. Next
+   to the rays themselves it keeps their origins and directions across the
+   lanes, a lane a ray, for the kernels and the primitives' packet tests.
+   Spare lanes repeat the first ray and are left out of active. */
+
+struct RayPacket
+{
+   RayPacket(const Ray* r, size_t count) : rays(r)
+   {
+      for (size_t k = 0; k < PACKET_SIZE; ++k)
+      {
+         const Ray& ray = rays[k < count ? k : 0];
+
+         for (size_t i = 0; i < 3; ++i)
+         {
+            origin[i][k] = ray.GetOrigin()[i];
+            direction[i][k] = ray.GetDirection()[i];
+            inverse_direction[i][k] = ray.GetInverseDirectionForAABoxFaceIntersection()[i];
+         }
+      }
+
+      active = count < PACKET_SIZE ? (1u << count) - 1 : (1u << PACKET_SIZE) - 1;
+   }
+
+/* For rays already laid out across the lanes, such as ones carried into
+   another space together. */
+   RayPacket(const Ray* r, uint32_t a, const vec3x8& o, const vec3x8& d, const vec3x8& inverse_d) : rays(r), active(a)
+   {
+      for (size_t i = 0; i < 3; ++i)
+      {
+         o[i].Store(origin[i]);
+         d[i].Store(direction[i]);
+         inverse_d[i].Store(inverse_direction[i]);
+      }
+   }
+
+   vec3x8 GetOrigin() const
+   {
+      return vec3x8(float8::Load(origin[x]), float8::Load(origin[y]), float8::Load(origin[z]));
+   }
+
+   vec3x8 GetDirection() const
+   {
+      return vec3x8(float8::Load(direction[x]), float8::Load(direction[y]), float8::Load(direction[z]));
+   }
+
+   vec3x8 GetInverseDirection() const
+   {
+      return vec3x8(float8::Load(inverse_direction[x]), float8::Load(inverse_direction[y]), float8::Load(inverse_direction[z]));
+   }
+
+   const Ray* rays;
+   uint32_t active;
+
+   float origin[3][PACKET_SIZE];
+   float direction[3][PACKET_SIZE];
+   float inverse_direction[3][PACKET_SIZE];
+};
+
+/* The number of rays set in a mask of them. */
+inline size_t CountRays(uint32_t mask)
+{
+   size_t count = 0;
+
+   for (; mask != 0; mask = mask & (mask - 1))
+   {
+      ++count;
+   }
+
+   return count;
+}
+
+#endif
@@ -6,52 +6,162 @@
 #include "material.h"
 #include "pdf.h"
 
-color3f PathTracer::TracePath(const Ray& ray, size_t bounce) const
+color3f PathTracer::TracePath(const Ray& camera_ray, Sampler& sampler) const
 {
-   color3f color;
+   Hit hit;
+   bool found = scene->GetGroup()->Intersect(camera_ray, hit, epsilon);
 
-   if (bounce > max_bounces)
-   {
-      return color;
-   }
+   return TracePath(camera_ray, hit, found, sampler);
+}
 
-   Hit hit;
-   if (scene->GetGroup()->Intersect(ray, hit, epsilon) != false)
+color3f PathTracer::TracePath(const Ray& camera_ray, const Hit& first, bool found, Sampler& sampler) const
+{
+   color3f color, throughput(1.0f, 1.0f, 1.0f);
+
+   Ray ray = camera_ray;
+
+/* The density with which the last bounce chose the ray's direction; a listed
+   light it hits is weighed against sampling that light directly. Zero, for
+   camera rays and perfect mirrors, counts the emission in full. */
+   float pdf = 0.0f;
+
+   for (size_t bounce = 0; bounce <= max_bounces; ++bounce)
    {
+      Hit hit = first;
+
+      if (bounce > 0)
+      {
+         hit = Hit();
+         found = scene->GetGroup()->Intersect(ray, hit, epsilon);
+      }
+
+      if (found == false)
+      {
+         color = color + throughput * scene->GetBackground();
+
+         break;
+      }
+
+      hit.Evaluate(ray);
+
       Material* material = hit.GetMaterial();
 
       color3f light = material->Emitted(hit.GetIntersectionPoint());
 
+      if (pdf > 0.0f && scene->IsLight(hit.GetObject()) != false)
+      {
+         MixturePdf lights(scene->GetLights(), scene->GetNumLights(), ray.GetOrigin());
+
+         light = light * PowerHeuristic(pdf, lights.GetValue(ray.GetDirection()));
+      }
+
+      color = color + throughput * light;
+
       vector3f scattered;
-      if (material->Scatter(ray, hit, scattered) != false)
+      if (material->Scatter(ray, hit, scattered, sampler) == false)
       {
-         if (material->IsSpecular(hit.GetIntersectionPoint()) != false)
-         {
-            Ray specular_ray = Ray(hit.GetIntersectionPoint(), scattered);
+         break;
+      }
 
-            color = material->GetColor(hit.GetIntersectionPoint()) * TracePath(specular_ray, bounce + 1);
+      throughput = throughput * material->GetColor(hit.GetIntersectionPoint());
+
+      if (material->IsSpecular(hit.GetIntersectionPoint()) != false)
+      {
+      /* A blurred mirror has a pdf and takes a light sample; a perfect one does not. */
+         pdf = material->ScatterPdf(ray, hit, scattered);
+
+         if (pdf > 0.0f)
+         {
+            color = color + throughput * SampleLights(ray, hit, sampler);
          }
-         else
+
+         ray = Ray(hit.GetIntersectionPoint(), scattered, ray.GetTime());
+      }
+      else
+      {
+      /* Reflect on the side the ray arrived from. */
+         vector3f normal = hit.GetNormal();
+
+         if (vector3f::Dot(normal, ray.GetDirection()) > 0.0f)
          {
-            CosinePdf pdf(hit.GetNormal());
-            Ray scatter_ray = Ray(hit.GetIntersectionPoint(), pdf.Generate());
+            normal.Negate();
+         }
 
-         // float v = pdf.GetValue(scatter_ray.GetDirection());
+         color = color + throughput * SampleLights(ray, hit, sampler);
 
-         // color = light + material->GetColor(hit.GetIntersectionPoint()) * material->ScatterPdf(hit, scatter_ray.GetDirection()) * TracePath(scatter_ray, bounce + 1) / v;
+         CosinePdf cosine(normal);
+         ray = Ray(hit.GetIntersectionPoint(), cosine.Generate(sampler), ray.GetTime());
 
-            color = light + material->GetColor(hit.GetIntersectionPoint()) * TracePath(scatter_ray, bounce + 1);
-         }
+         pdf = cosine.GetValue(ray.GetDirection());
       }
-      else
+
+      if (bounce + 1 >= rr_depth)
       {
-         color = light;
+         float survive = (float) fmax(throughput[r], fmax(throughput[g], throughput[b]));
+
+         if (survive < 1.0f)
+         {
+            if (sampler.Get1D() >= survive)
+            {
+               break;
+            }
+
+            throughput = throughput / survive;
+         }
       }
    }
-   else
+
+   return color;
+}
+
+color3f PathTracer::SampleLights(const Ray& ray, const Hit& hit, Sampler& sampler) const
+{
+/* One direction from the mixture of every light, weighed against the
+   material's own pdf. Both the diffuse and the glossy lobe have the BRDF
+   times the cosine equal to albedo * pdf; the caller applies the albedo. */
+   color3f direct;
+
+   if (scene->GetNumLights() == 0)
    {
-      color = scene->GetBackground();
+      return direct;
    }
 
-   return color;
+   const point3f point = hit.GetIntersectionPoint();
+
+   MixturePdf lights(scene->GetLights(), scene->GetNumLights(), point);
+
+   vector3f direction = lights.Generate(sampler);
+
+   float scatter_pdf = hit.GetMaterial()->ScatterPdf(ray, hit, direction);
+
+   if (scatter_pdf <= 0.0f)
+   {
+      return direct;
+   }
+
+   float light_pdf = lights.GetValue(direction);
+
+   if (light_pdf <= 0.0f)
+   {
+      return direct;
+   }
+
+   Ray light_ray(point, direction, ray.GetTime());
+   Hit shadow;
+
+   if (scene->GetGroup()->Intersect(light_ray, shadow, epsilon) != false && scene->IsLight(shadow.GetObject()) != false)
+   {
+      shadow.Evaluate(light_ray);
+
+      color3f emitted = shadow.GetMaterial()->Emitted(shadow.GetIntersectionPoint());
+
+      direct = emitted * (scatter_pdf / light_pdf * PowerHeuristic(light_pdf, scatter_pdf));
+   }
+
+   return direct;
+}
+
+uint32_t PathTracer::IntersectPacket(const RayPacket& packet, Hit hits[PACKET_SIZE]) const
+{
+   return scene->GetGroup()->IntersectPacket(packet, hits, packet.active, epsilon);
 }
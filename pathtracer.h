@@ -6,21 +6,41 @@
 #include "math.h"
 #include "hit.h"
 #include "ray.h"
+#include "sampler.h"
+#include "packet.h"
 
 #define EPSILON  1e-4f
+#define RR_DEPTH 3 /* Bounces before Russian roulette may end a path. */
 
 class Scene;
 
 class PathTracer
 {
 public:
-   PathTracer(Scene* s, size_t max_bounces) : scene(s), max_bounces(max_bounces), epsilon(EPSILON) {   }
+   PathTracer(Scene* s, size_t max_bounces, size_t rr_depth = RR_DEPTH) : scene(s), max_bounces(max_bounces), rr_depth(rr_depth), epsilon(EPSILON) {   }
 
-   color3f TracePath(const Ray& ray, size_t bounce) const;
+/* Follows one path from the camera. From rr_depth bounces on, a path survives
+   each bounce with a probability set by its throughput and is reweighted to
+   stay unbiased; max_bounces remains a hard limit. */
+   color3f TracePath(const Ray& ray, Sampler& sampler) const;
+
+/* The same for a camera ray intersected already, such as in a packet; found
+   says whether hit holds what it reached. */
+   color3f TracePath(const Ray& ray, const Hit& first, bool found, Sampler& sampler) const;
+
+/* Intersects the camera rays of a packet together, filling in their first
+   hits; returns the mask of the rays that hit something. */
+   uint32_t IntersectPacket(const RayPacket& packet, Hit hits[PACKET_SIZE]) const;
+
+   size_t GetMaxBounces() const {   return max_bounces;   }
+   size_t GetRRDepth()    const {   return rr_depth;      }
 
 private:
+   color3f SampleLights(const Ray& ray, const Hit& hit, Sampler& sampler) const;
+
    Scene* scene;
    size_t max_bounces;
+   size_t rr_depth;
    float epsilon;
 };
 
@@ -4,18 +4,20 @@
 #define PDF_H
 
 #include "math.h"
+#include "sampler.h"
+#include "object.h"
 
 class Pdf
 {
 public:
    virtual float GetValue(const vector3f& direction) const = 0;
-   virtual vector3f Generate() const = 0;
+   virtual vector3f Generate(Sampler& sampler) const = 0;
 
 protected:
-   static vector3f RandomCosineDirection() 
+   static vector3f RandomCosineDirection(const point2f& u)
    {
-      float r1 = random_float();
-      float r2 = random_float();
+      float r1 = u[x];
+      float r2 = u[y];
 
       float _z = (float) sqrt(1.0f - r2);
 
@@ -48,9 +50,9 @@ public:
       return (float) fmax(FLT_EPSILON, cosine / PI);
    }
 
-   virtual vector3f Generate() const
+   virtual vector3f Generate(Sampler& sampler) const
    {
-      vector3f d = RandomCosineDirection();
+      vector3f d = RandomCosineDirection(sampler.Get2D());
 
       return d[x] * u + d[y] * v + d[z] * w;
    }
@@ -59,4 +61,106 @@ public:
    vector3f u, v, w;
 };
 
+/* A Phong lobe, cos^exponent about the mirror direction; used by blurred mirrors. */
+
+class GlossyPdf : public Pdf
+{
+public:
+   GlossyPdf(const vector3f& reflected, float e) : exponent(e)
+   {
+      w = reflected;
+      w.Normalize();
+
+      vector3f a = (fabs(w[x]) > 0.9f) ? vector3f(0.0f, 1.0f, 0.0f) : vector3f(1.0f, 0.0f, 0.0f);
+
+      v = vector3f::Cross(w, a).Normalize();
+      u = vector3f::Cross(w, v).Normalize();
+   }
+
+   virtual float GetValue(const vector3f& direction) const
+   {
+      float cosine = vector3f::Dot(w, direction);
+
+      return cosine > 0.0f ? (exponent + 1.0f) / (2.0f * PI) * (float) pow(cosine, exponent) : 0.0f;
+   }
+
+   virtual vector3f Generate(Sampler& sampler) const
+   {
+      point2f s = sampler.Get2D();
+
+      float cos_theta = (float) pow(s[x], 1.0f / (exponent + 1.0f));
+      float sin_theta = (float) sqrt(fmax(0.0f, 1.0f - cos_theta * cos_theta));
+      float phi = 2.0f * PI * s[y];
+
+      return ((float) cos(phi) * sin_theta) * u + ((float) sin(phi) * sin_theta) * v + cos_theta * w;
+   }
+
+public:
+   vector3f u, v, w;
+   float exponent;
+};
+
+/* The equal weight mixture of the light pdfs of a list of objects, seen from
+   origin. Generate samples one object picked at random; GetValue averages over
+   all of them, as a direction may reach more than one. A direction that could
+   not be sampled comes back as the zero vector. */
+
+class MixturePdf : public Pdf
+{
+public:
+   MixturePdf(Object* const* o, size_t n, const point3f& p) : object(o), count(n), origin(p) {   }
+
+   virtual float GetValue(const vector3f& direction) const
+   {
+      float sum = 0.0f;
+
+      for (size_t i = 0; i < count; ++i)
+      {
+         sum = sum + object[i]->GetPdfValue(origin, direction);
+      }
+
+      return count > 0 ? sum / count : 0.0f;
+   }
+
+   virtual vector3f Generate(Sampler& sampler) const
+   {
+      vector3f direction(0.0f, 0.0f, 0.0f);
+
+      if (count == 0)
+      {
+         return direction;
+      }
+
+      size_t i = (size_t) (sampler.Get1D() * count);
+
+      if (i >= count)
+      {
+         i = count - 1;
+      }
+
+      float distance = 0.0f, pdf = 0.0f;
+
+      if (object[i]->SampleDirection(origin, sampler.Get2D(), direction, distance, pdf) == false)
+      {
+         return vector3f(0.0f, 0.0f, 0.0f);
+      }
+
+      return direction;
+   }
+
+private:
+   Object* const* object;
+   size_t count;
+   point3f origin;
+};
+
+/* Weight for a sample drawn with density f when another strategy would have drawn it with density g (Veach's power heuristic, beta = 2). */
+inline float PowerHeuristic(float f, float g)
+{
+   f = f * f;
+   g = g * g;
+
+   return f + g > 0.0f ? f / (f + g) : 0.0f;
+}
+
 #endif
@@ -6,6 +6,8 @@
 #include <math.h>
 #include <stdio.h>
 
+#include "kernels.h"
+
 class Perlin
 {
 public:
@@ -35,6 +37,15 @@ public:
                                      grad(p[BB + 1], x - 1, y - 1, z - 1))));
    }
 
+/* The sum of octaves of noise, each at twice the frequency and half the
+   amplitude of the last, as worked out by the selected kernels. */
+   static float Turbulence(float x, float y, float z, size_t octaves)
+   {
+      return Kernels::Get().Turbulence(p, x, y, z, octaves);
+   }
+
+   static const int* GetPermutation() {   return p;   }
+
 protected:
 private:
    static float fade(float t)
@@ -10,7 +10,12 @@
 class Ray
 {
 public:
-   Ray(const point3f& o, const vector3f& d) : origin(o), direction(d)
+   Ray() : time(0.0f) {   }
+
+/* For a direction already of unit length whose inverse was worked out elsewhere. */
+   Ray(const point3f& o, const vector3f& d, const vector3f& inverse_d, float t) : origin(o), direction(d), inverse_direction(inverse_d), time(t) {   }
+
+   Ray(const point3f& o, const vector3f& d, float t = 0.0f) : origin(o), direction(d), time(t)
    {
       direction.Normalize();
 
@@ -19,6 +24,7 @@ public:
 
    point3f GetOrigin()    const {   return origin;      }
    vector3f GetDirection() const {   return direction;   }
+   float GetTime()         const {   return time;        }
   
    vector3f GetInverseDirectionForAABoxFaceIntersection() const { return inverse_direction; }
 
@@ -33,6 +39,8 @@ private:
    vector3f direction;
 
    vector3f inverse_direction;
+
+   float time; /* Shutter time in [0, 1) for motion blur. */
 };
 
 #endif
@@ -0,0 +1,512 @@
+/* File: renderer.cpp; Mode: C++; Tab-width: 3; Author: Simon Flannery;       */
+
+#include <stdio.h>
+
+#include <chrono>
+
+#include "renderer.h"
+#include "scheduler.h"
+#include "camera.h"
+#include "scene.h"
+#include "pathtracer.h"
+#include "sampler.h"
+#include "image.h"
+#include "film.h"
+#include "packet.h"
+#include "hit.h"
+#include "wavefront.h"
+
+Renderer::Renderer(Scene* s, PathTracer* t, Scheduler* sch, size_t samples, uint64_t sd, Sampler::Type st) : scene(s), camera(s->GetCamera()), trace(t), scheduler(sch), samples_per_pixel(samples), seed(sd), sampler_type(st), tiles_x(0), tiles_y(0), noise_threshold(0.0f), min_samples(ADAPTIVE_MIN_SAMPLES), szCheckpointFileName(NULL), szStateFileName(NULL), checkpoint_seconds(0.0f), checkpoint_passes(0), resume(false), packets(true), integrator(Integrator::Recursive), wavefront_paths(WAVEFRONT_PATHS), reorder(false)
+{
+   tiles_done = 0;
+   last_percent = 0;
+}
+
+void Renderer::SetAdaptive(float threshold, size_t samples)
+{
+   noise_threshold = threshold;
+   min_samples = samples > 0 ? samples : 1;
+
+   return;
+}
+
+void Renderer::SetCheckpoint(const char* szImageFileName, float seconds, size_t passes)
+{
+   szCheckpointFileName = szImageFileName;
+   checkpoint_seconds = seconds;
+   checkpoint_passes = passes;
+
+   return;
+}
+
+void Renderer::SetDeadline(std::chrono::steady_clock::time_point d)
+{
+   deadline = d;
+
+   return;
+}
+
+void Renderer::SetStateFile(const char* szFileName, bool r)
+{
+   szStateFileName = szFileName;
+   resume = r;
+
+   return;
+}
+
+void Renderer::SetPackets(bool p)
+{
+   packets = p;
+
+   return;
+}
+
+void Renderer::SetIntegrator(Integrator i)
+{
+   integrator = i;
+
+   return;
+}
+
+void Renderer::SetWavefront(size_t paths, bool r)
+{
+   wavefront_paths = paths > 0 ? paths : 1;
+   reorder = r;
+
+   return;
+}
+
+void Renderer::Render(Image& capture, Image* sample_counts)
+{
+   const size_t width  = capture.GetWidth();
+   const size_t height = capture.GetHeight();
+
+   tiles_x = (width  + TILE_SIZE - 1) / TILE_SIZE;
+   tiles_y = (height + TILE_SIZE - 1) / TILE_SIZE;
+
+   Film film(width, height);
+
+   active.assign(width * height, 1);
+
+   std::vector<size_t> tiles(tiles_x * tiles_y);
+
+   for (size_t i = 0; i < tiles.size(); ++i)
+   {
+      tiles[i] = i;
+   }
+
+   const bool adaptive = noise_threshold > 0.0f;
+   const bool time_limited = deadline != std::chrono::steady_clock::time_point();
+   const bool progressive = adaptive || time_limited || checkpoint_seconds > 0.0f || checkpoint_passes > 0;
+   size_t taken = 0, pass = 0;
+   float seconds_per_sample = 0.0f;
+
+   if (resume != false && LoadState(film, taken, pass) != false)
+   {
+      printf("Resuming from pass %d at %d spp\n", (int) pass, (int) taken); fflush(NULL);
+
+      if (adaptive != false)
+      {
+         UpdateActive(film, tiles);
+      }
+   }
+
+/* A pool of paths for each thread, kept across the tiles it renders. */
+   std::vector<Wavefront*> wavefronts;
+
+   if (integrator == Integrator::Wavefront)
+   {
+      for (size_t k = 0; k < scheduler->GetNumThreads(); ++k)
+      {
+         wavefronts.push_back(new Wavefront(scene, trace->GetMaxBounces(), trace->GetRRDepth(), sampler_type, seed, packets, reorder, wavefront_paths));
+      }
+   }
+
+   auto last_checkpoint = std::chrono::steady_clock::now();
+   size_t last_checkpoint_pass = pass;
+
+   while (tiles.empty() == false && taken < samples_per_pixel)
+   {
+   /* Without a threshold or checkpoints there is a single pass. Checkpoints
+      alone take fixed passes. With a threshold each pass adds half again what
+      the pixels already have, so the error estimate is revisited often early
+      on without paying for a pass every few samples later. */
+      size_t samples = samples_per_pixel - taken;
+
+      if (adaptive != false)
+      {
+         size_t step = taken / 2 > min_samples ? taken / 2 : min_samples;
+         samples = step < samples ? step : samples;
+      }
+      else if (progressive != false)
+      {
+         samples = PROGRESSIVE_PASS_SAMPLES < samples ? PROGRESSIVE_PASS_SAMPLES : samples;
+      }
+
+   /* Against a deadline, a short first pass times the scene and the last
+      pass is cut down to what the one before suggests will fit. Retiring
+      pixels only makes passes cheaper, so the estimate errs on the early side. */
+      if (time_limited != false)
+      {
+         if (seconds_per_sample == 0.0f)
+         {
+            samples = PROGRESSIVE_PASS_SAMPLES < samples ? PROGRESSIVE_PASS_SAMPLES : samples;
+         }
+
+         float remaining = std::chrono::duration<float>(deadline - std::chrono::steady_clock::now()).count();
+
+         if (seconds_per_sample > 0.0f && remaining < samples * seconds_per_sample)
+         {
+            samples = remaining > 0.0f ? (size_t) (remaining / seconds_per_sample) : 0;
+         }
+
+         if (samples == 0)
+         {
+            printf("Stopping at the time limit\n"); fflush(NULL);
+
+            break;
+         }
+      }
+
+      auto pass_start = std::chrono::steady_clock::now();
+
+      tiles_done = 0;
+      last_percent = 0;
+
+      scheduler->ParallelFor(tiles.size(), [this, &tiles, &film, &wavefronts, samples, progressive](size_t k, size_t thread)
+      {
+         RenderTile(tiles[k], film, samples, wavefronts.empty() == false ? wavefronts[thread] : NULL);
+
+         if (progressive == false)
+         {
+            ReportProgress();
+         }
+      });
+
+      taken = taken + samples;
+      ++pass;
+
+      auto now = std::chrono::steady_clock::now();
+      float pass_time = std::chrono::duration<float>(now - pass_start).count();
+
+      seconds_per_sample = pass_time / samples;
+
+      if (adaptive != false)
+      {
+         if (taken >= min_samples)
+         {
+            UpdateActive(film, tiles);
+         }
+
+         size_t remaining = 0;
+
+         for (size_t i = 0; i < active.size(); ++i)
+         {
+            remaining = remaining + active[i];
+         }
+
+         printf("Pass %d: %d spp in %.2f s, %d pixels still sampling\n", (int) pass, (int) taken, pass_time, (int) remaining); fflush(NULL);
+      }
+      else if (progressive != false)
+      {
+         printf("Pass %d: %d spp in %.2f s\n", (int) pass, (int) taken, pass_time); fflush(NULL);
+      }
+
+      float elapsed = std::chrono::duration<float>(now - last_checkpoint).count();
+
+      if ((checkpoint_seconds > 0.0f && elapsed >= checkpoint_seconds) ||
+          (checkpoint_passes > 0 && pass - last_checkpoint_pass >= checkpoint_passes))
+      {
+         Checkpoint(film, capture, taken, pass);
+
+         last_checkpoint = now;
+         last_checkpoint_pass = pass;
+      }
+   }
+
+   for (size_t k = 0; k < wavefronts.size(); ++k)
+   {
+      delete wavefronts[k];
+   }
+
+   SaveState(film, taken, pass);
+
+   if (progressive != false)
+   {
+      printf("Reached %d spp, %.1f spp on average, in %d passes\n", (int) taken, film.GetTotalSampleCount() / (double) (width * height), (int) pass); fflush(NULL);
+   }
+
+   film.Resolve(capture);
+
+   if (sample_counts != NULL)
+   {
+      film.ResolveSampleCounts(*sample_counts);
+   }
+
+   return;
+}
+
+void Renderer::RenderTile(size_t tile, Film& film, size_t samples, Wavefront* wavefront)
+{
+   const size_t width  = film.GetWidth();
+   const size_t height = film.GetHeight();
+
+   const size_t x0 = (tile % tiles_x) * TILE_SIZE;
+   const size_t y0 = (tile / tiles_x) * TILE_SIZE;
+   const size_t x1 = x0 + TILE_SIZE < width  ? x0 + TILE_SIZE : width;
+   const size_t y1 = y0 + TILE_SIZE < height ? y0 + TILE_SIZE : height;
+
+   Sampler* sampler = Sampler::Create(sampler_type, seed);
+
+/* With packets on, the camera rays are gathered a packet at a time and
+   intersected together. Each path is then followed alone from its first
+   hit, with its sampler set back to where its camera ray left it, so the
+   samples are the ones tracing the rays one by one gives. */
+   struct Pending
+   {
+      size_t i, j, t;
+   };
+
+   Pending pending[PACKET_SIZE];
+   std::vector<Ray> rays;
+
+   rays.reserve(PACKET_SIZE);
+
+   auto flush = [&]()
+   {
+      RayPacket packet(rays.data(), rays.size());
+      Hit hits[PACKET_SIZE];
+
+      const uint32_t found = trace->IntersectPacket(packet, hits);
+
+      for (size_t k = 0; k < rays.size(); ++k)
+      {
+         const Pending& p = pending[k];
+
+         sampler->StartPixelSample(p.j * width + p.i, p.t);
+         sampler->Get2D();
+         sampler->Get1D();
+
+         film.AddSample(p.i, p.j, trace->TracePath(rays[k], hits[k], ((found >> k) & 1) != 0, *sampler));
+      }
+
+      rays.clear();
+
+      return;
+   };
+
+/* With a wavefront the paths are handed to its pool, and their colours
+   added in the same order once it has traced them. */
+   std::vector<Pending> queued;
+
+   if (wavefront != NULL)
+   {
+      queued.reserve(wavefront->GetCapacity());
+   }
+
+   auto trace_paths = [&]()
+   {
+      wavefront->Trace();
+
+      for (size_t k = 0; k < queued.size(); ++k)
+      {
+         film.AddSample(queued[k].i, queued[k].j, wavefront->GetColor(k));
+      }
+
+      wavefront->Clear();
+      queued.clear();
+
+      return;
+   };
+
+   for (size_t j = y0; j < y1; ++j)
+   {
+      for (size_t i = x0; i < x1; ++i)
+      {
+         if (active[j * width + i] == 0)
+         {
+            continue;
+         }
+
+      /* Carry on from the pixel's last sample so each pass extends the same sequence. */
+         const size_t first = film.GetSampleCount(i, j);
+
+         for (size_t t = first; t < first + samples; ++t)
+         {
+            Sampler& s = wavefront != NULL ? wavefront->GetNextSampler() : *sampler;
+
+            s.StartPixelSample(j * width + i, t);
+
+            point2f jitter = s.Get2D();
+            float time = s.Get1D();
+
+            point2f p((i + jitter[x]) / (float) width,
+                      (j + jitter[y]) / (float) height);
+
+            const Ray ray = camera->GenerateRay(p, time);
+
+            if (wavefront != NULL)
+            {
+               queued.push_back({i, j, t});
+               wavefront->Add(ray);
+
+               if (wavefront->IsFull() != false)
+               {
+                  trace_paths();
+               }
+
+               continue;
+            }
+
+            if (packets == false)
+            {
+               film.AddSample(i, j, trace->TracePath(ray, *sampler));
+
+               continue;
+            }
+
+            pending[rays.size()] = {i, j, t};
+            rays.push_back(ray);
+
+            if (rays.size() == PACKET_SIZE)
+            {
+               flush();
+            }
+         }
+      }
+   }
+
+   if (rays.empty() == false)
+   {
+      flush();
+   }
+
+   if (queued.empty() == false)
+   {
+      trace_paths();
+   }
+
+   delete sampler;
+
+   return;
+}
+
+void Renderer::UpdateActive(const Film& film, std::vector<size_t>& tiles)
+{
+   const size_t width  = film.GetWidth();
+   const size_t height = film.GetHeight();
+
+   size_t kept = 0;
+
+   for (size_t k = 0; k < tiles.size(); ++k)
+   {
+      const size_t x0 = (tiles[k] % tiles_x) * TILE_SIZE;
+      const size_t y0 = (tiles[k] / tiles_x) * TILE_SIZE;
+      const size_t x1 = x0 + TILE_SIZE < width  ? x0 + TILE_SIZE : width;
+      const size_t y1 = y0 + TILE_SIZE < height ? y0 + TILE_SIZE : height;
+
+      bool any = false;
+
+      for (size_t j = y0; j < y1; ++j)
+      {
+         for (size_t i = x0; i < x1; ++i)
+         {
+            uint8_t& a = active[j * width + i];
+
+            if (a != 0 && film.GetRelativeError(i, j) <= noise_threshold)
+            {
+               a = 0;
+            }
+
+            any = any || a != 0;
+         }
+      }
+
+      if (any != false)
+      {
+         tiles[kept++] = tiles[k];
+      }
+   }
+
+   tiles.resize(kept);
+
+   return;
+}
+
+bool Renderer::LoadState(Film& film, size_t& taken, size_t& pass) const
+{
+   if (szStateFileName == NULL)
+   {
+      return false;
+   }
+
+   FilmProgress progress = {};
+
+   if (film.Load(szStateFileName, progress) == false)
+   {
+      printf("Could not read %s, starting afresh\n", szStateFileName); fflush(NULL);
+
+      return false;
+   }
+
+/* Another seed or sampler would restart the sequences part way through. */
+   if (progress.seed != seed || progress.sampler != (uint32_t) sampler_type)
+   {
+      printf("%s was rendered with another seed or sampler, starting afresh\n", szStateFileName); fflush(NULL);
+
+      film.Clear();
+
+      return false;
+   }
+
+   taken = progress.samples;
+   pass = progress.pass;
+
+   return true;
+}
+
+void Renderer::SaveState(const Film& film, size_t taken, size_t pass) const
+{
+   if (szStateFileName != NULL)
+   {
+      FilmProgress progress = {seed, (uint32_t) sampler_type, (uint32_t) pass, (uint32_t) taken};
+
+      if (film.Save(szStateFileName, progress) == false)
+      {
+         printf("Could not write %s\n", szStateFileName); fflush(NULL);
+      }
+   }
+
+   return;
+}
+
+void Renderer::Checkpoint(const Film& film, Image& capture, size_t taken, size_t pass) const
+{
+   if (szCheckpointFileName != NULL)
+   {
+      film.Resolve(capture);
+      capture.Save(szCheckpointFileName);
+   }
+
+   SaveState(film, taken, pass);
+
+   return;
+}
+
+void Renderer::ReportProgress()
+{
+   size_t done = ++tiles_done;
+   int percent = (int) ((100 * done) / (tiles_x * tiles_y));
+   int last = last_percent;
+
+   while (percent > last)
+   {
+      if (last_percent.compare_exchange_weak(last, percent) != false)
+      {
+         printf("%2d%c ", percent, '%'); fflush(NULL);
+         break;
+      }
+   }
+
+   return;
+}
@@ -0,0 +1,115 @@
+/* File: renderer.h; Mode: C++; Tab-width: 3; Author: Simon Flannery;         */
+
+#ifndef RENDERER_H
+#define RENDERER_H
+
+#include <stdint.h>
+
+#include <atomic>
+#include <chrono>
+#include <vector>
+
+#include "math.h"
+#include "sampler.h"
+
+#define TILE_SIZE 16
+#define ADAPTIVE_MIN_SAMPLES 64
+#define PROGRESSIVE_PASS_SAMPLES 16
+
+class Scene;
+class Camera;
+class PathTracer;
+class Scheduler;
+class Image;
+class Film;
+class Wavefront;
+
+/* Splits the image into square tiles and hands them to the scheduler. Every
+   tile owns its pixels outright, so workers write straight into the film.
+   With a noise threshold set, the samples go out in passes: after each pass
+   a pixel whose relative error is below the threshold stops, and a tile with
+   no pixel left is not scheduled again. Checkpoints and a deadline also
+   render in passes: checkpoints write the image and the film's state between
+   them, for a later run to resume from, and the deadline is checked before
+   each pass starts. */
+
+class Renderer
+{
+public:
+   enum class Integrator { Recursive, Wavefront };
+
+   Renderer(Scene* s, PathTracer* t, Scheduler* sch, size_t samples, uint64_t sd, Sampler::Type st = Sampler::Type::Random);
+
+/* Turns on adaptive sampling; samples_per_pixel becomes the most any pixel gets. */
+   void SetAdaptive(float threshold, size_t min_samples = ADAPTIVE_MIN_SAMPLES);
+
+/* Writes the image so far every so many seconds or passes; either may be zero.
+   The state file, if one is set, is written along with it. */
+   void SetCheckpoint(const char* szImageFileName, float seconds, size_t passes);
+
+/* Stops starting passes once the deadline is reached, shortening the last to
+   fit; samples_per_pixel still caps the render. */
+   void SetDeadline(std::chrono::steady_clock::time_point deadline);
+
+/* Names the file the film's state is saved to when rendering ends and at each
+   checkpoint. With resume set, rendering carries on from what it holds. */
+   void SetStateFile(const char* szFileName, bool resume);
+
+/* Traces the camera rays in packets, which is the default; the image is the
+   same either way. */
+   void SetPackets(bool packets);
+
+/* Follows the paths one at a time, the default, or a pool of them in stages;
+   see Wavefront. The image is the same either way. */
+   void SetIntegrator(Integrator integrator);
+
+/* How many paths each thread's wavefront keeps in flight, and whether it
+   sorts their rays between bounces, which it does not by default. More
+   paths sort better but hold more memory and finish each tile later. */
+   void SetWavefront(size_t paths, bool reorder);
+
+/* sample_counts, if given, receives the number of samples each pixel took. */
+   void Render(Image& capture, Image* sample_counts = NULL);
+
+private:
+   void RenderTile(size_t tile, Film& film, size_t samples, Wavefront* wavefront);
+   void ReportProgress();
+
+   bool LoadState(Film& film, size_t& taken, size_t& pass) const;
+   void SaveState(const Film& film, size_t taken, size_t pass) const;
+   void Checkpoint(const Film& film, Image& capture, size_t taken, size_t pass) const;
+
+/* Retires the converged pixels and drops the tiles left without any. */
+   void UpdateActive(const Film& film, std::vector<size_t>& tiles);
+
+   Scene* scene;
+   Camera* camera;
+   PathTracer* trace;
+   Scheduler* scheduler;
+
+   size_t samples_per_pixel;
+   uint64_t seed;
+   Sampler::Type sampler_type;
+   size_t tiles_x, tiles_y;
+
+   float noise_threshold;
+   size_t min_samples;
+   std::vector<uint8_t> active;
+
+   const char* szCheckpointFileName;
+   const char* szStateFileName;
+   float checkpoint_seconds;
+   size_t checkpoint_passes;
+   bool resume;
+   bool packets;
+   Integrator integrator;
+   size_t wavefront_paths;
+   bool reorder;
+
+   std::chrono::steady_clock::time_point deadline;
+
+   std::atomic<size_t> tiles_done;
+   std::atomic<int> last_percent;
+};
+
+#endif
@@ -0,0 +1,227 @@
+/* File: sampler.cpp; Mode: C++; Tab-width: 3; Author: Simon Flannery;        */
+
+#include "sampler.h"
+
+/* The largest float below one. */
+#define ONE_MINUS_EPSILON 0.99999994f
+
+namespace
+{
+   inline float ToFloat(uint32_t v)
+   {
+   /* The top 24 bits fill the mantissa exactly, so 1.0 is never returned. */
+      return (v >> 8) * (1.0f / 16777216.0f);
+   }
+
+   inline uint32_t ReverseBits(uint32_t v)
+   {
+      v = ((v >> 1) & 0x55555555u) | ((v & 0x55555555u) << 1);
+      v = ((v >> 2) & 0x33333333u) | ((v & 0x33333333u) << 2);
+      v = ((v >> 4) & 0x0F0F0F0Fu) | ((v & 0x0F0F0F0Fu) << 4);
+      v = ((v >> 8) & 0x00FF00FFu) | ((v & 0x00FF00FFu) << 8);
+
+      return (v >> 16) | (v << 16);
+   }
+
+/* Owen scrambling of a 32 bit fraction: each bit is flipped depending on the
+   bits above it. The Laine-Karras hash does this on the reversed value, in
+   which the higher bits are the lower ones. */
+   inline uint32_t OwenScramble(uint32_t v, uint32_t seed)
+   {
+      v = ReverseBits(v);
+
+      v = v + seed;
+      v = v ^ (v * 0x6C50B47Cu);
+      v = v ^ (v * 0xB82F1E52u);
+      v = v ^ (v * 0xC7AFE638u);
+      v = v ^ (v * 0x8D22F6E6u);
+
+      return ReverseBits(v);
+   }
+
+/* The second Sobol dimension; the first is the bit reversed index. */
+   inline uint32_t Sobol2(uint32_t index)
+   {
+      uint32_t result = 0;
+
+      for (uint32_t v = 1u << 31; index != 0; index = index >> 1, v = v ^ (v >> 1))
+      {
+         if (index & 1)
+         {
+            result = result ^ v;
+         }
+      }
+
+      return result;
+   }
+
+   inline uint32_t Hash(uint64_t a, uint64_t b)
+   {
+      uint64_t v = a * 0x9E3779B97F4A7C15ULL + b;
+
+      v = (v ^ (v >> 30)) * 0xBF58476D1CE4E5B9ULL;
+      v = (v ^ (v >> 27)) * 0x94D049BB133111EBULL;
+
+      return (uint32_t) (v ^ (v >> 31));
+   }
+}
+
+Sampler* Sampler::Create(Type type, uint64_t seed)
+{
+   Sampler* sampler = NULL;
+
+   switch (type)
+   {
+   case Type::Sobol:
+      sampler = new SobolSampler(seed);
+      break;
+
+   case Type::Halton:
+      sampler = new HaltonSampler(seed);
+      break;
+
+   default:
+      sampler = new RandomSampler(seed);
+      break;
+   }
+
+   return sampler;
+}
+
+void RandomSampler::StartPixelSample(size_t pixel, size_t sample, size_t dimension)
+{
+   random.Seed(Mix(pixel ^ Mix(seed)), Mix(sample));
+
+   if (dimension != 0)
+   {
+      random.Advance(dimension);
+   }
+
+   return;
+}
+
+float RandomSampler::Get1D()
+{
+   return random.NextFloat();
+}
+
+point2f RandomSampler::Get2D()
+{
+   float u = random.NextFloat();
+   float v = random.NextFloat();
+
+   return point2f(u, v);
+}
+
+void SobolSampler::StartPixelSample(size_t pixel, size_t sample, size_t d)
+{
+   pixel_seed = Mix(pixel ^ Mix(seed));
+   index = (uint32_t) sample;
+   dimension = d;
+
+   return;
+}
+
+float SobolSampler::Get1D()
+{
+   uint32_t s = NextSeed();
+
+   uint32_t shuffled = OwenScramble(index, s);
+
+   return ToFloat(OwenScramble(ReverseBits(shuffled), Hash(s, 1)));
+}
+
+point2f SobolSampler::Get2D()
+{
+   uint32_t s = NextSeed();
+
+   uint32_t shuffled = OwenScramble(index, s);
+
+   uint32_t u = OwenScramble(ReverseBits(shuffled), Hash(s, 1));
+   uint32_t v = OwenScramble(Sobol2(shuffled), Hash(s, 2));
+
+   return point2f(ToFloat(u), ToFloat(v));
+}
+
+HaltonSampler::HaltonSampler(uint64_t s) : seed(s), pixel_seed(0), index(0), dimension(0)
+{
+   size_t count = 0;
+
+   for (uint32_t n = 2; count < HALTON_MAX_DIMENSIONS; ++n)
+   {
+      bool is_prime = true;
+
+      for (size_t i = 0; i < count && prime[i] * prime[i] <= n; ++i)
+      {
+         if (n % prime[i] == 0)
+         {
+            is_prime = false;
+            break;
+         }
+      }
+
+      if (is_prime != false)
+      {
+         prime[count++] = n;
+      }
+   }
+}
+
+void HaltonSampler::StartPixelSample(size_t pixel, size_t sample, size_t d)
+{
+   pixel_seed = Mix(pixel ^ Mix(seed));
+   index = sample;
+   dimension = d;
+
+   random.Seed(pixel_seed, Mix(sample));
+
+   return;
+}
+
+float HaltonSampler::Get1D()
+{
+   return Sample(dimension++);
+}
+
+point2f HaltonSampler::Get2D()
+{
+   float u = Sample(dimension++);
+   float v = Sample(dimension++);
+
+   return point2f(u, v);
+}
+
+float HaltonSampler::Sample(size_t d)
+{
+   if (d >= HALTON_MAX_DIMENSIONS)
+   {
+      return random.NextFloat();
+   }
+
+/* Radical inverse of the index, shifting every digit by an amount that
+   depends on the digits before it. The shifts carry on past the index's
+   last digit until they fall below float precision. */
+   const uint32_t base = prime[d];
+   const double inverse_base = 1.0 / base;
+   const uint32_t s = Hash(pixel_seed, d);
+
+   uint64_t n = index, prefix = 0;
+   double value = 0.0, weight = inverse_base;
+
+   while (weight > 1e-8)
+   {
+      uint32_t digit = (uint32_t) (n % base);
+      n = n / base;
+
+      uint32_t shifted = (uint32_t) ((digit + Hash(s, prefix)) % base);
+
+      value = value + shifted * weight;
+      weight = weight * inverse_base;
+
+      prefix = prefix * base + digit + 1;
+   }
+
+   float u = (float) value;
+
+   return u < 1.0f ? u : ONE_MINUS_EPSILON;
+}
@@ -0,0 +1,178 @@
+/* File: sampler.h; Mode: C++; Tab-width: 3; Author: Simon Flannery;          */
+
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include <stdint.h>
+
+#include "math.h"
+
+/* PCG32 random number generator (M.E. O'Neill, pcg-random.org). Eight bytes
+   of state, a period of 2^64 per stream and 2^63 selectable streams. */
+
+class Random
+{
+public:
+   Random(uint64_t seed = 0, uint64_t stream = 0) {   Seed(seed, stream);   }
+
+   void Seed(uint64_t seed, uint64_t stream)
+   {
+      state = 0;
+      increment = (stream << 1) | 1;
+      NextUInt();
+      state = state + seed;
+      NextUInt();
+
+      return;
+   }
+
+   uint32_t NextUInt()
+   {
+      uint64_t old = state;
+
+      state = old * MULTIPLIER + increment;
+
+      uint32_t xorshifted = (uint32_t) (((old >> 18) ^ old) >> 27);
+      uint32_t rot = (uint32_t) (old >> 59);
+
+      return (xorshifted >> rot) | (xorshifted << ((0u - rot) & 31));
+   }
+
+   float NextFloat() // [0, 1)
+   {
+   /* The top 24 bits fill the mantissa exactly, so 1.0 is never returned. */
+      return (NextUInt() >> 8) * (1.0f / 16777216.0f);
+   }
+
+   void Advance(uint64_t delta)
+   {
+   /* Jump ahead in O(log delta) (F. Brown, "Random Number Generation with Arbitrary Stride"). */
+      uint64_t acc_mult = 1, acc_plus = 0;
+      uint64_t cur_mult = MULTIPLIER, cur_plus = increment;
+
+      while (delta > 0)
+      {
+         if (delta & 1)
+         {
+            acc_mult = acc_mult * cur_mult;
+            acc_plus = acc_plus * cur_mult + cur_plus;
+         }
+
+         cur_plus = (cur_mult + 1) * cur_plus;
+         cur_mult = cur_mult * cur_mult;
+         delta = delta >> 1;
+      }
+
+      state = acc_mult * state + acc_plus;
+
+      return;
+   }
+
+private:
+   static const uint64_t MULTIPLIER = 6364136223846793005ULL;
+
+   uint64_t state, increment;
+};
+
+#define HALTON_MAX_DIMENSIONS 128
+
+/* Hands out the numbers for one path at a time. StartPixelSample positions
+   the sampler on one sample of one pixel; after that every call takes the
+   next dimension, in the order the integrator asks for them: the film
+   position and shutter time first, then each bounce's light sample,
+   direction and Russian roulette decision. A sample is reproducible no
+   matter which thread renders it or in what order. */
+
+class Sampler
+{
+public:
+   enum class Type { Random, Sobol, Halton };
+
+   static Sampler* Create(Type type, uint64_t seed);
+
+   virtual ~Sampler() {   }
+
+   virtual void StartPixelSample(size_t pixel, size_t sample, size_t dimension = 0) = 0;
+
+   virtual float Get1D() = 0;
+   virtual point2f Get2D() = 0;
+
+protected:
+   static uint64_t Mix(uint64_t v)
+   {
+   /* The SplitMix64 finaliser; neighbouring pixels land far apart. */
+      v = (v ^ (v >> 30)) * 0xBF58476D1CE4E5B9ULL;
+      v = (v ^ (v >> 27)) * 0x94D049BB133111EBULL;
+
+      return v ^ (v >> 31);
+   }
+};
+
+/* Independent uniform numbers: every (pixel, sample) pair owns a PCG stream. */
+
+class RandomSampler : public Sampler
+{
+public:
+   RandomSampler(uint64_t s = 0) : seed(s) {   }
+
+   virtual void StartPixelSample(size_t pixel, size_t sample, size_t dimension = 0);
+
+   virtual float Get1D();
+   virtual point2f Get2D();
+
+private:
+   uint64_t seed;
+   Random random;
+};
+
+/* The first two Sobol dimensions, Owen scrambled, with the sample order
+   shuffled afresh for every pixel and dimension pair (Burley, "Practical
+   Hash-based Owen Scrambling", 2020). Each 2D request is a well stratified
+   point set of its own, and padding the pairs this way keeps the dimensions
+   from correlating with one another however long the path. */
+
+class SobolSampler : public Sampler
+{
+public:
+   SobolSampler(uint64_t s = 0) : seed(s), pixel_seed(0), index(0), dimension(0) {   }
+
+   virtual void StartPixelSample(size_t pixel, size_t sample, size_t dimension = 0);
+
+   virtual float Get1D();
+   virtual point2f Get2D();
+
+private:
+   uint32_t NextSeed() {   return (uint32_t) Mix(pixel_seed + dimension++);   }
+
+   uint64_t seed, pixel_seed;
+   uint32_t index;
+   size_t dimension;
+};
+
+/* The Halton sequence with one prime base per dimension, each digit
+   scrambled by a random shift chosen per pixel, dimension and digit prefix.
+   Past HALTON_MAX_DIMENSIONS the bases are too large to help and the
+   remaining dimensions are filled with independent random numbers. */
+
+class HaltonSampler : public Sampler
+{
+public:
+   HaltonSampler(uint64_t s = 0);
+
+   virtual void StartPixelSample(size_t pixel, size_t sample, size_t dimension = 0);
+
+   virtual float Get1D();
+   virtual point2f Get2D();
+
+private:
+   float Sample(size_t d);
+
+   uint32_t prime[HALTON_MAX_DIMENSIONS];
+
+   uint64_t seed, pixel_seed;
+   uint64_t index;
+   size_t dimension;
+   Random random;
+};
+
+#endif
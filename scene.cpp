@@ -9,14 +9,78 @@
 #include <stdio.h>
 #include <string.h>
 
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
+#include <chrono>
+#include <string>
+
 #include "scene.h"
 #include "camera.h"
 #include "material.h"
 #include "object.h"
+#include "mesh.h"
+#include "mapping.h"
 
 #define DegreesToRadians(x) ((PI * x) / 180.0f)
 
-Scene::Scene(const char* szFileName)
+namespace
+{
+/* FNV-1a taken a word at a time, which is fast enough to key a cache on the
+   whole of a large file. A product only carries bits upwards, so the top half
+   is folded back down after every word. */
+   uint64_t Hash(const uint8_t* data, size_t size, uint64_t h = 0xCBF29CE484222325ULL)
+   {
+      const uint64_t prime = 0x100000001B3ULL;
+
+      size_t i = 0;
+
+      for (; i + sizeof(uint64_t) <= size; i = i + sizeof(uint64_t))
+      {
+         uint64_t word = 0;
+         memcpy(&word, data + i, sizeof(uint64_t));
+
+         h = (h ^ word) * prime;
+         h = h ^ (h >> 32);
+      }
+
+      for (; i < size; ++i)
+      {
+         h = (h ^ data[i]) * prime;
+      }
+
+      return h;
+   }
+
+/* The cache file of a mesh is named for its source and everything that
+   shapes what is built from it. */
+   bool GetCacheFileName(const char* szCacheDirectory, const char* szMeshFileName, BVH::Type type, std::string& name)
+   {
+      MappedFile source;
+
+      if (source.Open(szMeshFileName) == false)
+      {
+         return false;
+      }
+
+      const uint32_t parameters[] = {MESH_CACHE_VERSION, (uint32_t) type, BVH_WIDTH, MESH_LEAF_SIZE, BVH_NUM_BINS, (uint32_t) sizeof(BVHNode)};
+
+      uint64_t key = Hash(source.GetData(), source.GetSize());
+      key = Hash((const uint8_t*) parameters, sizeof(parameters), key);
+
+      char szKey[32];
+      sprintf(szKey, "/%016llx.mesh", (unsigned long long) key);
+
+      name = std::string(szCacheDirectory) + szKey;
+
+      return true;
+   }
+}
+
+Scene::Scene(const char* szFileName, Scheduler* sch, BVH::Type type, const char* szCacheDirectory) : scheduler(sch), bvh_type(type), build_time(0.0), cache_directory(szCacheDirectory)
 {
    group = NULL;
    camera = NULL;
@@ -32,6 +96,15 @@ Scene::Scene(const char* szFileName)
 
    distribution = false;
 
+   if (cache_directory != NULL)
+   {
+#ifdef _WIN32
+      _mkdir(cache_directory);
+#else
+      mkdir(cache_directory, 0777);
+#endif
+   }
+
    if (szFileName != NULL)
    {
       file = fopen(szFileName, "r");
@@ -44,6 +117,17 @@ Scene::Scene(const char* szFileName)
    }
 
    file = NULL;
+
+   if (group != NULL)
+   {
+      auto start = std::chrono::steady_clock::now();
+
+      Compile();
+
+      build_time = build_time + std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+      CollectLights(group);
+   }
 }
 
 Scene::~Scene()
@@ -51,6 +135,16 @@ Scene::~Scene()
    delete group;
    delete camera;
 
+   for (std::map<std::string, Prototype>::iterator i = prototype.begin(); i != prototype.end(); ++i)
+   {
+      delete i->second.object;
+   }
+
+   for (std::map<Group*, Group*>::iterator i = compiled.begin(); i != compiled.end(); ++i)
+   {
+      delete i->second;
+   }
+
    for (size_t i = 0; i < num_materials; ++i)
    {
       delete material[i];
@@ -91,6 +185,177 @@ void Scene::ParseFile()
    return;
 }
 
+void Scene::Compile()
+{
+   CountPaths(group);
+
+   Group* flat = Compile(group);
+
+   delete group;
+   group = flat;
+
+   paths.clear();
+
+   return;
+}
+
+Group* Scene::Compile(Group* g)
+{
+   std::vector<Object*> flat;
+
+   Flatten(g, NULL, NULL, flat);
+
+   Group* result = new Group(flat.size());
+
+   for (size_t i = 0; i < flat.size(); ++i)
+   {
+      result->SetAt(i, flat[i]);
+   }
+
+   result->Build(scheduler, bvh_type);
+
+   return result;
+}
+
+void Scene::Flatten(Group* g, const Matrix3x4* matrix, const Matrix3x4* inverse, std::vector<Object*>& flat)
+{
+/* Without a matrix the group's own primitives are taken over as they are.
+   With one they may be shared, so they are copied or placed by a new transform. */
+   for (size_t i = 0; i < g->GetSize(); ++i)
+   {
+      Object* object = g->GetAt(i);
+
+      Group* child = dynamic_cast<Group*>(object);
+      Transform* transform = dynamic_cast<Transform*>(object);
+
+      if (child != NULL)
+      {
+         Flatten(child, matrix, inverse, flat);
+      }
+      else if (transform != NULL && matrix == NULL)
+      {
+         Place(transform->GetObject(), transform->GetMatrix(), transform->GetInverse(), flat);
+      }
+      else if (transform != NULL)
+      {
+         Place(transform->GetObject(), *matrix * transform->GetMatrix(), transform->GetInverse() * *inverse, flat);
+      }
+      else if (matrix == NULL)
+      {
+         flat.push_back(object);
+         g->SetAt(i, NULL);
+      }
+      else
+      {
+         Place(object, *matrix, *inverse, flat);
+      }
+   }
+
+   return;
+}
+
+void Scene::Place(Object* object, const Matrix3x4& matrix, const Matrix3x4& inverse, std::vector<Object*>& flat)
+{
+   Group* g = dynamic_cast<Group*>(object);
+   Transform* transform = dynamic_cast<Transform*>(object);
+
+   if (transform != NULL)
+   {
+      Place(transform->GetObject(), matrix * transform->GetMatrix(), transform->GetInverse() * inverse, flat);
+   }
+   else if (g != NULL && paths[g] < 2)
+   {
+      Flatten(g, &matrix, &inverse, flat);
+   }
+   else if (g != NULL)
+   {
+   /* Opening up a group placed many times would copy it for every placement. */
+      std::map<Group*, Group*>::iterator i = compiled.find(g);
+
+      if (i == compiled.end())
+      {
+         i = compiled.insert(std::make_pair(g, Compile(g))).first;
+      }
+
+      flat.push_back(new Transform(matrix, inverse, i->second));
+   }
+   else
+   {
+   /* Meshes have no Bake, so they stay instances of the one hierarchy. */
+      Object* baked = object->Bake(matrix);
+
+      flat.push_back(baked != NULL ? baked : new Transform(matrix, inverse, object));
+   }
+
+   return;
+}
+
+void Scene::CountPaths(Object* object)
+{
+/* A second visit carries on down, so everything under an object reached
+   twice is itself counted twice; a third changes nothing. */
+   int& count = paths[object];
+
+   if (count >= 2)
+   {
+      return;
+   }
+
+   ++count;
+
+   Group* g = dynamic_cast<Group*>(object);
+   Transform* transform = dynamic_cast<Transform*>(object);
+
+   if (g != NULL)
+   {
+      for (size_t i = 0; i < g->GetSize(); ++i)
+      {
+         CountPaths(g->GetAt(i));
+      }
+   }
+   else if (transform != NULL)
+   {
+      CountPaths(transform->GetObject());
+   }
+
+   return;
+}
+
+void Scene::CollectLights(Group* g)
+{
+/* Only untransformed primitives can be sampled; any other emitter is still
+   found by paths that happen to hit it. */
+   for (size_t i = 0; i < g->GetSize(); ++i)
+   {
+      Object* object = g->GetAt(i);
+      Group* child = dynamic_cast<Group*>(object);
+
+      if (child != NULL)
+      {
+         CollectLights(child);
+      }
+      else if (object->IsSampleable() != false && object->GetMaterial() != NULL && object->GetMaterial()->IsEmitter() != false)
+      {
+         light.push_back(object);
+      }
+   }
+
+   return;
+}
+
+bool Scene::IsLight(const Object* object) const
+{
+   for (size_t i = 0; i < light.size(); ++i)
+   {
+      if (light[i] == object)
+      {
+         return true;
+      }
+   }
+
+   return false;
+}
+
 void Scene::ParseOrthographicCamera()
 {
    char token[MAX_PARSER_TOKEN_LENGTH];
@@ -849,6 +1114,7 @@ Group* Scene::ParseGroup()
    
    GetToken(token); assert(strcmp(token, "}") == 0);
 
+/* The hierarchy is built once the scene is compiled. */
    return result;
 }
 
@@ -1223,7 +1489,7 @@ YZRectangle* Scene::ParseYZRectangle()
    return new YZRectangle(v0, v1, k, n, current_material);
 }
 
-Group* Scene::ParseTriangleMesh()
+TriangleMesh* Scene::ParseTriangleMesh()
 {
    char token[MAX_PARSER_TOKEN_LENGTH];
    char szFileName[MAX_PARSER_TOKEN_LENGTH];
@@ -1235,6 +1501,18 @@ Group* Scene::ParseTriangleMesh()
    GetToken(szFileName); 
    GetToken(token); assert(strcmp(token, "}") == 0);
 
+   std::string cache_file;
+
+   if (cache_directory != NULL && GetCacheFileName(cache_directory, szFileName, bvh_type, cache_file) != false)
+   {
+      TriangleMesh* mesh = TriangleMesh::Load(cache_file.c_str(), current_material);
+
+      if (mesh != NULL)
+      {
+         return mesh;
+      }
+   }
+
    FILE* f = fopen(szFileName, "r");
    assert(f != NULL);
 
@@ -1267,12 +1545,10 @@ Group* Scene::ParseTriangleMesh()
 
    fseek(f, 0, SEEK_SET);
 
-   vector3f* verts = new vector3f[vcount];
-   Group* result   = new Group(fcount);
+   point3f*  verts   = new point3f[vcount];
+   uint32_t* indices = new uint32_t[3 * fcount];
 
    int new_vcount = 0, new_fcount = 0;
-  
-   vector3f vmax(-FLT_MAX, -FLT_MAX, -FLT_MAX), vmin(FLT_MAX, FLT_MAX, FLT_MAX);
 
    c = fgetc(f);
 
@@ -1285,14 +1561,6 @@ Group* Scene::ParseTriangleMesh()
          fscanf(f, "%f %f %f", &v0, &v1, &v2);
          verts[new_vcount] = vector3f(v0, v1, v2);
 
-         if (vmin[x] > v0) vmin[x] = v0;
-         if (vmin[y] > v1) vmin[y] = v1;
-         if (vmin[z] > v2) vmin[z] = v2;
-
-         if (vmax[x] < v0) vmax[x] = v0;
-         if (vmax[y] < v1) vmax[y] = v1;
-         if (vmax[z] < v2) vmax[z] = v2;
-
          ++new_vcount;
       }
       else if (c == 'f')
@@ -1303,8 +1571,9 @@ Group* Scene::ParseTriangleMesh()
          assert(f0 > 0 && f0 <= vcount);
          assert(f1 > 0 && f1 <= vcount);
          assert(f2 > 0 && f2 <= vcount);
-         Triangle* t = new Triangle(verts[f0 - 1], verts[f1 - 1], verts[f2 - 1], current_material);
-         result->SetAt(new_fcount, t);
+         indices[3 * new_fcount + 0] = f0 - 1;
+         indices[3 * new_fcount + 1] = f1 - 1;
+         indices[3 * new_fcount + 2] = f2 - 1;
          ++new_fcount;
       }
 
@@ -1313,13 +1582,22 @@ Group* Scene::ParseTriangleMesh()
 
    fclose(f);
 
-   delete [] verts;
    assert(fcount == new_fcount);
    assert(vcount == new_vcount);
 
-   result->SetBB(vmin * 1.01f, vmax * 1.01f); /* Increase the Bounding Box by a little (1%). */
+/* The mesh keeps the shared vertices and the index buffer. */
+   auto start = std::chrono::steady_clock::now();
 
-   return result;
+   TriangleMesh* mesh = new TriangleMesh(verts, vcount, indices, fcount, current_material, scheduler, bvh_type);
+
+   build_time = build_time + std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+   if (cache_file.empty() == false && mesh->Save(cache_file.c_str()) == false)
+   {
+      printf("Could not write %s\n", cache_file.c_str()); fflush(NULL);
+   }
+
+   return mesh;
 }
 
 Cube* Scene::ParseCube()
@@ -1424,7 +1702,7 @@ Transform* Scene::ParseTransform()
       else
       {
       /* Otherwise this must be an object, and there are no more transformations. */
-         object = ParseObject(token);
+         object = ParsePrototype(token);
          break;
       }
 
@@ -1437,6 +1715,62 @@ Transform* Scene::ParseTransform()
    return new Transform(matrix, object);
 }
 
+Object* Scene::ParsePrototype(char token[MAX_PARSER_TOKEN_LENGTH])
+{
+/* The block's tokens and the material it starts with name the object, so
+   a mesh or group repeated under many transforms is read and built once. */
+   char szMaterial[32];
+   sprintf(szMaterial, "%p ", (void*) current_material);
+
+   std::string key = std::string(szMaterial) + token;
+
+   const long start = ftell(file);
+
+   char text[MAX_PARSER_TOKEN_LENGTH];
+   size_t depth = 0;
+
+   do
+   {
+      if (GetToken(text) == false)
+      {
+         break;
+      }
+
+      if (strcmp(text, "{") == 0)
+      {
+         ++depth;
+      }
+      else if (strcmp(text, "}") == 0)
+      {
+         --depth;
+      }
+
+      key = key + " " + text;
+   } while (depth > 0);
+
+   std::map<std::string, Prototype>::iterator i = prototype.find(key);
+
+   if (i != prototype.end())
+   {
+      current_material = i->second.material;
+
+      return i->second.object;
+   }
+
+   fseek(file, start, SEEK_SET);
+
+   Prototype p;
+   p.object = ParseObject(token);
+   p.material = current_material;
+
+   if (p.object != NULL)
+   {
+      prototype[key] = p;
+   }
+
+   return p.object;
+}
+
 bool Scene::GetToken(char token[MAX_PARSER_TOKEN_LENGTH])
 {
    token[0] = '\0';
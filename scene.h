@@ -7,7 +7,12 @@
 
 #include <assert.h>
 
+#include <vector>
+#include <string>
+#include <map>
+
 #include "math.h"
+#include "bvh.h"
 
 #define MAX_PARSER_TOKEN_LENGTH 100
 #define SIZE 0x20
@@ -30,16 +35,21 @@ class MotionSphere;
 class Plane;
 class Cube;
 class Triangle;
+class TriangleMesh;
 class Cone;
 class XYRectangle;
 class XZRectangle;
 class YZRectangle;
 class Transform;
+class Scheduler;
 
 class Scene
 {
 public:
-   Scene(const char* szFileName);
+/* Hierarchies are built on the scheduler's threads when one is given. With a
+   cache directory, built meshes are saved there and mapped back in by later
+   runs in place of parsing and building them again. */
+   Scene(const char* szFileName, Scheduler* scheduler = NULL, BVH::Type bvh_type = BVH::Type::SAH, const char* szCacheDirectory = NULL);
    ~Scene();
 
    Camera*   GetCamera()           const {   return camera;       }
@@ -51,12 +61,22 @@ public:
 
    bool      UseSamples()          const {   return distribution;       }
 
+/* Emitters that can be sampled directly, gathered once the file is read. */
+   size_t    GetNumLights()        const {   return light.size();       }
+   Object*   GetLight(size_t i)    const {   return light[i];           }
+   Object* const* GetLights()      const {   return light.empty() ? NULL : &light[0];   }
+   bool      IsLight(const Object* object) const;
+
+/* Seconds spent building hierarchies while the file was read. */
+   double    GetBuildTime()        const {   return build_time;         }
+
 private:
    void ParseFile();
    void ParseOrthographicCamera();
    void ParsePerspectiveCamera();
    void ParseBackground();
    void ParseMaterials();
+   void CollectLights(Group* g);
 
    DiffuseMaterial*    ParseDiffuse();
    ReflectiveMaterial* ParseReflective();
@@ -76,9 +96,19 @@ private:
    XYRectangle*  ParseXYRectangle();
    XZRectangle*  ParseXZRectangle();
    YZRectangle*  ParseYZRectangle();
-   Group*        ParseTriangleMesh();
+   TriangleMesh* ParseTriangleMesh();
    Cube*         ParseCube();
    Transform*    ParseTransform();
+   Object*       ParsePrototype(char token[MAX_PARSER_TOKEN_LENGTH]);
+
+/* Once the file is read, the tree is flattened into one group. Transforms
+   are baked into the primitives where that is exact, and the groups under
+   them are opened up unless they are instanced more than once. */
+   void   Compile();
+   Group* Compile(Group* g);
+   void   Flatten(Group* g, const Matrix3x4* matrix, const Matrix3x4* inverse, std::vector<Object*>& flat);
+   void   Place(Object* object, const Matrix3x4& matrix, const Matrix3x4& inverse, std::vector<Object*>& flat);
+   void   CountPaths(Object* object);
 
    bool GetToken(char token[MAX_PARSER_TOKEN_LENGTH]);
 
@@ -99,7 +129,28 @@ private:
 
    Group* group;
 
+   std::vector<Object*> light;
+
+/* Objects placed by transforms, read once for each distinct block of the
+   file and material, and shared by every transform that repeats them. */
+   struct Prototype
+   {
+      Object* object;
+      Material* material; /* The current material once the block was read. */
+   };
+
+   std::map<std::string, Prototype> prototype;
+
+   std::map<const Object*, int> paths; /* Ways each object is reached, counted up to two. */
+   std::map<Group*, Group*> compiled;   /* Flattened copies of the groups still instanced. */
+
    bool distribution;
+
+   Scheduler* scheduler;
+   BVH::Type bvh_type;
+   double build_time;
+
+   const char* cache_directory;
 };
 
 #endif
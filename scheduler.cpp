@@ -0,0 +1,182 @@
+/* File: scheduler.cpp; Mode: C++; Tab-width: 3; Author: Simon Flannery;      */
+
+#include "scheduler.h"
+
+Scheduler::Scheduler(size_t threads) : num_threads(threads), worker(NULL), task(NULL), generation(0), active(0), quit(false)
+{
+   if (num_threads == 0)
+   {
+      num_threads = std::thread::hardware_concurrency();
+
+      if (num_threads == 0)
+      {
+         num_threads = 1;
+      }
+   }
+
+   worker = new Worker[num_threads];
+
+   for (size_t i = 0; i < num_threads; ++i)
+   {
+      worker[i].range = Pack(0, 0);
+   }
+
+/* Worker zero is the calling thread. */
+   for (size_t i = 1; i < num_threads; ++i)
+   {
+      worker[i].thread = std::thread(&Scheduler::WorkerMain, this, i);
+   }
+}
+
+Scheduler::~Scheduler()
+{
+   {
+      std::lock_guard<std::mutex> guard(lock);
+      quit = true;
+   }
+
+   wake.notify_all();
+
+   for (size_t i = 1; i < num_threads; ++i)
+   {
+      worker[i].thread.join();
+   }
+
+   delete [] worker;
+}
+
+void Scheduler::ParallelFor(size_t count, const Task& t)
+{
+   if (count == 0)
+   {
+      return;
+   }
+
+/* Hand each worker an equal, contiguous slice of the range. */
+   for (size_t i = 0; i < num_threads; ++i)
+   {
+      uint32_t begin = (uint32_t) ((count * i) / num_threads);
+      uint32_t end   = (uint32_t) ((count * (i + 1)) / num_threads);
+
+      worker[i].range = Pack(begin, end);
+   }
+
+   {
+      std::lock_guard<std::mutex> guard(lock);
+      task = &t;
+      active = num_threads - 1;
+      ++generation;
+   }
+
+   wake.notify_all();
+
+   RunTasks(0);
+
+/* A worker only leaves RunTasks once there is nothing left to pop or steal,
+   so when every worker has left, every task has run. */
+   std::unique_lock<std::mutex> guard(lock);
+   done.wait(guard, [this] {   return active == 0;   });
+   task = NULL;
+
+   return;
+}
+
+void Scheduler::WorkerMain(size_t thread)
+{
+   size_t seen = 0;
+
+   for (;;)
+   {
+      {
+         std::unique_lock<std::mutex> guard(lock);
+         wake.wait(guard, [this, seen] {   return quit != false || generation != seen;   });
+
+         if (quit != false)
+         {
+            break;
+         }
+
+         seen = generation;
+      }
+
+      RunTasks(thread);
+
+      {
+         std::lock_guard<std::mutex> guard(lock);
+         --active;
+      }
+
+      done.notify_one();
+   }
+
+   return;
+}
+
+void Scheduler::RunTasks(size_t thread)
+{
+   size_t index = 0;
+
+   while (Pop(thread, index) != false || Steal(thread, index) != false)
+   {
+      (*task)(index, thread);
+   }
+
+   return;
+}
+
+bool Scheduler::Pop(size_t thread, size_t& index)
+{
+   std::atomic<uint64_t>& range = worker[thread].range;
+   uint64_t r = range.load();
+
+   for (;;)
+   {
+      uint32_t begin = (uint32_t) r, end = (uint32_t) (r >> 32);
+
+      if (begin >= end)
+      {
+         return false;
+      }
+
+      if (range.compare_exchange_weak(r, Pack(begin + 1, end)) != false)
+      {
+         index = begin;
+
+         return true;
+      }
+   }
+}
+
+bool Scheduler::Steal(size_t thread, size_t& index)
+{
+   for (size_t i = 1; i < num_threads; ++i)
+   {
+      std::atomic<uint64_t>& range = worker[(thread + i) % num_threads].range;
+      uint64_t r = range.load();
+
+      for (;;)
+      {
+         uint32_t begin = (uint32_t) r, end = (uint32_t) (r >> 32);
+
+         if (begin >= end)
+         {
+            break;
+         }
+
+      /* Take the back half, leaving the victim the tasks it is about to reach. */
+         uint32_t middle = begin + (end - begin) / 2;
+
+         if (range.compare_exchange_weak(r, Pack(begin, middle)) != false)
+         {
+            index = middle;
+
+         /* Our own slice is empty, so no one else is touching it. */
+            worker[thread].range = Pack(middle + 1, end);
+
+            return true;
+         }
+      }
+   }
+
+   return false;
+}
@@ -0,0 +1,60 @@
+/* File: scheduler.h; Mode: C++; Tab-width: 3; Author: Simon Flannery;        */
+
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stdint.h>
+
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+/* A fixed pool of worker threads that share out a range of task indices.
+
+   Each worker owns a contiguous slice of the range and eats it from the
+   front. A worker that runs dry steals the back half of another worker's
+   slice, so neighbouring tasks (tiles) stay on one core while expensive
+   regions of the image are still spread across every core. The calling
+   thread takes part as worker zero. */
+
+class Scheduler
+{
+public:
+   typedef std::function<void (size_t index, size_t thread)> Task;
+
+   Scheduler(size_t threads = 0); /* Zero means one per hardware thread. */
+   ~Scheduler();
+
+   size_t GetNumThreads() const {   return num_threads;   }
+
+   void ParallelFor(size_t count, const Task& t);
+
+private:
+   struct Worker
+   {
+      std::atomic<uint64_t> range; /* [begin, end) packed as two 32-bit halves. */
+      std::thread thread;
+   };
+
+   static uint64_t Pack(uint32_t begin, uint32_t end) {   return ((uint64_t) end << 32) | begin;   }
+
+   void WorkerMain(size_t thread);
+   void RunTasks(size_t thread);
+   bool Pop(size_t thread, size_t& index);
+   bool Steal(size_t thread, size_t& index);
+
+   size_t num_threads;
+   Worker* worker;
+
+   const Task* task;
+
+   std::mutex lock;
+   std::condition_variable wake, done;
+   size_t generation;
+   size_t active;
+   bool quit;
+};
+
+#endif
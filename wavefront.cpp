@@ -0,0 +1,382 @@
+/* File: wavefront.cpp; Mode: C++; Tab-width: 3; Author: Simon Flannery;      */
+
+#include "wavefront.h"
+#include "pathtracer.h"
+#include "scene.h"
+#include "object.h"
+#include "material.h"
+#include "packet.h"
+#include "pdf.h"
+
+Wavefront::Wavefront(Scene* s, size_t bounces, size_t depth, Sampler::Type sampler_type, uint64_t seed, bool p, bool sort, size_t size) : scene(s), max_bounces(bounces), rr_depth(depth), epsilon(EPSILON), packets(p), reorder(sort), capacity(size), count(0)
+{
+/* Only the bounded objects are in the box; origins outside it take the nearest cell. */
+   scene->GetGroup()->GetBounds(box);
+
+   const float cells = (float) (1 << WAVEFRONT_CELL_BITS);
+
+   for (size_t k = 0; k < 3; ++k)
+   {
+      float extent = box.vmax[k] - box.vmin[k];
+
+      scale[k] = extent > 0.0f ? cells / extent : 0.0f;
+   }
+
+   sampler.resize(capacity);
+
+   for (size_t k = 0; k < capacity; ++k)
+   {
+      sampler[k] = Sampler::Create(sampler_type, seed);
+   }
+
+   ray.resize(capacity);
+   hit.resize(capacity);
+   color.resize(capacity);
+   throughput.resize(capacity);
+   pdf.resize(capacity);
+   type.resize(capacity);
+
+   live.reserve(capacity);
+   order.resize(capacity);
+   key.resize(capacity);
+   sorted_key.resize(capacity);
+   shadow.reserve(capacity);
+}
+
+Wavefront::~Wavefront()
+{
+   for (size_t k = 0; k < sampler.size(); ++k)
+   {
+      delete sampler[k];
+   }
+}
+
+void Wavefront::Add(const Ray& r)
+{
+   ray[count] = r;
+   color[count] = color3f();
+   throughput[count] = color3f(1.0f, 1.0f, 1.0f);
+   pdf[count] = 0.0f;
+
+   ++count;
+
+   return;
+}
+
+void Wavefront::Trace()
+{
+   live.resize(count);
+
+   for (size_t k = 0; k < count; ++k)
+   {
+      live[k] = (uint32_t) k;
+   }
+
+   for (size_t bounce = 0; bounce <= max_bounces && live.empty() == false; ++bounce)
+   {
+      if (bounce >= WAVEFRONT_SORT_BOUNCE && reorder != false)
+      {
+         SortRays();
+      }
+
+      Intersect(bounce == 0);
+      Shade(bounce);
+      TraceShadows();
+   }
+
+   live.clear();
+
+   return;
+}
+
+void Wavefront::SortRays()
+{
+/* The Morton code of the origin's cell above the octant of the direction. */
+   const float cells = (float) (1 << WAVEFRONT_CELL_BITS);
+   const size_t n = live.size();
+
+   for (size_t i = 0; i < n; ++i)
+   {
+      const Ray& r = ray[live[i]];
+
+      uint32_t cell[3], octant = 0;
+
+      for (size_t k = 0; k < 3; ++k)
+      {
+         float v = (r.GetOrigin()[k] - box.vmin[k]) * scale[k];
+
+         cell[k] = (uint32_t) (v > 0.0f ? (v < cells - 1.0f ? v : cells - 1.0f) : 0.0f);
+         octant = octant | (r.GetDirection()[k] < 0.0f ? 1u << k : 0u);
+      }
+
+      key[i] = (((ExpandBits(cell[x]) << 2) | (ExpandBits(cell[y]) << 1) | ExpandBits(cell[z])) << 3) | octant;
+   }
+
+/* Least significant byte first, each pass stable. */
+   const uint32_t digits = 256;
+
+   for (uint32_t shift = 0; shift < 3 * WAVEFRONT_CELL_BITS + 3; shift += 8)
+   {
+      uint32_t offset[digits + 1] = {0};
+
+      for (size_t i = 0; i < n; ++i)
+      {
+         ++offset[((key[i] >> shift) & (digits - 1)) + 1];
+      }
+
+      for (uint32_t d = 0; d < digits; ++d)
+      {
+         offset[d + 1] = offset[d + 1] + offset[d];
+      }
+
+      for (size_t i = 0; i < n; ++i)
+      {
+         uint32_t slot = offset[(key[i] >> shift) & (digits - 1)]++;
+
+         sorted_key[slot] = key[i];
+         order[slot] = live[i];
+      }
+
+      key.swap(sorted_key);
+
+      for (size_t i = 0; i < n; ++i)
+      {
+         live[i] = order[i];
+      }
+   }
+
+   return;
+}
+
+void Wavefront::Intersect(bool camera)
+{
+   const Group* group = scene->GetGroup();
+
+   size_t kept = 0;
+
+   if (camera != false && packets != false)
+   {
+   /* The camera rays are still in the order they were added, neighbours
+      together, so they go a packet at a time. */
+      for (size_t first = 0; first < live.size(); first = first + PACKET_SIZE)
+      {
+         const size_t n = live.size() - first < PACKET_SIZE ? live.size() - first : PACKET_SIZE;
+
+         RayPacket packet(&ray[first], n);
+         Hit hits[PACKET_SIZE];
+
+         const uint32_t found = group->IntersectPacket(packet, hits, packet.active, epsilon);
+
+         for (size_t k = 0; k < n; ++k)
+         {
+            const uint32_t path = (uint32_t) (first + k);
+
+            if (((found >> k) & 1) == 0)
+            {
+               color[path] = color[path] + throughput[path] * scene->GetBackground();
+
+               continue;
+            }
+
+            hit[path] = hits[k];
+            live[kept++] = path;
+         }
+      }
+   }
+   else
+   {
+      for (size_t n = 0; n < live.size(); ++n)
+      {
+         const uint32_t k = live[n];
+
+         hit[k] = Hit();
+
+         if (group->Intersect(ray[k], hit[k], epsilon) == false)
+         {
+            color[k] = color[k] + throughput[k] * scene->GetBackground();
+
+            continue;
+         }
+
+         live[kept++] = k;
+      }
+   }
+
+   live.resize(kept);
+
+   return;
+}
+
+void Wavefront::Shade(size_t bounce)
+{
+/* The surface and emission of every hit, and the type of its material. */
+   size_t start[MATERIAL_TYPES + 1] = {0};
+
+   for (size_t n = 0; n < live.size(); ++n)
+   {
+      const uint32_t k = live[n];
+
+      hit[k].Evaluate(ray[k]);
+
+      const Material* material = hit[k].GetMaterial();
+
+      color3f light = material->Emitted(hit[k].GetIntersectionPoint());
+
+      if (pdf[k] > 0.0f && scene->IsLight(hit[k].GetObject()) != false)
+      {
+         MixturePdf lights(scene->GetLights(), scene->GetNumLights(), ray[k].GetOrigin());
+
+         light = light * PowerHeuristic(pdf[k], lights.GetValue(ray[k].GetDirection()));
+      }
+
+      color[k] = color[k] + throughput[k] * light;
+
+      type[k] = (uint8_t) material->GetType();
+      ++start[type[k] + 1];
+   }
+
+/* Counted into queues by material type, keeping the order within each. */
+   for (size_t i = 1; i <= MATERIAL_TYPES; ++i)
+   {
+      start[i] = start[i] + start[i - 1];
+   }
+
+   for (size_t n = 0; n < live.size(); ++n)
+   {
+      order[start[type[live[n]]]++] = live[n];
+   }
+
+/* Each queue in turn, scattering as PathTracer::TracePath does. A light
+   sample only queues its shadow ray, which is traced once the whole pool
+   has been shaded. */
+   const size_t shaded = live.size();
+
+   live.clear();
+
+   for (size_t n = 0; n < shaded; ++n)
+   {
+      const uint32_t k = order[n];
+
+      const Hit& h = hit[k];
+      const Material* material = h.GetMaterial();
+      const point3f point = h.GetIntersectionPoint();
+
+      Sampler& s = *sampler[k];
+
+      vector3f scattered;
+      if (material->Scatter(ray[k], h, scattered, s) == false)
+      {
+         continue;
+      }
+
+      throughput[k] = throughput[k] * material->GetColor(point);
+
+      if (material->IsSpecular(point) != false)
+      {
+         pdf[k] = material->ScatterPdf(ray[k], h, scattered);
+
+         if (pdf[k] > 0.0f)
+         {
+            SampleLight(k);
+         }
+
+         ray[k] = Ray(point, scattered, ray[k].GetTime());
+      }
+      else
+      {
+         vector3f normal = h.GetNormal();
+
+         if (vector3f::Dot(normal, ray[k].GetDirection()) > 0.0f)
+         {
+            normal.Negate();
+         }
+
+         SampleLight(k);
+
+         CosinePdf cosine(normal);
+         ray[k] = Ray(point, cosine.Generate(s), ray[k].GetTime());
+
+         pdf[k] = cosine.GetValue(ray[k].GetDirection());
+      }
+
+      if (bounce + 1 >= rr_depth)
+      {
+         float survive = (float) fmax(throughput[k][r], fmax(throughput[k][g], throughput[k][b]));
+
+         if (survive < 1.0f)
+         {
+            if (s.Get1D() >= survive)
+            {
+               continue;
+            }
+
+            throughput[k] = throughput[k] / survive;
+         }
+      }
+
+      live.push_back(k);
+   }
+
+   return;
+}
+
+void Wavefront::SampleLight(uint32_t k)
+{
+/* PathTracer::SampleLights up to its shadow ray. */
+   if (scene->GetNumLights() == 0)
+   {
+      return;
+   }
+
+   const Hit& h = hit[k];
+   const point3f point = h.GetIntersectionPoint();
+
+   MixturePdf lights(scene->GetLights(), scene->GetNumLights(), point);
+
+   vector3f direction = lights.Generate(*sampler[k]);
+
+   float scatter_pdf = h.GetMaterial()->ScatterPdf(ray[k], h, direction);
+
+   if (scatter_pdf <= 0.0f)
+   {
+      return;
+   }
+
+   float light_pdf = lights.GetValue(direction);
+
+   if (light_pdf <= 0.0f)
+   {
+      return;
+   }
+
+   Shadow light = {k, Ray(point, direction, ray[k].GetTime()), throughput[k], scatter_pdf / light_pdf * PowerHeuristic(light_pdf, scatter_pdf)};
+
+   shadow.push_back(light);
+
+   return;
+}
+
+void Wavefront::TraceShadows()
+{
+   const Group* group = scene->GetGroup();
+
+   for (size_t n = 0; n < shadow.size(); ++n)
+   {
+      const Shadow& light = shadow[n];
+
+      Hit h;
+
+      if (group->Intersect(light.ray, h, epsilon) != false && scene->IsLight(h.GetObject()) != false)
+      {
+         h.Evaluate(light.ray);
+
+         color3f emitted = h.GetMaterial()->Emitted(h.GetIntersectionPoint());
+
+         color[light.path] = color[light.path] + light.throughput * (emitted * light.weight);
+      }
+   }
+
+   shadow.clear();
+
+   return;
+}
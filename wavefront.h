@@ -0,0 +1,112 @@
+/* File: wavefront.h; Mode: C++; Tab-width: 3; Author: Simon Flannery;        */
+
+#ifndef WAVEFRONT_H
+#define WAVEFRONT_H
+
+#include <stdint.h>
+
+#include <vector>
+
+#include "math.h"
+#include "hit.h"
+#include "ray.h"
+#include "sampler.h"
+
+#define WAVEFRONT_PATHS 4096 /* Paths in flight in one pool. */
+#define WAVEFRONT_CELL_BITS 8 /* Bits of each axis of the cell in a ray's sort key. */
+#define WAVEFRONT_SORT_BOUNCE 2 /* The first bounce whose rays are sorted. */
+
+class Scene;
+
+/* The path tracer turned inside out. Rather than follow one path from the
+   camera to its end, a pool of paths takes each bounce together in stages:
+   every ray is intersected, then every hit shaded, queued by the type of
+   its material, then every shadow ray traced. Each stage is a short loop
+   over the fields it needs, kept an array a field across the pool, and
+   the shading loops call the same few functions over and over.
+
+   When asked to, from WAVEFRONT_SORT_BOUNCE on, the rays are sorted by the
+   cell they start in and then by the octant they head into, so rays traced
+   in turn visit much the same nodes and primitives while these are still
+   in the cache. Until then they start from neighbouring pixels' hits in the
+   order the tile gave them, which sorting only makes worse. The larger the
+   pool the better the rays sort, at the cost of memory and of longer waits
+   for each tile's last paths.
+
+   Every path keeps a sampler of its own and asks it for the same numbers in
+   the same order as PathTracer::TracePath does, so the colours are the ones
+   that gives. */
+
+class Wavefront
+{
+public:
+   Wavefront(Scene* s, size_t max_bounces, size_t rr_depth, Sampler::Type type, uint64_t seed, bool packets = true, bool reorder = false, size_t capacity = WAVEFRONT_PATHS);
+   ~Wavefront();
+
+   size_t GetCapacity() const {   return capacity;   }
+   size_t GetCount()    const {   return count;      }
+   bool IsFull()        const {   return count == capacity;   }
+
+/* The sampler of the next path added, to be started on its pixel sample
+   and to pick its camera ray before Add is called. */
+   Sampler& GetNextSampler() {   return *sampler[count];   }
+
+   void Add(const Ray& ray);
+
+/* Follows every path added to its end; GetColor(k) then gives what the k-th
+   brought back, until Clear. */
+   void Trace();
+
+   const color3f& GetColor(size_t k) const {   return color[k];   }
+
+   void Clear() {   count = 0;   }
+
+private:
+   Wavefront(const Wavefront&);
+   Wavefront& operator = (const Wavefront&);
+
+   void SortRays();
+   void Intersect(bool camera);
+   void Shade(size_t bounce);
+   void SampleLight(uint32_t k);
+   void TraceShadows();
+
+   Scene* scene;
+   size_t max_bounces;
+   size_t rr_depth;
+   float epsilon;
+   bool packets;
+   bool reorder;
+
+/* The cells of the sort keys divide the scene's bounds. */
+   AABox box;
+   vector3f scale;
+
+   size_t capacity, count;
+
+/* A path's state, by its index. */
+   std::vector<Sampler*> sampler;
+   std::vector<Ray> ray;
+   std::vector<Hit> hit;
+   std::vector<color3f> color, throughput;
+   std::vector<float> pdf;
+   std::vector<uint8_t> type;
+
+/* The indices of the paths still going, and of those to shade, by material type. */
+   std::vector<uint32_t> live, order;
+   std::vector<uint32_t> key, sorted_key;
+
+/* Light samples waiting on their shadow ray: the path, the ray, the
+   throughput at the time and the weight of the light, if it is reached. */
+   struct Shadow
+   {
+      uint32_t path;
+      Ray ray;
+      color3f throughput;
+      float weight;
+   };
+
+   std::vector<Shadow> shadow;
+};
+
+#endif